@@ -0,0 +1,485 @@
+/*
+ pycann - Neural network library
+ A Python/C hybrid for fast neural networks in Python
+ Copyright (C) 2010  Janosch Gräf <janosch.graef@gmx.net>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Benchmark of the step kernel. Networks are generated in-process for every
+// combination of the swept parameters, stepped a few times to warm up and
+// then timed over some repetitions. Results are written as JSON or CSV.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "pycann.h"
+
+// Maximum number of values of a swept parameter
+#define BENCHMARK_MAX_VALUES 32
+
+// Activation function settings, "mix" splits the non-input neurons into
+// blocks of all activation functions
+typedef enum {
+  BENCHMARK_ACTIVATION_STEP   = 0,
+  BENCHMARK_ACTIVATION_EXP    = 1,
+  BENCHMARK_ACTIVATION_APPROX = 2,
+  BENCHMARK_ACTIVATION_LINEAR = 3,
+  BENCHMARK_ACTIVATION_MIX    = 4
+} benchmark_activation_t;
+
+static const char *benchmark_activation_names[] = {"step", "exp", "approx", "linear", "mix"};
+
+// List of values of a swept parameter
+typedef struct {
+  unsigned int n;
+  double values[BENCHMARK_MAX_VALUES];
+} benchmark_list_t;
+
+typedef struct {
+  benchmark_list_t sizes;
+  benchmark_list_t connection_rates;
+  benchmark_list_t learning;
+  benchmark_list_t activations;
+  benchmark_list_t threads;
+  benchmark_list_t steps;
+  unsigned int warmup;
+  unsigned int repetitions;
+  unsigned int seed;
+  const char *format;
+  const char *output;
+  const char *kernel;
+  unsigned int verbose;
+} benchmark_options_t;
+
+// Result of a configuration, times are in seconds
+typedef struct {
+  unsigned int size;
+  double connection_rate;
+  unsigned int learning;
+  benchmark_activation_t activation;
+  unsigned int threads;
+  unsigned int steps;
+
+  unsigned int synapses;
+  size_t memory_usage;
+  double create_time;
+  double load_time;
+  double step_time_mean; // per step
+  double step_time_min;
+  double step_time_stddev;
+  double steps_per_second;
+  double synapse_updates_per_second;
+} benchmark_result_t;
+
+// Monotonic time in seconds
+static double benchmark_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec+(double)ts.tv_nsec*1e-9;
+}
+
+// Parse comma separated list of numbers (or activation function names)
+static int benchmark_parse_list(benchmark_list_t *list, const char *s, unsigned int activations) {
+  char *end;
+  unsigned int i;
+
+  list->n = 0;
+  while (*s!='\0') {
+    if (list->n==BENCHMARK_MAX_VALUES) {
+      return -1;
+    }
+    if (activations) {
+      for (i=0; i<=BENCHMARK_ACTIVATION_MIX; i=i+1) {
+        if (strncmp(s, benchmark_activation_names[i], strlen(benchmark_activation_names[i]))==0) {
+          break;
+        }
+      }
+      if (i>BENCHMARK_ACTIVATION_MIX) {
+        return -1;
+      }
+      list->values[list->n] = i;
+      end = (char*)s+strlen(benchmark_activation_names[i]);
+    }
+    else {
+      list->values[list->n] = strtod(s, &end);
+      if (end==s) {
+        return -1;
+      }
+    }
+    list->n = list->n+1;
+    if (*end==',') {
+      end = end+1;
+    }
+    else if (*end!='\0') {
+      return -1;
+    }
+    s = end;
+  }
+  return list->n>0?0:-1;
+}
+
+// Generate network (like the test networks of the old benchmark.py: a third
+// of the neurons are inputs, no outputs)
+static pycann_t *benchmark_create(const benchmark_options_t *options, benchmark_result_t *result) {
+  pycann_t *net;
+  pycann_float_t gamma[4] = {0.01, 0.0, 0.0, -0.001};
+  pycann_float_t w;
+  unsigned int i, num_inputs, block;
+
+  num_inputs = result->size/3;
+  net = pycann_new(result->size, num_inputs, 0, result->threads);
+  if (net==NULL) {
+    return NULL;
+  }
+  pycann_set_seed(net, options->seed);
+  pycann_set_random_weights(net, result->connection_rate);
+
+  block = (result->size-num_inputs)/4+1;
+  for (i=num_inputs; i<result->size; i=i+1) {
+    switch (result->activation) {
+    case BENCHMARK_ACTIVATION_STEP:
+      pycann_set_activation_function(net, i, PYCANN_SIGMOID_STEP);
+      break;
+    case BENCHMARK_ACTIVATION_EXP:
+      pycann_set_activation_function(net, i, PYCANN_SIGMOID_EXP);
+      break;
+    case BENCHMARK_ACTIVATION_APPROX:
+      pycann_set_activation_function(net, i, PYCANN_SIGMOID_APPROX);
+      break;
+    case BENCHMARK_ACTIVATION_LINEAR:
+      pycann_set_activation_function(net, i, PYCANN_LINEAR);
+      break;
+    case BENCHMARK_ACTIVATION_MIX:
+      pycann_set_activation_function(net, i, PYCANN_SIGMOID_STEP+(i-num_inputs)/block);
+      break;
+    }
+    pycann_set_threshold(net, i, (pycann_float_t)rand()/(pycann_float_t)RAND_MAX-0.5);
+  }
+
+  if (result->learning) {
+    // 95% of the neurons have a modularity neuron
+    pycann_set_learning_rate(net, 0.01);
+    for (i=0; i<result->size; i=i+1) {
+      w = 2.0*(pycann_float_t)rand()/(pycann_float_t)RAND_MAX-1.0;
+      if (fabs(w)>=0.05) {
+        pycann_set_gamma(net, i, gamma);
+        pycann_set_mod(net, i, rand()%result->size, w);
+      }
+    }
+  }
+
+  for (i=0; i<num_inputs; i=i+1) {
+    pycann_set_activation(net, i, (pycann_float_t)(rand()&1));
+  }
+  return net;
+}
+
+// Time loading the network from a file
+static double benchmark_load(pycann_t *net, const benchmark_result_t *result) {
+  char path[] = "/tmp/pycann-benchmark-XXXXXX";
+  pycann_t *loaded;
+  double t;
+  int fd;
+
+  fd = mkstemp(path);
+  if (fd==-1) {
+    return -1.0;
+  }
+  close(fd);
+  t = -1.0;
+  if (pycann_save_file(path, net)==0) {
+    t = benchmark_now();
+    loaded = pycann_load_file(path, result->threads);
+    t = benchmark_now()-t;
+    if (loaded==NULL) {
+      t = -1.0;
+    }
+    else {
+      pycann_del(loaded);
+    }
+  }
+  unlink(path);
+  return t;
+}
+
+// Benchmark a configuration
+static int benchmark_run(const benchmark_options_t *options, benchmark_result_t *result) {
+  pycann_t *net;
+  double t, sum, sum2;
+  unsigned int i;
+
+  srand(options->seed);
+  t = benchmark_now();
+  net = benchmark_create(options, result);
+  result->create_time = benchmark_now()-t;
+  if (net==NULL) {
+    return -1;
+  }
+  result->load_time = benchmark_load(net, result);
+  result->synapses = pycann_get_num_synapses(net);
+
+  for (i=0; i<options->warmup; i=i+1) {
+    pycann_step(net, result->steps);
+  }
+
+  sum = 0.0;
+  sum2 = 0.0;
+  result->step_time_min = HUGE_VAL;
+  for (i=0; i<options->repetitions; i=i+1) {
+    t = benchmark_now();
+    pycann_step(net, result->steps);
+    t = (benchmark_now()-t)/result->steps;
+    sum = sum+t;
+    sum2 = sum2+t*t;
+    if (t<result->step_time_min) {
+      result->step_time_min = t;
+    }
+  }
+  result->step_time_mean = sum/options->repetitions;
+  result->step_time_stddev = sqrt(fmax(sum2/options->repetitions-result->step_time_mean*result->step_time_mean, 0.0));
+  result->steps_per_second = 1.0/result->step_time_mean;
+  result->synapse_updates_per_second = result->steps_per_second*result->synapses;
+  // includes memory allocated while stepping (thread partitions, runs)
+  result->memory_usage = pycann_get_memory_usage(net);
+
+  pycann_del(net);
+  return 0;
+}
+
+static void benchmark_print_header(FILE *f, const benchmark_options_t *options) {
+  if (strcmp(options->format, "json")==0) {
+    fprintf(f, "{\n  \"kernel\": \"%s\",\n  \"threading\": %s,\n  \"warmup\": %u,\n  \"repetitions\": %u,\n  \"seed\": %u,\n  \"results\": [",
+            pycann_get_kernel(), pycann_is_threading_enabled()?"true":"false", options->warmup, options->repetitions, options->seed);
+  }
+  else {
+    fprintf(f, "kernel,threading,size,connection_rate,learning,activation,threads,steps,synapses,memory_usage,"
+               "create_time,load_time,step_time_mean,step_time_min,step_time_stddev,steps_per_second,synapse_updates_per_second\n");
+  }
+}
+
+static void benchmark_print_result(FILE *f, const benchmark_options_t *options, const benchmark_result_t *r, unsigned int first) {
+  if (strcmp(options->format, "json")==0) {
+    fprintf(f, "%s\n    {\"size\": %u, \"connection_rate\": %g, \"learning\": %s, \"activation\": \"%s\", \"threads\": %u, \"steps\": %u, "
+               "\"synapses\": %u, \"memory_usage\": %zu, \"create_time\": %.9g, \"load_time\": %.9g, "
+               "\"step_time_mean\": %.9g, \"step_time_min\": %.9g, \"step_time_stddev\": %.9g, "
+               "\"steps_per_second\": %.9g, \"synapse_updates_per_second\": %.9g}",
+            first?"":",", r->size, r->connection_rate, r->learning?"true":"false", benchmark_activation_names[r->activation], r->threads, r->steps,
+            r->synapses, r->memory_usage, r->create_time, r->load_time,
+            r->step_time_mean, r->step_time_min, r->step_time_stddev,
+            r->steps_per_second, r->synapse_updates_per_second);
+  }
+  else {
+    fprintf(f, "%s,%u,%u,%g,%u,%s,%u,%u,%u,%zu,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n",
+            pycann_get_kernel(), pycann_is_threading_enabled(), r->size, r->connection_rate, r->learning, benchmark_activation_names[r->activation], r->threads, r->steps,
+            r->synapses, r->memory_usage, r->create_time, r->load_time,
+            r->step_time_mean, r->step_time_min, r->step_time_stddev,
+            r->steps_per_second, r->synapse_updates_per_second);
+  }
+  fflush(f);
+}
+
+static void benchmark_print_footer(FILE *f, const benchmark_options_t *options) {
+  if (strcmp(options->format, "json")==0) {
+    fprintf(f, "\n  ]\n}\n");
+  }
+}
+
+static void benchmark_usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [OPTION]...\n"
+          "Benchmark pycann's step kernel on generated networks.\n"
+          "Lists are comma separated, every combination of their values is run.\n"
+          "\n"
+          "  -n, --sizes=LIST         numbers of neurons (default: 100,300,1000,3000)\n"
+          "  -c, --connrates=LIST     connection rates (default: 0.75)\n"
+          "  -l, --learning=LIST      0 (no learning) and/or 1 (Hebbian learning) (default: 0)\n"
+          "  -a, --activations=LIST   step, exp, approx, linear or mix (default: approx)\n"
+          "  -t, --threads=LIST       numbers of threads (default: 1)\n"
+          "  -s, --steps=LIST         steps per timed call (default: 10)\n"
+          "  -w, --warmup=N           untimed calls before timing (default: 2)\n"
+          "  -r, --repetitions=N      timed calls (default: 10)\n"
+          "  -S, --seed=N             seed of the generated networks (default: 1)\n"
+          "  -k, --kernel=NAME        kernels to use (scalar, sse2, avx2, avx512)\n"
+          "  -f, --format=FORMAT      json or csv (default: json)\n"
+          "  -o, --output=FILE        write results to FILE instead of stdout\n"
+          "  -v, --verbose            print progress to stderr\n"
+          "  -h, --help               show this help\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+    {"sizes",       required_argument, NULL, 'n'},
+    {"connrates",   required_argument, NULL, 'c'},
+    {"learning",    required_argument, NULL, 'l'},
+    {"activations", required_argument, NULL, 'a'},
+    {"threads",     required_argument, NULL, 't'},
+    {"steps",       required_argument, NULL, 's'},
+    {"warmup",      required_argument, NULL, 'w'},
+    {"repetitions", required_argument, NULL, 'r'},
+    {"seed",        required_argument, NULL, 'S'},
+    {"kernel",      required_argument, NULL, 'k'},
+    {"format",      required_argument, NULL, 'f'},
+    {"output",      required_argument, NULL, 'o'},
+    {"verbose",     no_argument,       NULL, 'v'},
+    {"help",        no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  benchmark_options_t options;
+  benchmark_result_t result;
+  unsigned int i_size, i_rate, i_learning, i_activation, i_threads, i_steps, first;
+  FILE *f;
+  int c, error;
+
+  memset(&options, 0, sizeof(options));
+  benchmark_parse_list(&options.sizes, "100,300,1000,3000", 0);
+  benchmark_parse_list(&options.connection_rates, "0.75", 0);
+  benchmark_parse_list(&options.learning, "0", 0);
+  benchmark_parse_list(&options.activations, "approx", 1);
+  benchmark_parse_list(&options.threads, "1", 0);
+  benchmark_parse_list(&options.steps, "10", 0);
+  options.warmup = 2;
+  options.repetitions = 10;
+  options.seed = 1;
+  options.format = "json";
+
+  error = 0;
+  while ((c = getopt_long(argc, argv, "n:c:l:a:t:s:w:r:S:k:f:o:vh", long_options, NULL))!=-1) {
+    switch (c) {
+    case 'n':
+      error = benchmark_parse_list(&options.sizes, optarg, 0);
+      break;
+    case 'c':
+      error = benchmark_parse_list(&options.connection_rates, optarg, 0);
+      break;
+    case 'l':
+      error = benchmark_parse_list(&options.learning, optarg, 0);
+      break;
+    case 'a':
+      error = benchmark_parse_list(&options.activations, optarg, 1);
+      break;
+    case 't':
+      error = benchmark_parse_list(&options.threads, optarg, 0);
+      break;
+    case 's':
+      error = benchmark_parse_list(&options.steps, optarg, 0);
+      break;
+    case 'w':
+      options.warmup = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      options.repetitions = strtoul(optarg, NULL, 10);
+      break;
+    case 'S':
+      options.seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'k':
+      options.kernel = optarg;
+      break;
+    case 'f':
+      options.format = optarg;
+      break;
+    case 'o':
+      options.output = optarg;
+      break;
+    case 'v':
+      options.verbose = 1;
+      break;
+    case 'h':
+      benchmark_usage(argv[0]);
+      return 0;
+    default:
+      benchmark_usage(argv[0]);
+      return 1;
+    }
+    if (error!=0) {
+      fprintf(stderr, "%s: invalid list: %s\n", argv[0], optarg);
+      return 1;
+    }
+  }
+  if (strcmp(options.format, "json")!=0 && strcmp(options.format, "csv")!=0) {
+    fprintf(stderr, "%s: unknown format: %s\n", argv[0], options.format);
+    return 1;
+  }
+  if (options.repetitions==0) {
+    options.repetitions = 1;
+  }
+  if (options.kernel!=NULL && pycann_set_kernel(options.kernel)!=0) {
+    fprintf(stderr, "%s: %s", argv[0], pycann_get_error());
+    return 1;
+  }
+  if (!pycann_is_threading_enabled()) {
+    fprintf(stderr, "%s: warning: threading is disabled, all networks use 1 thread\n", argv[0]);
+  }
+
+  if (options.output!=NULL) {
+    f = fopen(options.output, "w");
+    if (f==NULL) {
+      perror(options.output);
+      return 1;
+    }
+  }
+  else {
+    f = stdout;
+  }
+
+  benchmark_print_header(f, &options);
+  first = 1;
+  for (i_size=0; i_size<options.sizes.n; i_size=i_size+1) {
+    for (i_rate=0; i_rate<options.connection_rates.n; i_rate=i_rate+1) {
+      for (i_learning=0; i_learning<options.learning.n; i_learning=i_learning+1) {
+        for (i_activation=0; i_activation<options.activations.n; i_activation=i_activation+1) {
+          for (i_threads=0; i_threads<options.threads.n; i_threads=i_threads+1) {
+            for (i_steps=0; i_steps<options.steps.n; i_steps=i_steps+1) {
+              memset(&result, 0, sizeof(result));
+              result.size = options.sizes.values[i_size];
+              result.connection_rate = options.connection_rates.values[i_rate];
+              result.learning = options.learning.values[i_learning]!=0.0;
+              result.activation = options.activations.values[i_activation];
+              result.threads = options.threads.values[i_threads];
+              result.steps = options.steps.values[i_steps];
+              if (result.size==0 || result.steps==0) {
+                continue;
+              }
+              if (options.verbose) {
+                fprintf(stderr, "size=%u connrate=%g learning=%u activation=%s threads=%u steps=%u\n",
+                        result.size, result.connection_rate, result.learning, benchmark_activation_names[result.activation], result.threads, result.steps);
+              }
+              if (benchmark_run(&options, &result)!=0) {
+                fprintf(stderr, "%s: %s", argv[0], pycann_get_error());
+                pycann_reset_error();
+                continue;
+              }
+              benchmark_print_result(f, &options, &result, first);
+              first = 0;
+            }
+          }
+        }
+      }
+    }
+  }
+  benchmark_print_footer(f, &options);
+
+  if (f!=stdout) {
+    fclose(f);
+  }
+  return 0;
+}
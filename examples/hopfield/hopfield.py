@@ -30,3 +30,8 @@ class Hopfield(Network):
 
     def set_input(self, v):
         self.set_inputs(*v)
+
+    def settle(self, max_steps = 100):
+        """ Steps until the state doesn't change anymore (or max_steps steps
+            are done), returns the number of steps """
+        return self.step_until_stable(max_steps)[0]
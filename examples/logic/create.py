@@ -33,14 +33,14 @@ def logic_xor():
 print("Creating OR gate")
 gate = logic_or()
 gate.save("or.pcn")
-gate.save("or.rnn", "NXT")
+gate.save("or.rnn", "NXT_Q15")
 
 print("Creating AND gate")
 gate = logic_and()
 gate.save("and.pcn")
-gate.save("and.rnn", "NXT")
+gate.save("and.rnn", "NXT_Q15")
 
 print("Creating XOR gate")
 gate = logic_xor()
 gate.save("xor.pcn")
-gate.save("xor.rnn", "NXT")
+gate.save("xor.rnn", "NXT_Q15")
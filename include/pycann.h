@@ -23,6 +23,9 @@
 // Define this to use multi-threading
 //#define PYCANN_THREADING
 
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint32_t, uint64_t */
+
 #ifdef PYCANN_THREADING
 #include <pthread.h>
 #endif /* PYCANN_THREADING */
@@ -32,27 +35,71 @@
 #endif /* PYCANN_VISUALIZATION */
 
 // Macro for easy access to weights
-#define PYCANN_WEIGHT(net, a, b) ((net)->weights[(a)*(net)->size+(b)])
+#define PYCANN_WEIGHT(net, a, b) ((net)->weights[(size_t)(a)*(net)->stride+(b)])
 
 // Macro for easy access to gammas
 #define PYCANN_GAMMA(net, a, b) ((net)->gammas[(a)*4+(b)])
 
-// Version of embedded format
+// Versions of embedded format (dense floats, sparse fixed-point)
 #define PYCANN_EMBEDDED_VERSION 1
+#define PYCANN_EMBEDDED_VERSION_FIXED 2
+
+// Largest fixed-point scale of embedded weights (2^PYCANN_EMBEDDED_MAX_SHIFT)
+#define PYCANN_EMBEDDED_MAX_SHIFT 24
+
+// Fixed-point scale of activations on the device (PYCANN_ONE_BITS of pycann.nxh)
+#define PYCANN_EMBEDDED_ONE_BITS 14
 
 
 // Type for embedded file formats
-enum {
-  PYCANN_EMBEDDED_NONE = 0, // Invalid embedded format
-  PYCANN_EMBEDDED_NXT  = 1  // embedded format for LEGO Mindstorms NXT
+typedef enum {
+  PYCANN_EMBEDDED_NONE    = 0, // Invalid embedded format
+  PYCANN_EMBEDDED_NXT     = 1, // embedded format for LEGO Mindstorms NXT
+  PYCANN_EMBEDDED_NXT_Q15 = 2, // NXT, sparse rows of Q15 weights (version 2)
+  PYCANN_EMBEDDED_NXT_Q7  = 3  // NXT, sparse rows of Q7 weights (version 2)
 } pycann_embedded_format_t;
 
 // pycann floating point type
 typedef float pycann_float_t;
 
+// Weight storage engines
+typedef enum {
+  PYCANN_STORAGE_DENSE  = 0, // dense size*size matrix (see PYCANN_WEIGHT)
+  PYCANN_STORAGE_SPARSE = 1, // compressed sparse rows (CSR), only non-zero synapses are stored
+  // Quantized dense storage, these are for inference only: weights are
+  // converted to floats while propagating and there's no Hebbian learning
+  PYCANN_STORAGE_FP16   = 2, // IEEE half precision
+  PYCANN_STORAGE_BF16   = 3, // bfloat16 (upper half of a float)
+  PYCANN_STORAGE_INT8   = 4  // signed 8 bit with a scale per row
+} pycann_storage_t;
+
+// Flags for pycann_new_ex and pycann_load_file_ex
+#define PYCANN_NEW_SPARSE      0x0001 // use sparse weight storage
+#define PYCANN_NEW_HUGEPAGES   0x0004 // back the network's buffers with huge pages (if available)
+#define PYCANN_NEW_SHARED_POOL 0x0008 // step on the process-wide thread pool (a thread per CPU) instead of own threads
+#define PYCANN_NEW_PIN_THREADS 0x0010 // pin worker threads to CPUs (see pycann_get_thread_placement)
+#define PYCANN_NEW_FIRST_TOUCH 0x0020 // let every thread touch its dense weight rows first, which puts them on its NUMA node
+// NOTE: With PYCANN_NEW_FIRST_TOUCH the arena is always mapped (never taken
+//       from the heap), and dense weights of loaded v4 files are copied out
+//       of the file mapping. It has no effect on sparse or quantized weights
+//       and without PYCANN_THREADING.
+
+// Flags for pycann_load_file_ex
+#define PYCANN_LOAD_VERIFY 0x0002 // verify checksum of v4 files (reads the whole file, the structure is always checked)
+
+// Alignment of network buffers in bytes, dense rows are padded to multiples
+// of it (one cache line)
+#define PYCANN_ALIGNMENT 64
+
+// Size of huge pages requested with PYCANN_NEW_HUGEPAGES
+#define PYCANN_HUGE_PAGE_SIZE (2*1024*1024)
+
 // Stepness of exponential sigmoid function
 #define PYCANN_SIGMOID_BETA 10.0
 
+// Maximum absolute error of PYCANN_SIGMOID_APPROX against PYCANN_SIGMOID_EXP
+#define PYCANN_SIGMOID_APPROX_ERROR 1e-6
+
 // activation functions
 typedef enum {
   PYCANN_INVALID_ACTIVATION_FUNCTION = 0,
@@ -64,14 +111,200 @@ typedef enum {
 
 typedef struct pycann_struct pycann_t;
 
+// Run of neurons (first upto (excluding) last) sharing an activation function
+typedef struct {
+  unsigned int first;
+  unsigned int last;
+  pycann_activation_function_t activation_function;
+} pycann_run_t;
+
+// Default number of spins before an idle thread parks
+#define PYCANN_DEFAULT_SPIN_COUNT 4096
+
+// Default number of chunks per thread for dynamic scheduling
+#define PYCANN_DEFAULT_CHUNKS_PER_THREAD 8
+
+// Cost of a row in addition to its synapses (see pycann_get_thread_work)
+#define PYCANN_ROW_OVERHEAD 8
+
+// Least cost per thread of a network on the shared pool, smaller networks
+// step on fewer threads and leave the other workers to other networks
+#define PYCANN_SHARED_POOL_GRAIN 65536
+
+// Batch stepping: rows per tile and columns per cache block
+#define PYCANN_BATCH_TILE 16
+#define PYCANN_BATCH_BLOCK 512
+
+// Synchronous stepping: at most PYCANN_STEP_TILE rows per tile (fewer if
+// a tile's weights don't fit into half the L2 cache, PYCANN_STEP_CACHE bytes
+// if its size is unknown) and columns per cache block
+#define PYCANN_STEP_TILE 64
+#define PYCANN_STEP_CACHE (1024*1024)
+#define PYCANN_STEP_BLOCK 1024
+
+// Distributions of random weights (see pycann_set_random_weights_ex)
+typedef enum {
+  PYCANN_RANDOM_UNIFORM = 0, // uniform in (-scale, scale)
+  PYCANN_RANDOM_NORMAL  = 1  // normal with mean 0 and standard deviation scale
+} pycann_distribution_t;
+
+// Flags of pycann_set_random_weights_ex
+#define PYCANN_RANDOM_FAN_IN 0x0001 // divide scale by sqrt(synapses per neuron)
+
+// Scheduling of threads
+typedef enum {
+  PYCANN_SCHEDULE_STATIC  = 0, // every thread steps a fixed partition of about the same cost
+  PYCANN_SCHEDULE_DYNAMIC = 1  // threads grab chunks of about the same cost until none are left
+} pycann_schedule_t;
+
+// Update order of neurons in a step
+typedef enum {
+  PYCANN_UPDATE_ASYNC = 0, // neurons are updated in place, in order (threads: in any order)
+  PYCANN_UPDATE_SYNC  = 1  // all neurons are updated from the previous step's activations (deterministic)
+} pycann_update_t;
+
+// Propagation of activations in a step
+typedef enum {
+  PYCANN_PROPAGATION_FULL  = 0, // every neuron's net input is computed from all its synapses
+  PYCANN_PROPAGATION_DELTA = 1  // net inputs are kept and only changed by neurons whose activation changed
+} pycann_propagation_t;
+// NOTE: Delta propagation keeps a transposed copy of the weights, so while
+//       the weights are handed out in place (pycann_get_weights_buffer) steps
+//       fall back to full propagation (until the storage engine is changed).
+
+// Steps after which delta propagation recomputes all net inputs
+#define PYCANN_DELTA_REFRESH 256
+
+// Delta propagation recomputes all net inputs if more than 1/PYCANN_DELTA_DENSITY
+// of the neurons changed since the last step
+#define PYCANN_DELTA_DENSITY 4
+
+// Number of buckets of the step latency histogram (see pycann_stats_t)
+#define PYCANN_STATS_BUCKETS 32
+
+// Neurons with at least this activation after a step count as fired
+#define PYCANN_STATS_FIRE_THRESHOLD 0.5
+
+// Statistics of a network's steps (see pycann_get_stats), collected while
+// enabled with pycann_set_stats_enabled. Times are in nanoseconds.
+typedef struct {
+  unsigned long steps;          // steps done by pycann_step and pycann_run_sequence
+  uint64_t step_time;           // total time of these steps
+  // latency[0] counts steps taking less than 1 microsecond, latency[k] steps
+  // taking 2^(k-1) upto (excluding) 2^k microseconds, the last bucket all longer ones
+  unsigned long latency[PYCANN_STATS_BUCKETS];
+  unsigned long neurons_fired;  // neuron updates with activation>=PYCANN_STATS_FIRE_THRESHOLD
+  unsigned long weight_updates; // synapses changed by the Hebbian rule
+} pycann_stats_t;
+
+// Statistics of a thread (see pycann_get_thread_stats)
+typedef struct {
+  uint64_t busy_time;           // stepping neurons
+  uint64_t wait_time;           // waiting for other threads at the barrier between steps
+  uint64_t idle_time;           // between steps of different calls
+  unsigned long neurons_fired;
+  unsigned long weight_updates;
+} pycann_thread_stats_t;
+
+// Sequence driven by pycann_run_sequence
+typedef struct {
+  const pycann_float_t *inputs; // a row of num_inputs values per input
+  unsigned int steps;           // steps per row
+  pycann_float_t *outputs;      // a row of num_outputs values per input (or NULL)
+  pycann_float_t *trace;        // a row of size activations per input (or NULL)
+} pycann_sequence_t;
+
+// Convergence check of pycann_step_until_stable
+typedef struct {
+  pycann_float_t tolerance; // largest change of an activation in a stable step
+  unsigned int steps;       // steps done (set when stepping ends)
+  int stable;               // set if the last step was stable
+} pycann_stable_t;
+
+// Snapshot of a network's parameters for copy-on-write clones (see
+// pycann_clone): a v4 file in memory, referenced by every network whose
+// gammas, weights and thresholds still match it
+typedef struct {
+  int fd;
+  size_t length;
+  unsigned int refs;
+} pycann_snapshot_t;
+
 #ifdef PYCANN_THREADING
+typedef struct pycann_pool_struct pycann_pool_t;
+typedef struct pycann_pool_worker_struct pycann_pool_worker_t;
 typedef struct pycann_thread_struct pycann_thread_t;
 
-struct pycann_thread_struct {
+// Job run by all threads of a pool ('thread' is 0 for the submitting thread)
+typedef void (*pycann_pool_job_t)(pycann_pool_t *pool, unsigned int thread, void *arg);
+
+struct pycann_pool_worker_struct {
   pthread_t thread;
-  pycann_neuron_t first_neuron;
-  pycann_neuron_t last_neuron; // actually this is the neuron after the last one
-  unsigned int steps;
+  pycann_pool_t *pool;
+  unsigned int id;
+  // Workers of the shared pool: team the worker is lent to (NULL while
+  // idle) and its thread number there
+  pycann_pool_t *team;
+  unsigned int team_id;
+};
+
+// Thread pool. Idle workers spin for a while and then park on a condition
+// variable until the next job is submitted. Threads of a job synchronize
+// with a barrier, which also spins before parking.
+//
+// Networks on the shared pool have a team instead: a pool without workers
+// of its own, which borrows idle workers of the shared pool for every job
+// (see pycann_pool_run). Jobs of different teams run at the same time on
+// disjoint workers.
+struct pycann_pool_struct {
+  // Number of threads (including the thread submitting jobs)
+  unsigned int num_threads;
+  pycann_pool_worker_t *workers;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t job_cond;
+  pthread_cond_t barrier_cond;
+
+  // Current job (job is incremented for every submitted job)
+  unsigned int job;
+  pycann_pool_job_t job_func;
+  void *job_arg;
+  unsigned int shutdown;
+
+  // Barrier
+  unsigned int barrier_count;
+  unsigned int barrier_generation;
+
+  // Number of spins before parking
+  unsigned int spin_count;
+
+  // Team: the shared pool it borrows workers from (NULL for other pools) and
+  // the number of borrowed workers still running the current job
+  pycann_pool_t *parent;
+  unsigned int active;
+
+  // Shared pool: number of idle workers, teams wait on idle_cond for enough
+  // of them and for their workers to return. Teams are admitted in the
+  // order they asked for workers (a ticket lock: next_ticket is handed out,
+  // serving_ticket may take workers).
+  unsigned int num_idle;
+  pthread_cond_t idle_cond;
+  unsigned int next_ticket;
+  unsigned int serving_ticket;
+};
+
+// Part of the network a thread steps
+struct pycann_thread_struct {
+  unsigned int first_neuron;
+  unsigned int last_neuron; // actually this is the neuron after the last one
+  unsigned long work; // cost processed during the last pycann_step
+  pycann_thread_stats_t stats;
+  uint64_t stats_mark; // end of the thread's last job (0 if none)
+  int cpu; // CPU and NUMA node (see pycann_get_thread_placement)
+  int node;
+  // largest change of an activation the thread made in step s is change[s&1]
+  // (only while stepping until stable)
+  pycann_float_t change[2];
 };
 #endif /* PYCANN_THREADING */
 
@@ -92,21 +325,84 @@ struct pycann_struct {
   // Activation functions
   pycann_activation_function_t *activation_functions;
 
+  // Runs of neurons with the same activation function in index order, input
+  // neurons are never in the same run as others (rebuilt on the next step
+  // if runs_dirty is set)
+  pycann_run_t *runs;
+  unsigned int num_runs;
+  unsigned int runs_dirty;
+
   // Thresholds
   pycann_float_t *thresholds;
 
   // Activation potentials
   pycann_float_t *activations;
 
-  // Weights (see macro PYCANN_WEIGHT)
+  // Update order, synchronous updates write the next step's activations into
+  // back_activations (NULL until synchronous updates are enabled, asynchronous
+  // updates use it for the activations before a step in pycann_step_until_stable)
+  pycann_update_t update_mode;
+  pycann_float_t *back_activations;
+
+  // Synchronous stepping: rows per tile, and the net inputs of the next step
+  // summed ahead while a tile's weights are cached (allocated with synchronous
+  // updates, see pycann_single_step)
+  unsigned int step_tile;
+  pycann_float_t *fused_sums;
+
+  // Delta propagation: delta_sums are the net inputs for the activations in
+  // delta_basis, delta_columns are the transposed weights (column j is stride
+  // weights apart, all NULL unless enabled). They're recomputed on the next
+  // step if delta_valid isn't set, the net inputs after PYCANN_DELTA_REFRESH steps.
+  pycann_propagation_t propagation;
+  pycann_float_t *delta_sums;
+  pycann_float_t *delta_basis;
+  pycann_float_t *delta_columns;
+  unsigned int delta_valid;
+  unsigned int delta_steps;
+
+  // Weight storage engine
+  pycann_storage_t storage;
+
+  // Weights (see macro PYCANN_WEIGHT), NULL if storage is sparse. Rows are
+  // stride weights apart (stride>=size, padded to PYCANN_ALIGNMENT bytes).
   pycann_float_t *weights;
-
-  // Modularity connections
+  unsigned int stride;
+
+  // Sparse weights (CSR): the synapses of neuron i are
+  // sparse_values[sparse_rows[i]] upto (excluding) sparse_values[sparse_rows[i+1]],
+  // coming from the neurons in sparse_columns (sorted ascending per row)
+  unsigned int *sparse_rows;
+  unsigned int *sparse_columns;
+  pycann_float_t *sparse_values;
+  unsigned int sparse_capacity;
+
+  // Quantized weights (uint16_t for FP16/BF16, int8_t for INT8), NULL if
+  // storage is not quantized. Rows are stride weights apart, weight (i, j)
+  // of INT8 storage is qscales[i]*qweights[i*stride+j].
+  void *qweights;
+  pycann_float_t *qscales;
+
+  // Modularity connections (mod_neurons are neuron indices)
   pycann_float_t *mod_weights;
-  pycann_float_t **mod_neurons;
+  unsigned int *mod_neurons;
+
+  // Plastic neurons (modularity connection and non-zero gammas), only
+  // these are considered for the Hebbian update in a step
+  unsigned char *plastic;
+  unsigned int num_plastic;
 
-  // Memory usage
-  unsigned int memory_usage;
+  // Memory usage (bytes)
+  size_t memory_usage;
+
+  // Arena holding all buffers of fixed size in sections aligned to
+  // PYCANN_ALIGNMENT (see pycann_new_ex). Large arenas are mapped in pages of
+  // arena_page_size bytes, small ones come from the heap (arena_page_size is
+  // 0). Buffers in it are never freed on their own, but whole pages of a
+  // mapped arena are given back to the system.
+  void *arena;
+  size_t arena_size;
+  size_t arena_page_size;
 
   // Inputs
   unsigned int num_inputs;
@@ -115,14 +411,60 @@ struct pycann_struct {
   // Outputs
   unsigned int num_outputs;
 
+  // Statistics, only collected if stats_enabled is set (the threads collect
+  // their own, see pycann_thread_struct)
+  unsigned int stats_enabled;
+  pycann_stats_t stats;
+  uint64_t stats_step_start; // start of the current step
+#ifndef PYCANN_THREADING
+  pycann_thread_stats_t thread_stats;
+  uint64_t stats_mark;
+#endif /* PYCANN_THREADING */
+
+  // State of the network's random number generator (see pycann_set_seed)
+  uint64_t random_state;
+
+  // Sequence of the current pycann_run_sequence, NULL otherwise
+  pycann_sequence_t *sequence;
+
+  // Convergence check of the current pycann_step_until_stable, NULL otherwise
+  pycann_stable_t *stable;
+
+  // Set if row costs changed (sparse structure, plasticity)
+  unsigned int partition_dirty;
+
+  // File mapping of a v4 file (see pycann_load_file_ex) or snapshot (see
+  // pycann_clone). Gammas, weights and thresholds point into it, it's
+  // private, so they may still be changed.
+  void *mapping;
+  size_t mapping_size;
+
+  // Snapshot of the parameters (see pycann_clone), NULL if there's none or
+  // they changed since. No snapshot is kept once parameters were handed out
+  // in place (params_exposed, which ones in its bits), they may change at any
+  // time then.
+  pycann_snapshot_t *snapshot;
+  unsigned int params_exposed;
+
 #ifdef PYCANN_THREADING
   // Threading
   unsigned int num_threads;
   pycann_thread_t *threads;
+  pycann_pool_t *pool;
+  unsigned int steps; // number of steps of the current job
+
+  // Load balancing: costs[i] is the estimated cost of neurons 0 upto
+  // (excluding) i, chunks are the bounds for dynamic scheduling
+  pycann_schedule_t schedule;
+  unsigned long *costs;
+  unsigned int num_chunks;
+  unsigned int *chunks;
+  unsigned int chunk_counters[2];
 #endif /* PYCANN_THREADING */
 };
 
 #define PYCANN_FILE_MAGIC "PYCANN_NETWORK\0\3"
+#define PYCANN_FILE_MAGIC_SPARSE "PYCANN_NETWORK\1\3" // same layout, but CSR section instead of dense weights
 #define PYCANN_FILE_MAGIC_LENGTH 16
 struct pycann_file_header {
   char magic[PYCANN_FILE_MAGIC_LENGTH];
@@ -133,23 +475,109 @@ struct pycann_file_header {
   unsigned int num_outputs;
 };
 
+// Version 4 of the pycann format: a header, a table of sections and the
+// sections. Sections start at multiples of PYCANN_FILE_ALIGNMENT bytes and
+// are padded to them, so they can be used in place when the file is mapped.
+#define PYCANN_FILE_MAGIC_V4 "PYCANN_NETWORK\0\4"
+#define PYCANN_FILE_BYTE_ORDER 0x01020304 // written in host byte order
+#define PYCANN_FILE_ALIGNMENT 64
+#define PYCANN_FILE_ROW_ALIGNMENT 16 // dense rows are padded to multiples of this many weights
+
+// Sections of a v4 file
+typedef enum {
+  PYCANN_SECTION_GAMMAS               = 1,  // 4*size floats
+  PYCANN_SECTION_WEIGHTS              = 2,  // dense: size*stride floats
+  PYCANN_SECTION_SPARSE_ROWS          = 3,  // sparse: size+1 row offsets
+  PYCANN_SECTION_SPARSE_COLUMNS       = 4,  // sparse: num_synapses columns
+  PYCANN_SECTION_SPARSE_VALUES        = 5,  // sparse: num_synapses floats
+  PYCANN_SECTION_THRESHOLDS           = 6,  // size floats
+  PYCANN_SECTION_ACTIVATIONS          = 7,  // size floats
+  PYCANN_SECTION_MOD_WEIGHTS          = 8,  // size floats
+  PYCANN_SECTION_MOD_NEURONS          = 9,  // size neuron indices
+  PYCANN_SECTION_INPUTS               = 10, // num_inputs floats
+  PYCANN_SECTION_ACTIVATION_FUNCTIONS = 11, // size activation functions
+  PYCANN_SECTION_WEIGHTS_FP16         = 12, // fp16: size*stride halfs
+  PYCANN_SECTION_WEIGHTS_BF16         = 13, // bf16: size*stride bfloat16s
+  PYCANN_SECTION_WEIGHTS_INT8         = 14, // int8: size*stride bytes
+  PYCANN_SECTION_WEIGHT_SCALES        = 15, // int8: size floats
+  PYCANN_SECTION_MAX                  = 16
+} pycann_section_t;
+
+struct pycann_file_section {
+  uint32_t id;     // PYCANN_SECTION_*
+  uint32_t reserved;
+  uint64_t offset; // from start of file
+  uint64_t length; // in bytes, without padding
+};
+
+struct pycann_file_header_v4 {
+  char magic[PYCANN_FILE_MAGIC_LENGTH];
+
+  uint32_t byte_order;   // PYCANN_FILE_BYTE_ORDER
+  uint32_t header_size;  // header and section table in bytes
+  uint32_t size;
+  uint32_t num_inputs;
+  uint32_t num_outputs;
+  uint32_t storage;      // pycann_storage_t
+  uint32_t stride;       // dense and quantized: weights per row
+  uint32_t num_synapses; // sparse: number of synapses
+  pycann_float_t learning_rate;
+  uint32_t num_sections;
+  uint64_t checksum;     // of everything after the header's padding (see pycann_checksum)
+};
+
+
+// Thread safety: the library has no unsynchronized global state besides the
+// selected kernels (see pycann_set_kernel), so different networks may be
+// created, stepped, loaded and saved concurrently from any threads without
+// locking. A network itself must only be used by one thread at a time (its
+// worker threads are handled internally). Networks on the shared pool
+// (PYCANN_NEW_SHARED_POOL) step on up to cost/PYCANN_SHARED_POOL_GRAIN of
+// its workers, steps of several networks run at the same time as long as
+// there are enough idle workers, otherwise they wait for them. Their
+// pycann_set_spin_count only changes the spinning of the network's own
+// barriers, PYCANN_NEW_PIN_THREADS is ignored for them (the workers aren't
+// theirs to pin). Errors are kept per thread, pycann_get_error returns the
+// last error of the calling thread.
 
 const char *pycann_get_error(void);
 void pycann_reset_error(void);
 
 pycann_t *pycann_new(unsigned int size, unsigned int num_inputs, unsigned int num_outputs, unsigned int num_threads);
+pycann_t *pycann_new_ex(unsigned int size, unsigned int num_inputs, unsigned int num_outputs, unsigned int num_threads, unsigned int flags);
 void pycann_del(pycann_t *net);
 
 unsigned int pycann_is_threading_enabled(void);
-unsigned int pycann_get_memory_usage(pycann_t *net);
+const char *pycann_get_kernel(void);
+int pycann_set_kernel(const char *name);
+size_t pycann_get_memory_usage(pycann_t *net);
 unsigned int pycann_get_size(pycann_t *net);
 unsigned int pycann_get_num_threads(pycann_t *net);
+unsigned int pycann_get_spin_count(pycann_t *net);
+void pycann_set_spin_count(pycann_t *net, unsigned int n);
+pycann_schedule_t pycann_get_schedule(pycann_t *net);
+int pycann_set_schedule(pycann_t *net, pycann_schedule_t schedule, unsigned int chunks_per_thread);
+unsigned long pycann_get_partition(pycann_t *net, unsigned int thread, unsigned int *first, unsigned int *last);
+unsigned long pycann_get_thread_work(pycann_t *net, unsigned int thread);
+int pycann_get_thread_placement(pycann_t *net, unsigned int thread, int *cpu, int *node);
+int pycann_get_row_node(pycann_t *net, unsigned int i);
+unsigned int pycann_get_stats_enabled(pycann_t *net);
+void pycann_set_stats_enabled(pycann_t *net, unsigned int enabled);
+void pycann_get_stats(pycann_t *net, pycann_stats_t *stats);
+int pycann_get_thread_stats(pycann_t *net, unsigned int thread, pycann_thread_stats_t *stats);
+void pycann_reset_stats(pycann_t *net);
+pycann_update_t pycann_get_update_mode(pycann_t *net);
+int pycann_set_update_mode(pycann_t *net, pycann_update_t mode);
+pycann_propagation_t pycann_get_propagation(pycann_t *net);
+int pycann_set_propagation(pycann_t *net, pycann_propagation_t mode);
 
 pycann_float_t pycann_get_learning_rate(pycann_t *net);
 void pycann_set_learning_rate(pycann_t *net, pycann_float_t v);
 
 void pycann_get_gamma(pycann_t *net, unsigned int i, pycann_float_t *gamma);
 void pycann_set_gamma(pycann_t *net, unsigned int i, pycann_float_t *gamma);
+void pycann_get_gammas(pycann_t *net, pycann_float_t *gammas);
+void pycann_set_gammas(pycann_t *net, const pycann_float_t *gammas);
 
 pycann_activation_function_t pycann_get_activation_function(pycann_t *net, unsigned int i);
 void pycann_set_activation_function(pycann_t *net, unsigned int i, pycann_activation_function_t activation_function);
@@ -157,12 +585,29 @@ void pycann_set_activation_function(pycann_t *net, unsigned int i, pycann_activa
 pycann_float_t pycann_get_weight(pycann_t *net, unsigned int i, unsigned int j);
 void pycann_set_weight(pycann_t *net, unsigned int i, unsigned int j, pycann_float_t v);
 void pycann_set_random_weights(pycann_t *net, pycann_float_t connection_rate);
+int pycann_set_random_weights_ex(pycann_t *net, pycann_float_t connection_rate, pycann_distribution_t distribution, pycann_float_t scale, unsigned int flags);
+void pycann_set_seed(pycann_t *net, uint64_t seed);
+void pycann_get_weight_row(pycann_t *net, unsigned int i, pycann_float_t *w);
+int pycann_set_weight_row(pycann_t *net, unsigned int i, const pycann_float_t *w);
+void pycann_get_weights(pycann_t *net, pycann_float_t *w);
+int pycann_set_weights(pycann_t *net, const pycann_float_t *w);
+pycann_float_t *pycann_get_weights_buffer(pycann_t *net, unsigned int *stride);
+
+pycann_storage_t pycann_get_storage(pycann_t *net);
+int pycann_set_storage(pycann_t *net, pycann_storage_t storage);
+unsigned int pycann_get_num_synapses(pycann_t *net);
 
 pycann_float_t pycann_get_threshold(pycann_t *net, unsigned int i);
 void pycann_set_threshold(pycann_t *net, unsigned int i, pycann_float_t v);
+void pycann_get_thresholds(pycann_t *net, pycann_float_t *v);
+void pycann_set_thresholds(pycann_t *net, const pycann_float_t *v);
+pycann_float_t *pycann_get_thresholds_buffer(pycann_t *net);
 
 pycann_float_t pycann_get_activation(pycann_t *net, unsigned int i);
 void pycann_set_activation(pycann_t *net, unsigned int i, pycann_float_t v);
+void pycann_get_activations(pycann_t *net, pycann_float_t *v);
+void pycann_set_activations(pycann_t *net, const pycann_float_t *v);
+pycann_float_t *pycann_get_activations_buffer(pycann_t *net);
 
 unsigned int pycann_get_mod_neuron(pycann_t *net, unsigned int i);
 pycann_float_t pycann_get_mod_weight(pycann_t *net, unsigned int i);
@@ -174,9 +619,18 @@ void pycann_set_inputs(pycann_t *net, pycann_float_t *inputs);
 void pycann_get_outputs(pycann_t *net, pycann_float_t *outputs);
 
 void pycann_step(pycann_t *net, unsigned int n);
+int pycann_step_until_stable(pycann_t *net, unsigned int max_steps, pycann_float_t tolerance, int *stable);
+int pycann_run_sequence(pycann_t *net, unsigned int length, const pycann_float_t *inputs, unsigned int steps, pycann_float_t *outputs, pycann_float_t *trace);
+
+void pycann_init_batch(pycann_t *net, unsigned int batch_size, pycann_float_t *activations);
+int pycann_step_batch(pycann_t *net, unsigned int batch_size, pycann_float_t *activations, const pycann_float_t *inputs, unsigned int n);
+void pycann_get_batch_outputs(pycann_t *net, unsigned int batch_size, const pycann_float_t *activations, pycann_float_t *outputs);
 
 pycann_t *pycann_load_file(const char *path, unsigned int num_threads);
+pycann_t *pycann_load_file_ex(const char *path, unsigned int num_threads, unsigned int flags);
 int pycann_save_file(const char *path, pycann_t *net);
+pycann_t *pycann_clone(pycann_t *net, unsigned int num_threads, unsigned int flags);
+int pycann_check_embedded(pycann_t *net, int format);
 int pycann_export_embedded(const char *path, pycann_t *net, int format);
 
 #endif /* _PYCANN_H_ */
@@ -15,10 +15,16 @@
 # You should have received a copy of the GNU Lesser General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-from ctypes import CDLL, c_void_p, c_uint, c_int, c_float, c_char_p, POINTER, Structure
+from ctypes import CDLL, c_void_p, c_uint, c_int, c_ulong, c_uint64, c_size_t, c_float, c_char_p, POINTER, Structure, byref, addressof
 
 
-__all__ = ["PyCANNException", "Network"]
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+
+__all__ = ["PyCANNException", "Network", "get_kernel", "set_kernel"]
 
 
 # utility function to check if variables are numeric
@@ -31,6 +37,90 @@ def is_numeric(*x):
     return True
 
 
+# converts 2-D data (NumPy array or sequence of sequences) into a contiguous
+# float buffer, returns a ctypes pointer and the object owning the memory
+def float_buffer_2d(data, rows, cols):
+    if (numpy is not None):
+        a = numpy.ascontiguousarray(data, dtype=numpy.float32)
+        if (a.shape!=(rows, cols)):
+            raise ValueError("Expected "+str(rows)+"x"+str(cols)+" buffer, got "+repr(a.shape))
+        return a.ctypes.data_as(POINTER(c_float)), a
+    buf = (rows*cols*c_float)()
+    for i, row in enumerate(data):
+        if (len(row)!=cols):
+            raise ValueError("Expected rows of length "+str(cols)+", got "+str(len(row)))
+        buf[i*cols:(i+1)*cols] = list(row)
+    return buf, buf
+
+# creates a rows x cols float buffer (NumPy array if available), returns a
+# ctypes pointer and the buffer
+def new_float_buffer_2d(rows, cols):
+    if (numpy is not None):
+        a = numpy.zeros((rows, cols), dtype=numpy.float32)
+        return a.ctypes.data_as(POINTER(c_float)), a
+    buf = (rows*cols*c_float)()
+    return buf, buf
+
+# returns a ctypes pointer to a rows x cols float buffer that is written in
+# place (contiguous float32 NumPy array or flat ctypes float array)
+def inplace_buffer_2d(buf, rows, cols):
+    if (numpy is not None and isinstance(buf, numpy.ndarray)):
+        if (buf.dtype!=numpy.float32 or not buf.flags["C_CONTIGUOUS"] or buf.shape!=(rows, cols)):
+            raise ValueError("Expected contiguous "+str(rows)+"x"+str(cols)+" float32 array")
+        return buf.ctypes.data_as(POINTER(c_float))
+    if (not isinstance(buf, c_float*(rows*cols))):
+        raise ValueError("Expected ctypes float array of length "+str(rows*cols))
+    return buf
+
+# converts 1-D data (NumPy array or sequence) into a contiguous float buffer,
+# returns a ctypes pointer and the object owning the memory
+def float_buffer_1d(data, n):
+    if (numpy is not None):
+        a = numpy.ascontiguousarray(data, dtype=numpy.float32)
+        if (a.shape!=(n,)):
+            raise ValueError("Expected buffer of length "+str(n)+", got "+repr(a.shape))
+        return a.ctypes.data_as(POINTER(c_float)), a
+    if (len(data)!=n):
+        raise ValueError("Expected buffer of length "+str(n)+", got "+str(len(data)))
+    buf = (n*c_float)(*data)
+    return buf, buf
+
+# creates a float buffer of length n (NumPy array if available), returns a
+# ctypes pointer and the buffer
+def new_float_buffer_1d(n):
+    if (numpy is not None):
+        a = numpy.zeros(n, dtype=numpy.float32)
+        return a.ctypes.data_as(POINTER(c_float)), a
+    buf = (n*c_float)()
+    return buf, buf
+
+# converts a ctypes buffer of length n into a tuple (NumPy arrays are kept)
+def values_1d(buf):
+    if (numpy is not None and isinstance(buf, numpy.ndarray)):
+        return buf
+    return tuple(buf)
+
+# view of rows x cols floats at pointer p (rows are stride floats apart)
+# without copying. NumPy arrays hide the padding, without NumPy a ctypes
+# array of rows x stride floats is returned.
+def view_2d(p, rows, cols, stride):
+    if (numpy is not None):
+        return numpy.ctypeslib.as_array(p, shape=(rows, stride))[:, :cols]
+    return ((stride*c_float)*rows).from_address(addressof(p.contents))
+
+# view of n floats at pointer p without copying
+def view_1d(p, n):
+    if (numpy is not None):
+        return numpy.ctypeslib.as_array(p, shape=(n,))
+    return (n*c_float).from_address(addressof(p.contents))
+
+# converts a flat ctypes buffer into a list of row tuples
+def rows_2d(buf, rows, cols):
+    if (numpy is not None and isinstance(buf, numpy.ndarray)):
+        return buf
+    return [tuple(buf[i*cols:(i+1)*cols]) for i in range(rows)]
+
+
 # load library
 __libpycann__ = CDLL("/usr/local/lib/libpycann.so")
 
@@ -40,6 +130,38 @@ pycann_t = c_void_p
 pycann_float_t = c_float
 pycann_activation_function_t = c_uint
 pycann_embedded_format_t = c_uint
+pycann_storage_t = c_uint
+pycann_schedule_t = c_uint
+pycann_update_t = c_uint
+pycann_propagation_t = c_uint
+pycann_distribution_t = c_uint
+
+
+# statistics (see pycann_get_stats and pycann_get_thread_stats)
+PYCANN_STATS_BUCKETS = 32
+
+class pycann_stats_t(Structure):
+    _fields_ = [("steps", c_ulong),
+                ("step_time", c_uint64),
+                ("latency", c_ulong*PYCANN_STATS_BUCKETS),
+                ("neurons_fired", c_ulong),
+                ("weight_updates", c_ulong)]
+
+class pycann_thread_stats_t(Structure):
+    _fields_ = [("busy_time", c_uint64),
+                ("wait_time", c_uint64),
+                ("idle_time", c_uint64),
+                ("neurons_fired", c_ulong),
+                ("weight_updates", c_ulong)]
+
+
+# flags for pycann_new_ex and pycann_load_file_ex
+PYCANN_NEW_SPARSE = 0x0001
+PYCANN_LOAD_VERIFY = 0x0002
+PYCANN_NEW_HUGEPAGES = 0x0004
+PYCANN_NEW_SHARED_POOL = 0x0008
+PYCANN_NEW_PIN_THREADS = 0x0010
+PYCANN_NEW_FIRST_TOUCH = 0x0020
 
 
 # load function prototypes
@@ -47,21 +169,54 @@ def __init_prototypes__(l):
     prototypes = [[l.pycann_get_error, c_char_p],
                   [l.pycann_reset_error, None],
                   [l.pycann_new, pycann_t, c_uint, c_uint, c_uint, c_uint],
+                  [l.pycann_new_ex, pycann_t, c_uint, c_uint, c_uint, c_uint, c_uint],
                   [l.pycann_del, None, pycann_t],
                   [l.pycann_is_threading_enabled, c_uint],
-                  [l.pycann_get_memory_usage, c_uint, pycann_t],
+                  [l.pycann_get_kernel, c_char_p],
+                  [l.pycann_set_kernel, c_int, c_char_p],
+                  [l.pycann_get_memory_usage, c_size_t, pycann_t],
                   [l.pycann_get_size, c_uint, pycann_t],
                   [l.pycann_get_num_threads, c_uint, pycann_t],
+                  [l.pycann_get_spin_count, c_uint, pycann_t],
+                  [l.pycann_set_spin_count, None, pycann_t, c_uint],
+                  [l.pycann_get_schedule, pycann_schedule_t, pycann_t],
+                  [l.pycann_set_schedule, c_int, pycann_t, pycann_schedule_t, c_uint],
+                  [l.pycann_get_partition, c_ulong, pycann_t, c_uint, POINTER(c_uint), POINTER(c_uint)],
+                  [l.pycann_get_thread_work, c_ulong, pycann_t, c_uint],
+                  [l.pycann_get_thread_placement, c_int, pycann_t, c_uint, POINTER(c_int), POINTER(c_int)],
+                  [l.pycann_get_row_node, c_int, pycann_t, c_uint],
+                  [l.pycann_get_stats_enabled, c_uint, pycann_t],
+                  [l.pycann_set_stats_enabled, None, pycann_t, c_uint],
+                  [l.pycann_get_stats, None, pycann_t, POINTER(pycann_stats_t)],
+                  [l.pycann_get_thread_stats, c_int, pycann_t, c_uint, POINTER(pycann_thread_stats_t)],
+                  [l.pycann_reset_stats, None, pycann_t],
+                  [l.pycann_get_update_mode, pycann_update_t, pycann_t],
+                  [l.pycann_set_update_mode, c_int, pycann_t, pycann_update_t],
+                  [l.pycann_get_propagation, pycann_propagation_t, pycann_t],
+                  [l.pycann_set_propagation, c_int, pycann_t, pycann_propagation_t],
                   [l.pycann_get_learning_rate, pycann_float_t, pycann_t],
                   [l.pycann_set_learning_rate, None, pycann_t, pycann_float_t],
                   [l.pycann_get_gamma, pycann_float_t, pycann_t, c_uint, POINTER(pycann_float_t)],
                   [l.pycann_set_gamma, None, pycann_t, c_uint, POINTER(pycann_float_t)],
+                  [l.pycann_get_gammas, None, pycann_t, POINTER(pycann_float_t)],
+                  [l.pycann_set_gammas, None, pycann_t, POINTER(pycann_float_t)],
                   [l.pycann_get_weight, pycann_float_t, pycann_t, c_uint, c_uint],
                   [l.pycann_set_weight, None, pycann_t, c_uint, c_uint, pycann_float_t],
+                  [l.pycann_get_weight_row, None, pycann_t, c_uint, POINTER(pycann_float_t)],
+                  [l.pycann_set_weight_row, c_int, pycann_t, c_uint, POINTER(pycann_float_t)],
+                  [l.pycann_get_weights, None, pycann_t, POINTER(pycann_float_t)],
+                  [l.pycann_set_weights, c_int, pycann_t, POINTER(pycann_float_t)],
+                  [l.pycann_get_weights_buffer, POINTER(pycann_float_t), pycann_t, POINTER(c_uint)],
                   [l.pycann_get_threshold, pycann_float_t, pycann_t, c_uint],
                   [l.pycann_set_threshold, None, pycann_t, c_uint, pycann_float_t],
+                  [l.pycann_get_thresholds, None, pycann_t, POINTER(pycann_float_t)],
+                  [l.pycann_set_thresholds, None, pycann_t, POINTER(pycann_float_t)],
+                  [l.pycann_get_thresholds_buffer, POINTER(pycann_float_t), pycann_t],
                   [l.pycann_get_activation, pycann_float_t, pycann_t, c_uint],
                   [l.pycann_set_activation, None, pycann_t, c_uint, pycann_float_t],
+                  [l.pycann_get_activations, None, pycann_t, POINTER(pycann_float_t)],
+                  [l.pycann_set_activations, None, pycann_t, POINTER(pycann_float_t)],
+                  [l.pycann_get_activations_buffer, POINTER(pycann_float_t), pycann_t],
                   [l.pycann_get_activation_function, pycann_activation_function_t, pycann_t, c_uint],
                   [l.pycann_set_activation_function, None, pycann_t, c_uint, pycann_activation_function_t],               
                   [l.pycann_get_mod_neuron, c_uint, pycann_t, c_uint],
@@ -72,9 +227,22 @@ def __init_prototypes__(l):
                   [l.pycann_get_num_inputs, c_uint, pycann_t],
                   [l.pycann_get_num_outputs, c_uint, pycann_t],
                   [l.pycann_set_random_weights, None, pycann_t, pycann_float_t],
+                  [l.pycann_set_random_weights_ex, c_int, pycann_t, pycann_float_t, pycann_distribution_t, pycann_float_t, c_uint],
+                  [l.pycann_set_seed, None, pycann_t, c_uint64],
+                  [l.pycann_get_storage, pycann_storage_t, pycann_t],
+                  [l.pycann_set_storage, c_int, pycann_t, pycann_storage_t],
+                  [l.pycann_get_num_synapses, c_uint, pycann_t],
                   [l.pycann_step, None, pycann_t, c_uint],
+                  [l.pycann_step_until_stable, c_int, pycann_t, c_uint, pycann_float_t, POINTER(c_int)],
+                  [l.pycann_run_sequence, c_int, pycann_t, c_uint, POINTER(pycann_float_t), c_uint, POINTER(pycann_float_t), POINTER(pycann_float_t)],
+                  [l.pycann_init_batch, None, pycann_t, c_uint, POINTER(pycann_float_t)],
+                  [l.pycann_step_batch, c_int, pycann_t, c_uint, POINTER(pycann_float_t), POINTER(pycann_float_t), c_uint],
+                  [l.pycann_get_batch_outputs, None, pycann_t, c_uint, POINTER(pycann_float_t), POINTER(pycann_float_t)],
                   [l.pycann_load_file, pycann_t, c_char_p, c_uint],
+                  [l.pycann_load_file_ex, pycann_t, c_char_p, c_uint, c_uint],
                   [l.pycann_save_file, c_int, c_char_p, pycann_t],
+                  [l.pycann_clone, pycann_t, pycann_t, c_uint, c_uint],
+                  [l.pycann_check_embedded, c_int, pycann_t, pycann_embedded_format_t],
                   [l.pycann_export_embedded, c_int, c_char_p, pycann_t, pycann_embedded_format_t]]
 
     for p in prototypes:
@@ -89,6 +257,16 @@ __init_prototypes__(__libpycann__)
 THREADING = bool(__libpycann__.pycann_is_threading_enabled())
 
 
+def get_kernel():
+    """ Returns the name of the compute kernels in use """
+    return __libpycann__.pycann_get_kernel().decode()
+
+def set_kernel(name = "auto"):
+    """ Selects compute kernels ("auto", "scalar", "sse2", "avx2" or "avx512") """
+    if (__libpycann__.pycann_set_kernel(name.encode())==-1):
+        raise PyCANNException()
+
+
 class PyCANNException(Exception):
     """ A pyCANN exception. Get error string from C library """
     def __init__(self, errstr = None):
@@ -106,17 +284,52 @@ class Network:
     l = __libpycann__
     net = None
     embedded_formats = {None: 0,
-                        "NXT": 1}
+                        "NXT":     1,
+                        "NXT_Q15": 2,
+                        "NXT_Q7":  3}
     activation_functions = {None: 0,
                             "SIGMOID_STEP":   1,
                             "SIGMOID_EXP":    2,
                             "SIGMOID_APPROX": 3,
                             "LINEAR":         4}
-
-    def __init__(self, *args):
+    storages = {"DENSE":  0,
+                "SPARSE": 1,
+                "FP16":   2,
+                "BF16":   3,
+                "INT8":   4}
+    schedules = {"STATIC":  0,
+                 "DYNAMIC": 1}
+    update_modes = {"ASYNC": 0,
+                    "SYNC":  1}
+    propagations = {"FULL":  0,
+                    "DELTA": 1}
+    distributions = {"UNIFORM": 0,
+                     "NORMAL":  1}
+
+    def __init__(self, *args, **options):
         """ Contructor:
-pycann.Network(num_inputs, num_interneurons, num_outputs [, num_threads])
-pycann.Network(path [, num_threads]) """
+pycann.Network(num_inputs, num_interneurons, num_outputs [, num_threads] [, sparse = False] [, hugepages = False] [, shared_pool = False] [, pin_threads = False] [, first_touch = False])
+pycann.Network(path [, num_threads] [, sparse = False] [, verify = False] [, hugepages = False] [, shared_pool = False] [, pin_threads = False] [, first_touch = False])
+
+With shared_pool the network is stepped by idle workers of the process-wide
+thread pool (a thread per CPU), as many as its size is worth, so small networks
+step concurrently; num_threads is ignored then. pin_threads pins the worker
+threads to CPUs, first_touch puts every thread's weight rows on its NUMA node. """
+
+        # creation flags
+        self.flags = 0
+        if (options.get("sparse", False)):
+            self.flags |= PYCANN_NEW_SPARSE
+        if (options.get("verify", False)):
+            self.flags |= PYCANN_LOAD_VERIFY
+        if (options.get("hugepages", False)):
+            self.flags |= PYCANN_NEW_HUGEPAGES
+        if (options.get("shared_pool", False)):
+            self.flags |= PYCANN_NEW_SHARED_POOL
+        if (options.get("pin_threads", False)):
+            self.flags |= PYCANN_NEW_PIN_THREADS
+        if (options.get("first_touch", False)):
+            self.flags |= PYCANN_NEW_FIRST_TOUCH
 
         # check if threading is supported
         if (not THREADING):
@@ -130,8 +343,10 @@ pycann.Network(path [, num_threads]) """
             self.init_load(*args)
         else:
             raise AttributeError("Unknown constructor with "+str(num_args)+" arguments.")
+        self.init_values()
 
-        # these values will never change, so we can hold them here too
+    def init_values(self):
+        """ Gets the values that never change, so we can hold them here too """
         self.size = self.l.pycann_get_size(self.net)
         self.num_inputs = self.l.pycann_get_num_inputs(self.net)
         self.num_outputs = self.l.pycann_get_num_outputs(self.net)
@@ -143,22 +358,137 @@ pycann.Network(path [, num_threads]) """
         
         # create neural network
         size = num_inputs + num_interneurons + num_outputs
-        self.net = self.l.pycann_new(size, num_inputs, num_outputs, num_threads)
+        self.net = self.l.pycann_new_ex(size, num_inputs, num_outputs, num_threads, self.flags)
         if (not self.net):
             raise PyCANNException()
 
     def init_load(self, path, num_threads = 1):
         """ Loads a neural network from file """
         # load neural network from file
-        self.net = self.l.pycann_load_file(path, num_threads)
+        self.net = self.l.pycann_load_file_ex(path, num_threads, self.flags)
         if (not self.net):
             raise PyCANNException()
 
+    def clone(self, num_threads = None):
+        """ Returns a copy of the network. Gammas, weights and thresholds are
+shared copy-on-write (a clone only copies a page of them when it first changes
+it), see pycann_clone. The clone has num_threads threads (default: as many
+as the network) and the network's creation flags. """
+        if (num_threads is None):
+            num_threads = self.num_threads
+        net = Network.__new__(Network)
+        net.flags = self.flags
+        net.net = self.l.pycann_clone(self.net, num_threads, self.flags)
+        if (not net.net):
+            raise PyCANNException()
+        net.init_values()
+        return net
+
     def __del__(self):
         """ Deletes the neural network """
         if (self.net!=None):
             self.l.pycann_del(self.net)
 
+    def get_spin_count(self):
+        return self.l.pycann_get_spin_count(self.net)
+
+    def set_spin_count(self, n):
+        """ Sets number of spins before idle threads park (latency vs. CPU usage) """
+        self.l.pycann_set_spin_count(self.net, n)
+
+    def get_schedule(self):
+        s = self.l.pycann_get_schedule(self.net)
+        for n in self.schedules:
+            if (s==self.schedules[n]):
+                return n
+        return None
+
+    def set_schedule(self, schedule = "STATIC", chunks_per_thread = 0):
+        """ Sets thread scheduling ("STATIC" or "DYNAMIC") """
+        if (self.l.pycann_set_schedule(self.net, self.schedules[schedule.upper()], chunks_per_thread)==-1):
+            raise PyCANNException()
+
+    def get_partition(self, thread):
+        """ Returns (first, last, cost) of a thread's static partition """
+        first = c_uint()
+        last = c_uint()
+        cost = self.l.pycann_get_partition(self.net, thread, byref(first), byref(last))
+        return first.value, last.value, cost
+
+    def get_thread_work(self):
+        """ Returns the cost each thread processed during the last step() """
+        return tuple(self.l.pycann_get_thread_work(self.net, i) for i in range(self.num_threads))
+
+    def get_thread_placement(self):
+        """ Returns (cpu, NUMA node) each thread runs on (-1 if unknown) """
+        placement = []
+        for i in range(self.num_threads):
+            cpu, node = c_int(), c_int()
+            self.l.pycann_get_thread_placement(self.net, i, byref(cpu), byref(node))
+            placement.append((cpu.value, node.value))
+        return tuple(placement)
+
+    def get_row_node(self, i):
+        """ Returns the NUMA node of neuron i's weights (-1 if unknown) """
+        return self.l.pycann_get_row_node(self.net, i)
+
+    def get_stats_enabled(self):
+        return bool(self.l.pycann_get_stats_enabled(self.net))
+
+    def set_stats_enabled(self, enabled = True):
+        """ Enables or disables collecting statistics of steps (see get_stats) """
+        self.l.pycann_set_stats_enabled(self.net, bool(enabled))
+
+    def get_stats(self):
+        """ Returns statistics of the steps since the last reset_stats() as a
+dict: steps, step_time (nanoseconds), latency (histogram, bucket 0 counts
+steps taking less than 1 microsecond, bucket k steps taking 2^(k-1) upto 2^k
+microseconds), neurons_fired, weight_updates and threads (busy_time,
+wait_time, idle_time, neurons_fired and weight_updates per thread). """
+        stats = pycann_stats_t()
+        self.l.pycann_get_stats(self.net, byref(stats))
+        threads = []
+        for i in range(self.num_threads):
+            t = pycann_thread_stats_t()
+            self.l.pycann_get_thread_stats(self.net, i, byref(t))
+            threads.append({n: getattr(t, n) for n, c in t._fields_})
+        return {"steps":          stats.steps,
+                "step_time":      stats.step_time,
+                "latency":        tuple(stats.latency),
+                "neurons_fired":  stats.neurons_fired,
+                "weight_updates": stats.weight_updates,
+                "threads":        threads}
+
+    def reset_stats(self):
+        self.l.pycann_reset_stats(self.net)
+
+    def get_update_mode(self):
+        m = self.l.pycann_get_update_mode(self.net)
+        for n in self.update_modes:
+            if (m==self.update_modes[n]):
+                return n
+        return None
+
+    def set_update_mode(self, mode = "ASYNC"):
+        """ Sets update order ("ASYNC" in place or "SYNC" double-buffered, deterministic with threads) """
+        if (self.l.pycann_set_update_mode(self.net, self.update_modes[mode.upper()])==-1):
+            raise PyCANNException()
+        self.memory_usage = self.l.pycann_get_memory_usage(self.net)
+
+    def get_propagation(self):
+        m = self.l.pycann_get_propagation(self.net)
+        for n in self.propagations:
+            if (m==self.propagations[n]):
+                return n
+        return None
+
+    def set_propagation(self, mode = "FULL"):
+        """ Sets propagation ("FULL" or "DELTA": net inputs are kept and only
+updated from neurons whose activation changed, for low-activity networks) """
+        if (self.l.pycann_set_propagation(self.net, self.propagations[mode.upper()])==-1):
+            raise PyCANNException()
+        self.memory_usage = self.l.pycann_get_memory_usage(self.net)
+
     def get_learning_rate(self):
         return self.l.pycann_get_learning_rate(self.net)
 
@@ -182,18 +512,92 @@ pycann.Network(path [, num_threads]) """
     def set_weight(self, i, j, weight):
         self.l.pycann_set_weight(self.net, j, i, weight)
 
+    def get_gammas(self):
+        """ Returns the gammas of all neurons (size x 4) """
+        p, gammas = new_float_buffer_2d(self.size, 4)
+        self.l.pycann_get_gammas(self.net, p)
+        return rows_2d(gammas, self.size, 4)
+
+    def set_gammas(self, gammas):
+        """ Sets the gammas of all neurons (size x 4) """
+        p, buf = float_buffer_2d(gammas, self.size, 4)
+        self.l.pycann_set_gammas(self.net, p)
+
+    def get_weights(self):
+        """ Returns all weights (size x size). Row j holds the weights of the
+synapses to neuron j, so weights[j][i] is get_weight(i, j). """
+        p, weights = new_float_buffer_2d(self.size, self.size)
+        self.l.pycann_get_weights(self.net, p)
+        return rows_2d(weights, self.size, self.size)
+
+    def set_weights(self, weights):
+        """ Sets all weights (size x size, see get_weights) """
+        p, buf = float_buffer_2d(weights, self.size, self.size)
+        if (self.l.pycann_set_weights(self.net, p)==-1):
+            raise PyCANNException()
+        self.memory_usage = self.l.pycann_get_memory_usage(self.net)
+
+    def get_weight_row(self, j):
+        """ Returns the weights of the synapses to neuron j (see get_weights) """
+        p, row = new_float_buffer_1d(self.size)
+        self.l.pycann_get_weight_row(self.net, j, p)
+        return values_1d(row)
+
+    def set_weight_row(self, j, row):
+        """ Sets the weights of the synapses to neuron j (see get_weights) """
+        p, buf = float_buffer_1d(row, self.size)
+        if (self.l.pycann_set_weight_row(self.net, j, p)==-1):
+            raise PyCANNException()
+        self.memory_usage = self.l.pycann_get_memory_usage(self.net)
+
+    def weights_view(self):
+        """ Returns the dense weights in place (size x size, see get_weights).
+Writes go straight to the network. The view is only valid while the network
+exists and its storage isn't changed, steps use full propagation until then. """
+        stride = c_uint()
+        p = self.l.pycann_get_weights_buffer(self.net, byref(stride))
+        if (not p):
+            raise PyCANNException()
+        return view_2d(p, self.size, self.size, stride.value)
+
     def get_threshold(self, i):
         return __libpycann__.pycann_get_threshold(self.net, i)
 
     def set_threshold(self, i, threshold):
         self.l.pycann_set_threshold(self.net, i, threshold)
 
+    def get_thresholds(self):
+        p, thresholds = new_float_buffer_1d(self.size)
+        self.l.pycann_get_thresholds(self.net, p)
+        return values_1d(thresholds)
+
+    def set_thresholds(self, thresholds):
+        p, buf = float_buffer_1d(thresholds, self.size)
+        self.l.pycann_set_thresholds(self.net, p)
+
+    def thresholds_view(self):
+        """ Returns the thresholds in place (valid while the network exists) """
+        return view_1d(self.l.pycann_get_thresholds_buffer(self.net), self.size)
+
     def get_activation(self, i):
         return self.l.pycann_get_activation(self.net, i)
 
     def set_activation(self, i, activation):
         self.l.pycann_set_activation(self.net, i, activation)
 
+    def get_activations(self):
+        p, activations = new_float_buffer_1d(self.size)
+        self.l.pycann_get_activations(self.net, p)
+        return values_1d(activations)
+
+    def set_activations(self, activations):
+        p, buf = float_buffer_1d(activations, self.size)
+        self.l.pycann_set_activations(self.net, p)
+
+    def activations_view(self):
+        """ Returns the activations in place (valid while the network exists) """
+        return view_1d(self.l.pycann_get_activations_buffer(self.net), self.size)
+
     def get_activation_function(self, i):
         a = self.l.pycann_get_activation_function(self.net, i)
         for n in self.activation_functions:
@@ -212,12 +616,99 @@ pycann.Network(path [, num_threads]) """
     def set_mod_connection(self, i, j, weight):
         self.l.pycann_set_mod(self.net, i, j, weight)
 
-    def set_random_weights(self, connrate = 1.0):
-        self.l.pycann_set_random_weights(self.net, connrate)
+    def set_random_weights(self, connrate = 1.0, distribution = "UNIFORM", scale = 1.0, fan_in = False):
+        """ Connects round(connrate*size) random neurons to every neuron with
+            weights uniform in (-scale, scale) or normal with standard
+            deviation scale (divided by the square root of the synapses per
+            neuron if fan_in). The weights only depend on the seed (see
+            set_seed), not on the number of threads. """
+        flags = 0x0001 if fan_in else 0
+        if (self.l.pycann_set_random_weights_ex(self.net, connrate, self.distributions[distribution.upper()], scale, flags)==-1):
+            raise PyCANNException()
+
+    def set_seed(self, seed):
+        """ Seeds the network's random number generator (see set_random_weights) """
+        self.l.pycann_set_seed(self.net, seed)
+
+    def get_storage(self):
+        s = self.l.pycann_get_storage(self.net)
+        for n in self.storages:
+            if (s==self.storages[n]):
+                return n
+        return None
+
+    def set_storage(self, storage = "DENSE"):
+        """ Converts weights to another storage engine ("DENSE", "SPARSE" or
+            the quantized, inference only "FP16", "BF16" and "INT8") """
+        if (self.l.pycann_set_storage(self.net, self.storages[storage.upper()])==-1):
+            raise PyCANNException()
+        self.memory_usage = self.l.pycann_get_memory_usage(self.net)
+
+    def get_num_synapses(self):
+        return self.l.pycann_get_num_synapses(self.net)
 
     def step(self, n = 1):
         self.l.pycann_step(self.net, n)
 
+    def step_until_stable(self, max_steps, tolerance = 0.0):
+        """ Steps until no activation changes by more than tolerance in a step
+(0.0: until a step repeats the activations exactly), but at most max_steps
+steps. Returns a tuple (steps, stable): the number of steps done and whether
+the last one was stable. """
+        stable = c_int()
+        steps = self.l.pycann_step_until_stable(self.net, max_steps, tolerance, byref(stable))
+        if (steps==-1):
+            raise PyCANNException()
+        return steps, bool(stable.value)
+
+    def run(self, inputs, steps = 1, trace = False):
+        """ Drives the network with a sequence of inputs (length x num_inputs):
+every row is applied for 'steps' steps and the outputs after them are
+returned (length x num_outputs). With trace = True the activations of all
+neurons after every row are returned, too (length x size), as a tuple
+(outputs, trace). """
+        length = len(inputs)
+        inputs_p, inputs_buf = float_buffer_2d(inputs, length, self.num_inputs)
+        outputs_p, outputs = new_float_buffer_2d(length, self.num_outputs)
+        trace_p, trace_buf = new_float_buffer_2d(length, self.size) if trace else (None, None)
+        if (self.l.pycann_run_sequence(self.net, length, inputs_p, steps, outputs_p, trace_p)==-1):
+            raise PyCANNException()
+        if (trace):
+            return rows_2d(outputs, length, self.num_outputs), rows_2d(trace_buf, length, self.size)
+        return rows_2d(outputs, length, self.num_outputs)
+
+    def new_batch_state(self, batch_size):
+        """ Returns batch_size activation states (batch_size x size) initialized
+with the current activations, for use with step_batch """
+        p, state = new_float_buffer_2d(batch_size, self.size)
+        self.l.pycann_init_batch(self.net, batch_size, p)
+        return state
+
+    def step_batch(self, inputs, n = 1, state = None):
+        """ Does n steps for every row of inputs (batch_size x num_inputs)
+independently against the network's weights and returns the outputs
+(batch_size x num_outputs). 'state' (see new_batch_state) holds the
+activations of every row and is updated in place, if it's not given all
+rows start with the network's current activations. Weights don't learn in
+batch mode. """
+        batch_size = len(inputs)
+        inputs_p, inputs_buf = float_buffer_2d(inputs, batch_size, self.num_inputs)
+        if (state is None):
+            state = self.new_batch_state(batch_size)
+        state_p = inplace_buffer_2d(state, batch_size, self.size)
+        if (self.l.pycann_step_batch(self.net, batch_size, state_p, inputs_p, n)==-1):
+            raise PyCANNException()
+        outputs_p, outputs = new_float_buffer_2d(batch_size, self.num_outputs)
+        self.l.pycann_get_batch_outputs(self.net, batch_size, state_p, outputs_p)
+        return rows_2d(outputs, batch_size, self.num_outputs)
+
+    def check_embedded(self, embedded):
+        """ Raises PyCANNException (with the reason) if the network can't be
+            exported in the embedded format ("NXT", or the fixed-point,
+            inference only "NXT_Q15" and "NXT_Q7") """
+        if (self.l.pycann_check_embedded(self.net, self.embedded_formats[embedded])==-1):
+            raise PyCANNException()
+
     def save(self, path, embedded = None):
         if (embedded==None):
             ret = self.l.pycann_save_file(path, self.net)
@@ -0,0 +1,1153 @@
+/*
+ pycann - Neural network library
+ A Python/C hybrid for fast neural networks in Python
+ Copyright (C) 2010  Janosch Gräf <janosch.graef@gmx.net>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Propagation and plasticity kernels
+//
+// There is one set of kernels per instruction set. The best set supported
+// by the CPU is selected when the library is loaded, so a single
+// libpycann.so runs on every x86 host. The environment variable
+// PYCANN_KERNEL (or pycann_set_kernel) overrides the choice, "scalar"
+// selects the reference implementation.
+
+#include <stdlib.h> /* getenv */
+#include <string.h> /* strcmp */
+#include <math.h> /* signbit */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PYCANN_X86
+#include <immintrin.h>
+#endif /* __x86_64__ || __i386__ */
+
+#include "kernels.h"
+
+
+// The reference kernels must keep the summation order of the original
+// loops, so don't let the compiler vectorize them (see PYCANN_NO_VECTORIZE).
+
+
+// Hebbian weight change of a single synapse
+static inline pycann_float_t pycann_hebbian_dw(pycann_float_t w, pycann_float_t v, const pycann_float_t *g, pycann_float_t u, pycann_float_t m) {
+  return (signbit(w)?-1.0:1.0) * m * (g[0]*u*v + g[1]*v + g[2]*u + g[3]);
+}
+
+
+/* Scalar reference kernels */
+
+static PYCANN_NO_VECTORIZE pycann_float_t pycann_dot_scalar(const pycann_float_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  pycann_float_t o = 0.0;
+
+  for (j=0; j<n; j=j+1) {
+    o = o+w[j]*v[j];
+  }
+  return o;
+}
+
+static PYCANN_NO_VECTORIZE pycann_float_t pycann_dot_sparse_scalar(const pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n) {
+  unsigned int k;
+  pycann_float_t o = 0.0;
+
+  for (k=0; k<n; k=k+1) {
+    o = o+w[k]*v[c[k]];
+  }
+  return o;
+}
+
+static PYCANN_NO_VECTORIZE pycann_float_t pycann_dot_hebbian_scalar(pycann_float_t *w, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m) {
+  unsigned int j;
+  pycann_float_t o = 0.0;
+
+  for (j=0; j<n; j=j+1) {
+    o = o+w[j]*v[j];
+    w[j] = w[j]+pycann_hebbian_dw(w[j], v[j], g, u, m);
+  }
+  return o;
+}
+
+static PYCANN_NO_VECTORIZE pycann_float_t pycann_dot_hebbian_sparse_scalar(pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m) {
+  unsigned int k;
+  pycann_float_t o = 0.0;
+
+  for (k=0; k<n; k=k+1) {
+    o = o+w[k]*v[c[k]];
+    w[k] = w[k]+pycann_hebbian_dw(w[k], v[c[k]], g, u, m);
+  }
+  return o;
+}
+
+static PYCANN_NO_VECTORIZE void pycann_axpy_scalar(pycann_float_t *o, pycann_float_t w, const pycann_float_t *x, unsigned int n) {
+  unsigned int j;
+
+  for (j=0; j<n; j=j+1) {
+    o[j] = o[j]+w*x[j];
+  }
+}
+
+static PYCANN_NO_VECTORIZE void pycann_gemm_scalar(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n, unsigned int nb) {
+  unsigned int r, k;
+
+  for (r=0; r<rows; r=r+1) {
+    for (k=0; k<n; k=k+1) {
+      pycann_axpy_scalar(o+r*nb, w[r*ldw+k], a+k*nb, nb);
+    }
+  }
+}
+
+static PYCANN_NO_VECTORIZE void pycann_gemv_scalar(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n) {
+  unsigned int r, k;
+
+  for (r=0; r<rows; r=r+1) {
+    for (k=0; k<n; k=k+1) {
+      o[r] = o[r]+w[(size_t)r*ldw+k]*a[k];
+    }
+  }
+}
+
+// Columns b0 upto (excluding) nb of gemm, for the remainder vector kernels don't cover
+static inline void pycann_gemm_tail(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n, unsigned int nb, unsigned int b0) {
+  unsigned int r, k, b;
+
+  for (r=0; r<rows; r=r+1) {
+    for (k=0; k<n; k=k+1) {
+      for (b=b0; b<nb; b=b+1) {
+        o[r*nb+b] = o[r*nb+b]+w[r*ldw+k]*a[k*nb+b];
+      }
+    }
+  }
+}
+
+static PYCANN_NO_VECTORIZE void pycann_sigmoid_scalar(pycann_float_t *y, const pycann_float_t *x, unsigned int n) {
+  unsigned int j;
+
+  for (j=0; j<n; j=j+1) {
+    y[j] = pycann_sigmoid_approx(x[j]);
+  }
+}
+
+static PYCANN_NO_VECTORIZE pycann_float_t pycann_dot_f16_scalar(const uint16_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  pycann_float_t o = 0.0;
+
+  for (j=0; j<n; j=j+1) {
+    o = o+pycann_half_to_float(w[j])*v[j];
+  }
+  return o;
+}
+
+static PYCANN_NO_VECTORIZE pycann_float_t pycann_dot_bf16_scalar(const uint16_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  pycann_float_t o = 0.0;
+
+  for (j=0; j<n; j=j+1) {
+    o = o+pycann_bf16_to_float(w[j])*v[j];
+  }
+  return o;
+}
+
+static PYCANN_NO_VECTORIZE pycann_float_t pycann_dot_i8_scalar(const int8_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  pycann_float_t o = 0.0;
+
+  for (j=0; j<n; j=j+1) {
+    o = o+(pycann_float_t)w[j]*v[j];
+  }
+  return o;
+}
+
+const pycann_kernels_t pycann_kernels_scalar = {
+  "scalar",
+  pycann_dot_scalar,
+  pycann_dot_sparse_scalar,
+  pycann_dot_hebbian_scalar,
+  pycann_dot_hebbian_sparse_scalar,
+  pycann_axpy_scalar,
+  pycann_gemm_scalar,
+  pycann_gemv_scalar,
+  pycann_sigmoid_scalar,
+  pycann_dot_f16_scalar,
+  pycann_dot_bf16_scalar,
+  pycann_dot_i8_scalar
+};
+
+
+#ifdef PYCANN_X86
+
+// Sign bit mask. Not written as -0.0, because -ffast-math may drop signed zeros.
+#define PYCANN_SIGN_MASK 0x80000000
+
+
+/* SSE2 kernels */
+
+static inline __attribute__((target("sse2"))) float pycann_hsum_sse2(__m128 x) {
+  x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+  x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+  return _mm_cvtss_f32(x);
+}
+
+static __attribute__((target("sse2"))) pycann_float_t pycann_dot_sse2(const pycann_float_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m128 a0, a1;
+  pycann_float_t o;
+
+  a0 = _mm_setzero_ps();
+  a1 = _mm_setzero_ps();
+  for (j=0; j+8<=n; j=j+8) {
+    a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(w+j), _mm_loadu_ps(v+j)));
+    a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(w+j+4), _mm_loadu_ps(v+j+4)));
+  }
+  o = pycann_hsum_sse2(_mm_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+w[j]*v[j];
+  }
+  return o;
+}
+
+static __attribute__((target("sse2"))) pycann_float_t pycann_dot_sparse_sse2(const pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n) {
+  unsigned int k;
+  __m128 a;
+  pycann_float_t o;
+
+  a = _mm_setzero_ps();
+  for (k=0; k+4<=n; k=k+4) {
+    a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(w+k), _mm_set_ps(v[c[k+3]], v[c[k+2]], v[c[k+1]], v[c[k]])));
+  }
+  o = pycann_hsum_sse2(a);
+  for (; k<n; k=k+1) {
+    o = o+w[k]*v[c[k]];
+  }
+  return o;
+}
+
+// Hebbian update of 4 weights x with pre-synaptic activations y
+static inline __attribute__((target("sse2"))) __m128 pycann_hebbian_sse2(__m128 x, __m128 y, __m128 g0u, __m128 g1, __m128 c, __m128 m) {
+  __m128 dw, s;
+
+  dw = _mm_mul_ps(m, _mm_add_ps(_mm_add_ps(_mm_mul_ps(g0u, y), _mm_mul_ps(g1, y)), c));
+  s = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(PYCANN_SIGN_MASK)));
+  return _mm_add_ps(x, _mm_xor_ps(dw, s));
+}
+
+static __attribute__((target("sse2"))) pycann_float_t pycann_dot_hebbian_sse2(pycann_float_t *w, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m) {
+  unsigned int j;
+  __m128 a, x, y, g0u, g1, c, mm;
+  pycann_float_t o;
+
+  a = _mm_setzero_ps();
+  g0u = _mm_set1_ps(g[0]*u);
+  g1 = _mm_set1_ps(g[1]);
+  c = _mm_set1_ps(g[2]*u+g[3]);
+  mm = _mm_set1_ps(m);
+  for (j=0; j+4<=n; j=j+4) {
+    x = _mm_loadu_ps(w+j);
+    y = _mm_loadu_ps(v+j);
+    a = _mm_add_ps(a, _mm_mul_ps(x, y));
+    _mm_storeu_ps(w+j, pycann_hebbian_sse2(x, y, g0u, g1, c, mm));
+  }
+  o = pycann_hsum_sse2(a);
+  for (; j<n; j=j+1) {
+    o = o+w[j]*v[j];
+    w[j] = w[j]+pycann_hebbian_dw(w[j], v[j], g, u, m);
+  }
+  return o;
+}
+
+static __attribute__((target("sse2"))) pycann_float_t pycann_dot_hebbian_sparse_sse2(pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m) {
+  unsigned int k;
+  __m128 a, x, y, g0u, g1, cc, mm;
+  pycann_float_t o;
+
+  a = _mm_setzero_ps();
+  g0u = _mm_set1_ps(g[0]*u);
+  g1 = _mm_set1_ps(g[1]);
+  cc = _mm_set1_ps(g[2]*u+g[3]);
+  mm = _mm_set1_ps(m);
+  for (k=0; k+4<=n; k=k+4) {
+    x = _mm_loadu_ps(w+k);
+    y = _mm_set_ps(v[c[k+3]], v[c[k+2]], v[c[k+1]], v[c[k]]);
+    a = _mm_add_ps(a, _mm_mul_ps(x, y));
+    _mm_storeu_ps(w+k, pycann_hebbian_sse2(x, y, g0u, g1, cc, mm));
+  }
+  o = pycann_hsum_sse2(a);
+  for (; k<n; k=k+1) {
+    o = o+w[k]*v[c[k]];
+    w[k] = w[k]+pycann_hebbian_dw(w[k], v[c[k]], g, u, m);
+  }
+  return o;
+}
+
+static __attribute__((target("sse2"))) void pycann_axpy_sse2(pycann_float_t *o, pycann_float_t w, const pycann_float_t *x, unsigned int n) {
+  unsigned int j;
+  __m128 ww;
+
+  ww = _mm_set1_ps(w);
+  for (j=0; j+4<=n; j=j+4) {
+    _mm_storeu_ps(o+j, _mm_add_ps(_mm_loadu_ps(o+j), _mm_mul_ps(ww, _mm_loadu_ps(x+j))));
+  }
+  for (; j<n; j=j+1) {
+    o[j] = o[j]+w*x[j];
+  }
+}
+
+// Sum of a row of gemv: s (the vector part) plus columns j upto (excluding)
+// n. Every row goes through this, so its sum doesn't depend on the rows
+// computed along with it.
+static PYCANN_NO_VECTORIZE pycann_float_t pycann_gemv_tail(pycann_float_t s, const pycann_float_t *w, const pycann_float_t *a, unsigned int j, unsigned int n) {
+  for (; j<n; j=j+1) {
+    s = s+w[j]*a[j];
+  }
+  return s;
+}
+
+// gemv with 4 rows at a time, each loaded block of a is used for all of them
+static __attribute__((target("sse2"))) PYCANN_NO_VECTORIZE void pycann_gemv_sse2(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n) {
+  unsigned int r, j;
+  __m128 s0, s1, s2, s3, x;
+  const pycann_float_t *w0, *w1, *w2, *w3;
+
+  for (r=0; r+4<=rows; r=r+4) {
+    w0 = w+(size_t)r*ldw;
+    w1 = w0+ldw;
+    w2 = w1+ldw;
+    w3 = w2+ldw;
+    s0 = _mm_setzero_ps();
+    s1 = _mm_setzero_ps();
+    s2 = _mm_setzero_ps();
+    s3 = _mm_setzero_ps();
+    for (j=0; j+4<=n; j=j+4) {
+      x = _mm_loadu_ps(a+j);
+      s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(w0+j), x));
+      s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(w1+j), x));
+      s2 = _mm_add_ps(s2, _mm_mul_ps(_mm_loadu_ps(w2+j), x));
+      s3 = _mm_add_ps(s3, _mm_mul_ps(_mm_loadu_ps(w3+j), x));
+    }
+    o[r] = o[r]+pycann_gemv_tail(pycann_hsum_sse2(s0), w0, a, j, n);
+    o[r+1] = o[r+1]+pycann_gemv_tail(pycann_hsum_sse2(s1), w1, a, j, n);
+    o[r+2] = o[r+2]+pycann_gemv_tail(pycann_hsum_sse2(s2), w2, a, j, n);
+    o[r+3] = o[r+3]+pycann_gemv_tail(pycann_hsum_sse2(s3), w3, a, j, n);
+  }
+  for (; r<rows; r=r+1) {
+    w0 = w+(size_t)r*ldw;
+    s0 = _mm_setzero_ps();
+    for (j=0; j+4<=n; j=j+4) {
+      s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(w0+j), _mm_loadu_ps(a+j)));
+    }
+    o[r] = o[r]+pycann_gemv_tail(pycann_hsum_sse2(s0), w0, a, j, n);
+  }
+}
+
+// gemm with 4 rows times 4 columns held in registers
+static __attribute__((target("sse2"))) void pycann_gemm_sse2(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n, unsigned int nb) {
+  unsigned int r, k, b;
+  __m128 o0, o1, o2, o3, x;
+  const pycann_float_t *w0, *w1, *w2, *w3;
+
+  for (b=0; b+4<=nb; b=b+4) {
+    for (r=0; r+4<=rows; r=r+4) {
+      w0 = w+r*ldw;
+      w1 = w0+ldw;
+      w2 = w1+ldw;
+      w3 = w2+ldw;
+      o0 = _mm_loadu_ps(o+r*nb+b);
+      o1 = _mm_loadu_ps(o+(r+1)*nb+b);
+      o2 = _mm_loadu_ps(o+(r+2)*nb+b);
+      o3 = _mm_loadu_ps(o+(r+3)*nb+b);
+      for (k=0; k<n; k=k+1) {
+        x = _mm_loadu_ps(a+k*nb+b);
+        o0 = _mm_add_ps(o0, _mm_mul_ps(_mm_set1_ps(w0[k]), x));
+        o1 = _mm_add_ps(o1, _mm_mul_ps(_mm_set1_ps(w1[k]), x));
+        o2 = _mm_add_ps(o2, _mm_mul_ps(_mm_set1_ps(w2[k]), x));
+        o3 = _mm_add_ps(o3, _mm_mul_ps(_mm_set1_ps(w3[k]), x));
+      }
+      _mm_storeu_ps(o+r*nb+b, o0);
+      _mm_storeu_ps(o+(r+1)*nb+b, o1);
+      _mm_storeu_ps(o+(r+2)*nb+b, o2);
+      _mm_storeu_ps(o+(r+3)*nb+b, o3);
+    }
+    for (; r<rows; r=r+1) {
+      o0 = _mm_loadu_ps(o+r*nb+b);
+      for (k=0; k<n; k=k+1) {
+        o0 = _mm_add_ps(o0, _mm_mul_ps(_mm_set1_ps(w[r*ldw+k]), _mm_loadu_ps(a+k*nb+b)));
+      }
+      _mm_storeu_ps(o+r*nb+b, o0);
+    }
+  }
+  pycann_gemm_tail(o, rows, w, ldw, a, n, nb, b);
+}
+
+// pycann_sigmoid_approx of 4 values (fraction rounded half to even)
+static inline __attribute__((target("sse2"))) __m128 pycann_sigmoid_approx_sse2(__m128 x) {
+  __m128 z, f, p, one;
+  __m128i n;
+
+  one = _mm_set1_ps(1.0);
+  z = _mm_mul_ps(x, _mm_set1_ps(PYCANN_SIGMOID_SCALE));
+  z = _mm_min_ps(_mm_max_ps(z, _mm_set1_ps(-PYCANN_EXP2_LIMIT)), _mm_set1_ps(PYCANN_EXP2_LIMIT));
+  n = _mm_cvtps_epi32(z);
+  f = _mm_sub_ps(z, _mm_cvtepi32_ps(n));
+  p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(PYCANN_EXP2_P0), f), _mm_set1_ps(PYCANN_EXP2_P1));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(PYCANN_EXP2_P2));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(PYCANN_EXP2_P3));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(PYCANN_EXP2_P4));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(PYCANN_EXP2_P5));
+  p = _mm_add_ps(_mm_mul_ps(p, f), one);
+  p = _mm_mul_ps(p, _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23)));
+  return _mm_div_ps(one, _mm_add_ps(one, p));
+}
+
+static __attribute__((target("sse2"))) void pycann_sigmoid_sse2(pycann_float_t *y, const pycann_float_t *x, unsigned int n) {
+  unsigned int j, k;
+  pycann_float_t t[4];
+
+  for (j=0; j+4<=n; j=j+4) {
+    _mm_storeu_ps(y+j, pycann_sigmoid_approx_sse2(_mm_loadu_ps(x+j)));
+  }
+  // the tail goes through the vector code too, so a value's result doesn't
+  // depend on where a thread's slice of the run starts
+  if (j<n) {
+    for (k=0; k<4; k=k+1) {
+      t[k] = j+k<n?x[j+k]:0.0;
+    }
+    _mm_storeu_ps(t, pycann_sigmoid_approx_sse2(_mm_loadu_ps(t)));
+    for (k=0; j+k<n; k=k+1) {
+      y[j+k] = t[k];
+    }
+  }
+}
+
+static __attribute__((target("sse2"))) pycann_float_t pycann_dot_bf16_sse2(const uint16_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m128i x, z;
+  __m128 a0, a1;
+  pycann_float_t o;
+
+  z = _mm_setzero_si128();
+  a0 = _mm_setzero_ps();
+  a1 = _mm_setzero_ps();
+  for (j=0; j+8<=n; j=j+8) {
+    // bf16 are the upper halves of floats
+    x = _mm_loadu_si128((const __m128i*)(w+j));
+    a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_castsi128_ps(_mm_unpacklo_epi16(z, x)), _mm_loadu_ps(v+j)));
+    a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_castsi128_ps(_mm_unpackhi_epi16(z, x)), _mm_loadu_ps(v+j+4)));
+  }
+  o = pycann_hsum_sse2(_mm_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+pycann_bf16_to_float(w[j])*v[j];
+  }
+  return o;
+}
+
+static __attribute__((target("sse2"))) pycann_float_t pycann_dot_i8_sse2(const int8_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m128i x;
+  __m128 a0, a1;
+  pycann_float_t o;
+
+  a0 = _mm_setzero_ps();
+  a1 = _mm_setzero_ps();
+  for (j=0; j+8<=n; j=j+8) {
+    // sign extend 8 bytes to 16 and then 32 bits
+    x = _mm_loadl_epi64((const __m128i*)(w+j));
+    x = _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8);
+    a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)), _mm_loadu_ps(v+j)));
+    a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)), _mm_loadu_ps(v+j+4)));
+  }
+  o = pycann_hsum_sse2(_mm_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+(pycann_float_t)w[j]*v[j];
+  }
+  return o;
+}
+
+// SSE2 has no half precision conversion, fp16 uses the scalar kernel
+static const pycann_kernels_t pycann_kernels_sse2 = {
+  "sse2",
+  pycann_dot_sse2,
+  pycann_dot_sparse_sse2,
+  pycann_dot_hebbian_sse2,
+  pycann_dot_hebbian_sparse_sse2,
+  pycann_axpy_sse2,
+  pycann_gemm_sse2,
+  pycann_gemv_sse2,
+  pycann_sigmoid_sse2,
+  pycann_dot_f16_scalar,
+  pycann_dot_bf16_sse2,
+  pycann_dot_i8_sse2
+};
+
+
+/* AVX2 kernels */
+
+#define PYCANN_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+
+static inline PYCANN_TARGET_AVX2 float pycann_hsum_avx2(__m256 x) {
+  return pycann_hsum_sse2(_mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1)));
+}
+
+static PYCANN_TARGET_AVX2 pycann_float_t pycann_dot_avx2(const pycann_float_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m256 a0, a1;
+  pycann_float_t o;
+
+  a0 = _mm256_setzero_ps();
+  a1 = _mm256_setzero_ps();
+  for (j=0; j+16<=n; j=j+16) {
+    a0 = _mm256_fmadd_ps(_mm256_loadu_ps(w+j), _mm256_loadu_ps(v+j), a0);
+    a1 = _mm256_fmadd_ps(_mm256_loadu_ps(w+j+8), _mm256_loadu_ps(v+j+8), a1);
+  }
+  if (j+8<=n) {
+    a0 = _mm256_fmadd_ps(_mm256_loadu_ps(w+j), _mm256_loadu_ps(v+j), a0);
+    j = j+8;
+  }
+  o = pycann_hsum_avx2(_mm256_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+w[j]*v[j];
+  }
+  return o;
+}
+
+static PYCANN_TARGET_AVX2 pycann_float_t pycann_dot_sparse_avx2(const pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n) {
+  unsigned int k;
+  __m256 a;
+  pycann_float_t o;
+
+  a = _mm256_setzero_ps();
+  for (k=0; k+8<=n; k=k+8) {
+    a = _mm256_fmadd_ps(_mm256_loadu_ps(w+k), _mm256_i32gather_ps(v, _mm256_loadu_si256((const __m256i*)(c+k)), 4), a);
+  }
+  o = pycann_hsum_avx2(a);
+  for (; k<n; k=k+1) {
+    o = o+w[k]*v[c[k]];
+  }
+  return o;
+}
+
+// Hebbian update of 8 weights x with pre-synaptic activations y
+static inline PYCANN_TARGET_AVX2 __m256 pycann_hebbian_avx2(__m256 x, __m256 y, __m256 g0u, __m256 g1, __m256 c, __m256 m) {
+  __m256 dw, s;
+
+  dw = _mm256_mul_ps(m, _mm256_add_ps(_mm256_fmadd_ps(g0u, y, _mm256_mul_ps(g1, y)), c));
+  s = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(PYCANN_SIGN_MASK)));
+  return _mm256_add_ps(x, _mm256_xor_ps(dw, s));
+}
+
+static PYCANN_TARGET_AVX2 pycann_float_t pycann_dot_hebbian_avx2(pycann_float_t *w, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m) {
+  unsigned int j;
+  __m256 a, x, y, g0u, g1, c, mm;
+  pycann_float_t o;
+
+  a = _mm256_setzero_ps();
+  g0u = _mm256_set1_ps(g[0]*u);
+  g1 = _mm256_set1_ps(g[1]);
+  c = _mm256_set1_ps(g[2]*u+g[3]);
+  mm = _mm256_set1_ps(m);
+  for (j=0; j+8<=n; j=j+8) {
+    x = _mm256_loadu_ps(w+j);
+    y = _mm256_loadu_ps(v+j);
+    a = _mm256_fmadd_ps(x, y, a);
+    _mm256_storeu_ps(w+j, pycann_hebbian_avx2(x, y, g0u, g1, c, mm));
+  }
+  o = pycann_hsum_avx2(a);
+  for (; j<n; j=j+1) {
+    o = o+w[j]*v[j];
+    w[j] = w[j]+pycann_hebbian_dw(w[j], v[j], g, u, m);
+  }
+  return o;
+}
+
+static PYCANN_TARGET_AVX2 pycann_float_t pycann_dot_hebbian_sparse_avx2(pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m) {
+  unsigned int k;
+  __m256 a, x, y, g0u, g1, cc, mm;
+  pycann_float_t o;
+
+  a = _mm256_setzero_ps();
+  g0u = _mm256_set1_ps(g[0]*u);
+  g1 = _mm256_set1_ps(g[1]);
+  cc = _mm256_set1_ps(g[2]*u+g[3]);
+  mm = _mm256_set1_ps(m);
+  for (k=0; k+8<=n; k=k+8) {
+    x = _mm256_loadu_ps(w+k);
+    y = _mm256_i32gather_ps(v, _mm256_loadu_si256((const __m256i*)(c+k)), 4);
+    a = _mm256_fmadd_ps(x, y, a);
+    _mm256_storeu_ps(w+k, pycann_hebbian_avx2(x, y, g0u, g1, cc, mm));
+  }
+  o = pycann_hsum_avx2(a);
+  for (; k<n; k=k+1) {
+    o = o+w[k]*v[c[k]];
+    w[k] = w[k]+pycann_hebbian_dw(w[k], v[c[k]], g, u, m);
+  }
+  return o;
+}
+
+static PYCANN_TARGET_AVX2 void pycann_axpy_avx2(pycann_float_t *o, pycann_float_t w, const pycann_float_t *x, unsigned int n) {
+  unsigned int j;
+  __m256 ww;
+
+  ww = _mm256_set1_ps(w);
+  for (j=0; j+8<=n; j=j+8) {
+    _mm256_storeu_ps(o+j, _mm256_fmadd_ps(ww, _mm256_loadu_ps(x+j), _mm256_loadu_ps(o+j)));
+  }
+  for (; j<n; j=j+1) {
+    o[j] = o[j]+w*x[j];
+  }
+}
+
+// gemv with 4 rows at a time (see pycann_gemv_sse2)
+static PYCANN_TARGET_AVX2 PYCANN_NO_VECTORIZE void pycann_gemv_avx2(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n) {
+  unsigned int r, j;
+  __m256 s0, s1, s2, s3, x;
+  const pycann_float_t *w0, *w1, *w2, *w3;
+
+  for (r=0; r+4<=rows; r=r+4) {
+    w0 = w+(size_t)r*ldw;
+    w1 = w0+ldw;
+    w2 = w1+ldw;
+    w3 = w2+ldw;
+    s0 = _mm256_setzero_ps();
+    s1 = _mm256_setzero_ps();
+    s2 = _mm256_setzero_ps();
+    s3 = _mm256_setzero_ps();
+    for (j=0; j+8<=n; j=j+8) {
+      x = _mm256_loadu_ps(a+j);
+      s0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0+j), x, s0);
+      s1 = _mm256_fmadd_ps(_mm256_loadu_ps(w1+j), x, s1);
+      s2 = _mm256_fmadd_ps(_mm256_loadu_ps(w2+j), x, s2);
+      s3 = _mm256_fmadd_ps(_mm256_loadu_ps(w3+j), x, s3);
+    }
+    o[r] = o[r]+pycann_gemv_tail(pycann_hsum_avx2(s0), w0, a, j, n);
+    o[r+1] = o[r+1]+pycann_gemv_tail(pycann_hsum_avx2(s1), w1, a, j, n);
+    o[r+2] = o[r+2]+pycann_gemv_tail(pycann_hsum_avx2(s2), w2, a, j, n);
+    o[r+3] = o[r+3]+pycann_gemv_tail(pycann_hsum_avx2(s3), w3, a, j, n);
+  }
+  for (; r<rows; r=r+1) {
+    w0 = w+(size_t)r*ldw;
+    s0 = _mm256_setzero_ps();
+    for (j=0; j+8<=n; j=j+8) {
+      s0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0+j), _mm256_loadu_ps(a+j), s0);
+    }
+    o[r] = o[r]+pycann_gemv_tail(pycann_hsum_avx2(s0), w0, a, j, n);
+  }
+}
+
+// gemm with 4 rows times 8 columns held in registers
+static PYCANN_TARGET_AVX2 void pycann_gemm_avx2(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n, unsigned int nb) {
+  unsigned int r, k, b;
+  __m256 o0, o1, o2, o3, x;
+  const pycann_float_t *w0, *w1, *w2, *w3;
+
+  for (b=0; b+8<=nb; b=b+8) {
+    for (r=0; r+4<=rows; r=r+4) {
+      w0 = w+r*ldw;
+      w1 = w0+ldw;
+      w2 = w1+ldw;
+      w3 = w2+ldw;
+      o0 = _mm256_loadu_ps(o+r*nb+b);
+      o1 = _mm256_loadu_ps(o+(r+1)*nb+b);
+      o2 = _mm256_loadu_ps(o+(r+2)*nb+b);
+      o3 = _mm256_loadu_ps(o+(r+3)*nb+b);
+      for (k=0; k<n; k=k+1) {
+        x = _mm256_loadu_ps(a+k*nb+b);
+        o0 = _mm256_fmadd_ps(_mm256_broadcast_ss(w0+k), x, o0);
+        o1 = _mm256_fmadd_ps(_mm256_broadcast_ss(w1+k), x, o1);
+        o2 = _mm256_fmadd_ps(_mm256_broadcast_ss(w2+k), x, o2);
+        o3 = _mm256_fmadd_ps(_mm256_broadcast_ss(w3+k), x, o3);
+      }
+      _mm256_storeu_ps(o+r*nb+b, o0);
+      _mm256_storeu_ps(o+(r+1)*nb+b, o1);
+      _mm256_storeu_ps(o+(r+2)*nb+b, o2);
+      _mm256_storeu_ps(o+(r+3)*nb+b, o3);
+    }
+    for (; r<rows; r=r+1) {
+      o0 = _mm256_loadu_ps(o+r*nb+b);
+      for (k=0; k<n; k=k+1) {
+        o0 = _mm256_fmadd_ps(_mm256_broadcast_ss(w+r*ldw+k), _mm256_loadu_ps(a+k*nb+b), o0);
+      }
+      _mm256_storeu_ps(o+r*nb+b, o0);
+    }
+  }
+  pycann_gemm_tail(o, rows, w, ldw, a, n, nb, b);
+}
+
+// pycann_sigmoid_approx of 8 values (fraction rounded half to even)
+static inline PYCANN_TARGET_AVX2 __m256 pycann_sigmoid_approx_avx2(__m256 x) {
+  __m256 z, f, p, one;
+  __m256i n;
+
+  one = _mm256_set1_ps(1.0);
+  z = _mm256_mul_ps(x, _mm256_set1_ps(PYCANN_SIGMOID_SCALE));
+  z = _mm256_min_ps(_mm256_max_ps(z, _mm256_set1_ps(-PYCANN_EXP2_LIMIT)), _mm256_set1_ps(PYCANN_EXP2_LIMIT));
+  n = _mm256_cvtps_epi32(z);
+  f = _mm256_sub_ps(z, _mm256_cvtepi32_ps(n));
+  p = _mm256_fmadd_ps(_mm256_set1_ps(PYCANN_EXP2_P0), f, _mm256_set1_ps(PYCANN_EXP2_P1));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(PYCANN_EXP2_P2));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(PYCANN_EXP2_P3));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(PYCANN_EXP2_P4));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(PYCANN_EXP2_P5));
+  p = _mm256_fmadd_ps(p, f, one);
+  p = _mm256_mul_ps(p, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23)));
+  return _mm256_div_ps(one, _mm256_add_ps(one, p));
+}
+
+static PYCANN_TARGET_AVX2 void pycann_sigmoid_avx2(pycann_float_t *y, const pycann_float_t *x, unsigned int n) {
+  unsigned int j, k;
+  pycann_float_t t[8];
+
+  for (j=0; j+8<=n; j=j+8) {
+    _mm256_storeu_ps(y+j, pycann_sigmoid_approx_avx2(_mm256_loadu_ps(x+j)));
+  }
+  // the tail goes through the vector code too, so a value's result doesn't
+  // depend on where a thread's slice of the run starts
+  if (j<n) {
+    for (k=0; k<8; k=k+1) {
+      t[k] = j+k<n?x[j+k]:0.0;
+    }
+    _mm256_storeu_ps(t, pycann_sigmoid_approx_avx2(_mm256_loadu_ps(t)));
+    for (k=0; j+k<n; k=k+1) {
+      y[j+k] = t[k];
+    }
+  }
+}
+
+static PYCANN_TARGET_AVX2 pycann_float_t pycann_dot_f16_avx2(const uint16_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m256 a0, a1;
+  pycann_float_t o;
+
+  a0 = _mm256_setzero_ps();
+  a1 = _mm256_setzero_ps();
+  for (j=0; j+16<=n; j=j+16) {
+    a0 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(w+j))), _mm256_loadu_ps(v+j), a0);
+    a1 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(w+j+8))), _mm256_loadu_ps(v+j+8), a1);
+  }
+  o = pycann_hsum_avx2(_mm256_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+pycann_half_to_float(w[j])*v[j];
+  }
+  return o;
+}
+
+static PYCANN_TARGET_AVX2 pycann_float_t pycann_dot_bf16_avx2(const uint16_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m256 a0, a1;
+  pycann_float_t o;
+
+  a0 = _mm256_setzero_ps();
+  a1 = _mm256_setzero_ps();
+  for (j=0; j+16<=n; j=j+16) {
+    a0 = _mm256_fmadd_ps(_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(w+j))), 16)), _mm256_loadu_ps(v+j), a0);
+    a1 = _mm256_fmadd_ps(_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(w+j+8))), 16)), _mm256_loadu_ps(v+j+8), a1);
+  }
+  o = pycann_hsum_avx2(_mm256_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+pycann_bf16_to_float(w[j])*v[j];
+  }
+  return o;
+}
+
+static PYCANN_TARGET_AVX2 pycann_float_t pycann_dot_i8_avx2(const int8_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m256 a0, a1;
+  pycann_float_t o;
+
+  a0 = _mm256_setzero_ps();
+  a1 = _mm256_setzero_ps();
+  for (j=0; j+16<=n; j=j+16) {
+    a0 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(w+j)))), _mm256_loadu_ps(v+j), a0);
+    a1 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(w+j+8)))), _mm256_loadu_ps(v+j+8), a1);
+  }
+  o = pycann_hsum_avx2(_mm256_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+(pycann_float_t)w[j]*v[j];
+  }
+  return o;
+}
+
+static const pycann_kernels_t pycann_kernels_avx2 = {
+  "avx2",
+  pycann_dot_avx2,
+  pycann_dot_sparse_avx2,
+  pycann_dot_hebbian_avx2,
+  pycann_dot_hebbian_sparse_avx2,
+  pycann_axpy_avx2,
+  pycann_gemm_avx2,
+  pycann_gemv_avx2,
+  pycann_sigmoid_avx2,
+  pycann_dot_f16_avx2,
+  pycann_dot_bf16_avx2,
+  pycann_dot_i8_avx2
+};
+
+
+/* AVX-512 kernels (tails are handled with masked loads) */
+
+#define PYCANN_TARGET_AVX512 __attribute__((target("avx512f")))
+
+static inline PYCANN_TARGET_AVX512 __mmask16 pycann_tail_mask_avx512(unsigned int n) {
+  return (__mmask16)((1u<<n)-1);
+}
+
+static PYCANN_TARGET_AVX512 pycann_float_t pycann_dot_avx512(const pycann_float_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m512 a0, a1;
+  __mmask16 t;
+
+  a0 = _mm512_setzero_ps();
+  a1 = _mm512_setzero_ps();
+  for (j=0; j+32<=n; j=j+32) {
+    a0 = _mm512_fmadd_ps(_mm512_loadu_ps(w+j), _mm512_loadu_ps(v+j), a0);
+    a1 = _mm512_fmadd_ps(_mm512_loadu_ps(w+j+16), _mm512_loadu_ps(v+j+16), a1);
+  }
+  for (; j+16<=n; j=j+16) {
+    a0 = _mm512_fmadd_ps(_mm512_loadu_ps(w+j), _mm512_loadu_ps(v+j), a0);
+  }
+  if (j<n) {
+    t = pycann_tail_mask_avx512(n-j);
+    a1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(t, w+j), _mm512_maskz_loadu_ps(t, v+j), a1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(a0, a1));
+}
+
+static PYCANN_TARGET_AVX512 pycann_float_t pycann_dot_sparse_avx512(const pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n) {
+  unsigned int k;
+  __m512 a;
+  __mmask16 t;
+
+  a = _mm512_setzero_ps();
+  for (k=0; k+16<=n; k=k+16) {
+    a = _mm512_fmadd_ps(_mm512_loadu_ps(w+k), _mm512_i32gather_ps(_mm512_loadu_si512(c+k), v, 4), a);
+  }
+  if (k<n) {
+    t = pycann_tail_mask_avx512(n-k);
+    a = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(t, w+k), _mm512_mask_i32gather_ps(_mm512_setzero_ps(), t, _mm512_maskz_loadu_epi32(t, c+k), v, 4), a);
+  }
+  return _mm512_reduce_add_ps(a);
+}
+
+// Hebbian update of 16 weights x with pre-synaptic activations y
+static inline PYCANN_TARGET_AVX512 __m512 pycann_hebbian_avx512(__m512 x, __m512 y, __m512 g0u, __m512 g1, __m512 c, __m512 m) {
+  __m512i dw, s;
+
+  dw = _mm512_castps_si512(_mm512_mul_ps(m, _mm512_add_ps(_mm512_fmadd_ps(g0u, y, _mm512_mul_ps(g1, y)), c)));
+  s = _mm512_and_si512(_mm512_castps_si512(x), _mm512_set1_epi32(PYCANN_SIGN_MASK));
+  return _mm512_add_ps(x, _mm512_castsi512_ps(_mm512_xor_si512(dw, s)));
+}
+
+static PYCANN_TARGET_AVX512 pycann_float_t pycann_dot_hebbian_avx512(pycann_float_t *w, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m) {
+  unsigned int j;
+  __m512 a, x, y, g0u, g1, c, mm;
+  __mmask16 t;
+
+  a = _mm512_setzero_ps();
+  g0u = _mm512_set1_ps(g[0]*u);
+  g1 = _mm512_set1_ps(g[1]);
+  c = _mm512_set1_ps(g[2]*u+g[3]);
+  mm = _mm512_set1_ps(m);
+  for (j=0; j+16<=n; j=j+16) {
+    x = _mm512_loadu_ps(w+j);
+    y = _mm512_loadu_ps(v+j);
+    a = _mm512_fmadd_ps(x, y, a);
+    _mm512_storeu_ps(w+j, pycann_hebbian_avx512(x, y, g0u, g1, c, mm));
+  }
+  if (j<n) {
+    t = pycann_tail_mask_avx512(n-j);
+    x = _mm512_maskz_loadu_ps(t, w+j);
+    y = _mm512_maskz_loadu_ps(t, v+j);
+    a = _mm512_fmadd_ps(x, y, a);
+    _mm512_mask_storeu_ps(w+j, t, pycann_hebbian_avx512(x, y, g0u, g1, c, mm));
+  }
+  return _mm512_reduce_add_ps(a);
+}
+
+static PYCANN_TARGET_AVX512 pycann_float_t pycann_dot_hebbian_sparse_avx512(pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m) {
+  unsigned int k;
+  __m512 a, x, y, g0u, g1, cc, mm;
+  __mmask16 t;
+
+  a = _mm512_setzero_ps();
+  g0u = _mm512_set1_ps(g[0]*u);
+  g1 = _mm512_set1_ps(g[1]);
+  cc = _mm512_set1_ps(g[2]*u+g[3]);
+  mm = _mm512_set1_ps(m);
+  for (k=0; k+16<=n; k=k+16) {
+    x = _mm512_loadu_ps(w+k);
+    y = _mm512_i32gather_ps(_mm512_loadu_si512(c+k), v, 4);
+    a = _mm512_fmadd_ps(x, y, a);
+    _mm512_storeu_ps(w+k, pycann_hebbian_avx512(x, y, g0u, g1, cc, mm));
+  }
+  if (k<n) {
+    t = pycann_tail_mask_avx512(n-k);
+    x = _mm512_maskz_loadu_ps(t, w+k);
+    y = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), t, _mm512_maskz_loadu_epi32(t, c+k), v, 4);
+    a = _mm512_fmadd_ps(x, y, a);
+    _mm512_mask_storeu_ps(w+k, t, pycann_hebbian_avx512(x, y, g0u, g1, cc, mm));
+  }
+  return _mm512_reduce_add_ps(a);
+}
+
+static PYCANN_TARGET_AVX512 void pycann_axpy_avx512(pycann_float_t *o, pycann_float_t w, const pycann_float_t *x, unsigned int n) {
+  unsigned int j;
+  __m512 ww;
+  __mmask16 t;
+
+  ww = _mm512_set1_ps(w);
+  for (j=0; j+16<=n; j=j+16) {
+    _mm512_storeu_ps(o+j, _mm512_fmadd_ps(ww, _mm512_loadu_ps(x+j), _mm512_loadu_ps(o+j)));
+  }
+  if (j<n) {
+    t = pycann_tail_mask_avx512(n-j);
+    _mm512_mask_storeu_ps(o+j, t, _mm512_fmadd_ps(ww, _mm512_maskz_loadu_ps(t, x+j), _mm512_maskz_loadu_ps(t, o+j)));
+  }
+}
+
+// gemv with 4 rows at a time (see pycann_gemv_sse2), column tail masked
+static PYCANN_TARGET_AVX512 PYCANN_NO_VECTORIZE void pycann_gemv_avx512(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n) {
+  unsigned int r, j;
+  __m512 s0, s1, s2, s3, x;
+  __mmask16 t;
+  const pycann_float_t *w0, *w1, *w2, *w3;
+
+  t = pycann_tail_mask_avx512(n%16);
+  for (r=0; r+4<=rows; r=r+4) {
+    w0 = w+(size_t)r*ldw;
+    w1 = w0+ldw;
+    w2 = w1+ldw;
+    w3 = w2+ldw;
+    s0 = _mm512_setzero_ps();
+    s1 = _mm512_setzero_ps();
+    s2 = _mm512_setzero_ps();
+    s3 = _mm512_setzero_ps();
+    for (j=0; j+16<=n; j=j+16) {
+      x = _mm512_loadu_ps(a+j);
+      s0 = _mm512_fmadd_ps(_mm512_loadu_ps(w0+j), x, s0);
+      s1 = _mm512_fmadd_ps(_mm512_loadu_ps(w1+j), x, s1);
+      s2 = _mm512_fmadd_ps(_mm512_loadu_ps(w2+j), x, s2);
+      s3 = _mm512_fmadd_ps(_mm512_loadu_ps(w3+j), x, s3);
+    }
+    if (j<n) {
+      x = _mm512_maskz_loadu_ps(t, a+j);
+      s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(t, w0+j), x, s0);
+      s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(t, w1+j), x, s1);
+      s2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(t, w2+j), x, s2);
+      s3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(t, w3+j), x, s3);
+    }
+    o[r] = o[r]+_mm512_reduce_add_ps(s0);
+    o[r+1] = o[r+1]+_mm512_reduce_add_ps(s1);
+    o[r+2] = o[r+2]+_mm512_reduce_add_ps(s2);
+    o[r+3] = o[r+3]+_mm512_reduce_add_ps(s3);
+  }
+  for (; r<rows; r=r+1) {
+    w0 = w+(size_t)r*ldw;
+    s0 = _mm512_setzero_ps();
+    for (j=0; j+16<=n; j=j+16) {
+      s0 = _mm512_fmadd_ps(_mm512_loadu_ps(w0+j), _mm512_loadu_ps(a+j), s0);
+    }
+    if (j<n) {
+      s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(t, w0+j), _mm512_maskz_loadu_ps(t, a+j), s0);
+    }
+    o[r] = o[r]+_mm512_reduce_add_ps(s0);
+  }
+}
+
+// gemm with 4 rows times 16 columns held in registers, column tail masked
+static PYCANN_TARGET_AVX512 void pycann_gemm_avx512(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n, unsigned int nb) {
+  unsigned int r, k, b;
+  __m512 o0, o1, o2, o3, x;
+  __mmask16 t;
+  const pycann_float_t *w0, *w1, *w2, *w3;
+
+  for (b=0; b<nb; b=b+16) {
+    t = nb-b>=16?(__mmask16)0xFFFF:pycann_tail_mask_avx512(nb-b);
+    for (r=0; r+4<=rows; r=r+4) {
+      w0 = w+r*ldw;
+      w1 = w0+ldw;
+      w2 = w1+ldw;
+      w3 = w2+ldw;
+      o0 = _mm512_maskz_loadu_ps(t, o+r*nb+b);
+      o1 = _mm512_maskz_loadu_ps(t, o+(r+1)*nb+b);
+      o2 = _mm512_maskz_loadu_ps(t, o+(r+2)*nb+b);
+      o3 = _mm512_maskz_loadu_ps(t, o+(r+3)*nb+b);
+      for (k=0; k<n; k=k+1) {
+        x = _mm512_maskz_loadu_ps(t, a+k*nb+b);
+        o0 = _mm512_fmadd_ps(_mm512_set1_ps(w0[k]), x, o0);
+        o1 = _mm512_fmadd_ps(_mm512_set1_ps(w1[k]), x, o1);
+        o2 = _mm512_fmadd_ps(_mm512_set1_ps(w2[k]), x, o2);
+        o3 = _mm512_fmadd_ps(_mm512_set1_ps(w3[k]), x, o3);
+      }
+      _mm512_mask_storeu_ps(o+r*nb+b, t, o0);
+      _mm512_mask_storeu_ps(o+(r+1)*nb+b, t, o1);
+      _mm512_mask_storeu_ps(o+(r+2)*nb+b, t, o2);
+      _mm512_mask_storeu_ps(o+(r+3)*nb+b, t, o3);
+    }
+    for (; r<rows; r=r+1) {
+      o0 = _mm512_maskz_loadu_ps(t, o+r*nb+b);
+      for (k=0; k<n; k=k+1) {
+        o0 = _mm512_fmadd_ps(_mm512_set1_ps(w[r*ldw+k]), _mm512_maskz_loadu_ps(t, a+k*nb+b), o0);
+      }
+      _mm512_mask_storeu_ps(o+r*nb+b, t, o0);
+    }
+  }
+}
+
+// pycann_sigmoid_approx of 16 values (fraction rounded half to even)
+static inline PYCANN_TARGET_AVX512 __m512 pycann_sigmoid_approx_avx512(__m512 x) {
+  __m512 z, f, p, one;
+  __m512i n;
+
+  one = _mm512_set1_ps(1.0);
+  z = _mm512_mul_ps(x, _mm512_set1_ps(PYCANN_SIGMOID_SCALE));
+  z = _mm512_min_ps(_mm512_max_ps(z, _mm512_set1_ps(-PYCANN_EXP2_LIMIT)), _mm512_set1_ps(PYCANN_EXP2_LIMIT));
+  n = _mm512_cvtps_epi32(z);
+  f = _mm512_sub_ps(z, _mm512_cvtepi32_ps(n));
+  p = _mm512_fmadd_ps(_mm512_set1_ps(PYCANN_EXP2_P0), f, _mm512_set1_ps(PYCANN_EXP2_P1));
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(PYCANN_EXP2_P2));
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(PYCANN_EXP2_P3));
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(PYCANN_EXP2_P4));
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(PYCANN_EXP2_P5));
+  p = _mm512_fmadd_ps(p, f, one);
+  p = _mm512_mul_ps(p, _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(127)), 23)));
+  return _mm512_div_ps(one, _mm512_add_ps(one, p));
+}
+
+static PYCANN_TARGET_AVX512 void pycann_sigmoid_avx512(pycann_float_t *y, const pycann_float_t *x, unsigned int n) {
+  unsigned int j;
+  __mmask16 t;
+
+  for (j=0; j+16<=n; j=j+16) {
+    _mm512_storeu_ps(y+j, pycann_sigmoid_approx_avx512(_mm512_loadu_ps(x+j)));
+  }
+  if (j<n) {
+    t = pycann_tail_mask_avx512(n-j);
+    _mm512_mask_storeu_ps(y+j, t, pycann_sigmoid_approx_avx512(_mm512_maskz_loadu_ps(t, x+j)));
+  }
+}
+
+// Quantized weights have no masked loads without AVX-512BW, tails are scalar
+static PYCANN_TARGET_AVX512 pycann_float_t pycann_dot_f16_avx512(const uint16_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m512 a0, a1;
+  pycann_float_t o;
+
+  a0 = _mm512_setzero_ps();
+  a1 = _mm512_setzero_ps();
+  for (j=0; j+32<=n; j=j+32) {
+    a0 = _mm512_fmadd_ps(_mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(w+j))), _mm512_loadu_ps(v+j), a0);
+    a1 = _mm512_fmadd_ps(_mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(w+j+16))), _mm512_loadu_ps(v+j+16), a1);
+  }
+  o = _mm512_reduce_add_ps(_mm512_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+pycann_half_to_float(w[j])*v[j];
+  }
+  return o;
+}
+
+static PYCANN_TARGET_AVX512 pycann_float_t pycann_dot_bf16_avx512(const uint16_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m512 a0, a1;
+  pycann_float_t o;
+
+  a0 = _mm512_setzero_ps();
+  a1 = _mm512_setzero_ps();
+  for (j=0; j+32<=n; j=j+32) {
+    a0 = _mm512_fmadd_ps(_mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(w+j))), 16)), _mm512_loadu_ps(v+j), a0);
+    a1 = _mm512_fmadd_ps(_mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(w+j+16))), 16)), _mm512_loadu_ps(v+j+16), a1);
+  }
+  o = _mm512_reduce_add_ps(_mm512_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+pycann_bf16_to_float(w[j])*v[j];
+  }
+  return o;
+}
+
+static PYCANN_TARGET_AVX512 pycann_float_t pycann_dot_i8_avx512(const int8_t *w, const pycann_float_t *v, unsigned int n) {
+  unsigned int j;
+  __m512 a0, a1;
+  pycann_float_t o;
+
+  a0 = _mm512_setzero_ps();
+  a1 = _mm512_setzero_ps();
+  for (j=0; j+32<=n; j=j+32) {
+    a0 = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(w+j)))), _mm512_loadu_ps(v+j), a0);
+    a1 = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(w+j+16)))), _mm512_loadu_ps(v+j+16), a1);
+  }
+  o = _mm512_reduce_add_ps(_mm512_add_ps(a0, a1));
+  for (; j<n; j=j+1) {
+    o = o+(pycann_float_t)w[j]*v[j];
+  }
+  return o;
+}
+
+static const pycann_kernels_t pycann_kernels_avx512 = {
+  "avx512",
+  pycann_dot_avx512,
+  pycann_dot_sparse_avx512,
+  pycann_dot_hebbian_avx512,
+  pycann_dot_hebbian_sparse_avx512,
+  pycann_axpy_avx512,
+  pycann_gemm_avx512,
+  pycann_gemv_avx512,
+  pycann_sigmoid_avx512,
+  pycann_dot_f16_avx512,
+  pycann_dot_bf16_avx512,
+  pycann_dot_i8_avx512
+};
+
+#endif /* PYCANN_X86 */
+
+
+const pycann_kernels_t *pycann_kernels = &pycann_kernels_scalar;
+
+// Select kernels by name ("auto" selects the best one)
+int pycann_kernels_select(const char *name) {
+  int automatic;
+
+  automatic = strcmp(name, "auto")==0;
+
+#ifdef PYCANN_X86
+  __builtin_cpu_init();
+
+  if ((automatic || strcmp(name, "avx512")==0) && __builtin_cpu_supports("avx512f")) {
+    pycann_kernels = &pycann_kernels_avx512;
+    return 0;
+  }
+  if ((automatic || strcmp(name, "avx2")==0) && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+    pycann_kernels = &pycann_kernels_avx2;
+    return 0;
+  }
+  if ((automatic || strcmp(name, "sse2")==0) && __builtin_cpu_supports("sse2")) {
+    pycann_kernels = &pycann_kernels_sse2;
+    return 0;
+  }
+#endif /* PYCANN_X86 */
+
+  if (automatic || strcmp(name, "scalar")==0) {
+    pycann_kernels = &pycann_kernels_scalar;
+    return 0;
+  }
+
+  return -1;
+}
+
+// Select kernels on library load
+static void __attribute__((constructor)) pycann_kernels_init(void) {
+  const char *name;
+
+  name = getenv("PYCANN_KERNEL");
+  if (name==NULL || pycann_kernels_select(name)!=0) {
+    pycann_kernels_select("auto");
+  }
+}
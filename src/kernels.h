@@ -0,0 +1,184 @@
+/*
+ pycann - Neural network library
+ A Python/C hybrid for fast neural networks in Python
+ Copyright (C) 2010  Janosch Gräf <janosch.graef@gmx.net>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Internal header: compute kernels used by the step functions.
+// Not installed, not part of the public API.
+
+#ifndef _PYCANN_KERNELS_H_
+#define _PYCANN_KERNELS_H_
+
+#include <stdint.h> /* int8_t, uint16_t, int32_t, uint32_t */
+
+#include "pycann.h"
+
+// Keep the compiler from vectorizing a function
+#define PYCANN_NO_VECTORIZE __attribute__((optimize("no-tree-vectorize")))
+
+// Set of kernels for one instruction set.
+//
+// Hebbian kernels return the same dot product as their non-plastic
+// counterparts (computed with the weights *before* the update) and apply
+//   w += sign(w) * m * (g[0]*u*v + g[1]*v + g[2]*u + g[3])
+// to every visited weight, where v is the pre-synaptic and u the
+// post-synaptic activation.
+typedef struct {
+  const char *name;
+
+  // sum(w[j]*v[j]) for j<n
+  pycann_float_t (*dot)(const pycann_float_t *w, const pycann_float_t *v, unsigned int n);
+  // sum(w[k]*v[c[k]]) for k<n
+  pycann_float_t (*dot_sparse)(const pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n);
+
+  // dot with Hebbian update of w
+  pycann_float_t (*dot_hebbian)(pycann_float_t *w, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m);
+  // dot_sparse with Hebbian update of w
+  pycann_float_t (*dot_hebbian_sparse)(pycann_float_t *w, const unsigned int *c, const pycann_float_t *v, unsigned int n, const pycann_float_t *g, pycann_float_t u, pycann_float_t m);
+
+  // o[j] += w*x[j] for j<n (batched propagation)
+  void (*axpy)(pycann_float_t *o, pycann_float_t w, const pycann_float_t *x, unsigned int n);
+  // o[r*nb+b] += sum(w[r*ldw+k]*a[k*nb+b]) for r<rows, k<n, b<nb (batched propagation)
+  void (*gemm)(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n, unsigned int nb);
+  // o[r] += sum(w[r*ldw+k]*a[k]) for r<rows, k<n (blocked stepping), the sum
+  // of a row must not depend on the other rows
+  void (*gemv)(pycann_float_t *o, unsigned int rows, const pycann_float_t *w, unsigned int ldw, const pycann_float_t *a, unsigned int n);
+
+  // y[j] = pycann_sigmoid_approx(x[j]) for j<n (y may be x), up to rounding:
+  // a value's result must not depend on its position or on n
+  void (*sigmoid)(pycann_float_t *y, const pycann_float_t *x, unsigned int n);
+
+  // dot with quantized weights (fp16, bf16, int8 without the row's scale)
+  pycann_float_t (*dot_f16)(const uint16_t *w, const pycann_float_t *v, unsigned int n);
+  pycann_float_t (*dot_bf16)(const uint16_t *w, const pycann_float_t *v, unsigned int n);
+  pycann_float_t (*dot_i8)(const int8_t *w, const pycann_float_t *v, unsigned int n);
+} pycann_kernels_t;
+
+// Approximate sigmoid: 2^z, z = PYCANN_SIGMOID_BETA*log2(e)*x, is computed
+// from the integer part of z (put into the exponent bits) and a polynomial
+// for the fraction f in [-0.5, 0.5], 2^f = 1+f*P(f) (relative error below
+// 2e-7). The sigmoid's error is at most a quarter of that, the bound
+// PYCANN_SIGMOID_APPROX_ERROR leaves room for rounding. z is clamped, beyond
+// the sigmoid is 0 or 1 within the bound anyway.
+#define PYCANN_SIGMOID_SCALE (PYCANN_SIGMOID_BETA*1.44269504088896341)
+#define PYCANN_EXP2_LIMIT 64.0
+#define PYCANN_EXP2_P0 1.535336188319500e-4
+#define PYCANN_EXP2_P1 1.339887440266574e-3
+#define PYCANN_EXP2_P2 9.618437357674640e-3
+#define PYCANN_EXP2_P3 5.550332471162809e-2
+#define PYCANN_EXP2_P4 2.402264791363012e-1
+#define PYCANN_EXP2_P5 6.931472028550421e-1
+
+// Approximation of 1/(1+exp(PYCANN_SIGMOID_BETA*x)) (PYCANN_SIGMOID_APPROX)
+static inline pycann_float_t pycann_sigmoid_approx(pycann_float_t x) {
+  union {
+    float f;
+    int32_t i;
+  } e;
+  pycann_float_t z, f, p;
+  int32_t n;
+
+  z = PYCANN_SIGMOID_SCALE*x;
+  z = z>PYCANN_EXP2_LIMIT?PYCANN_EXP2_LIMIT:(z<-PYCANN_EXP2_LIMIT?-PYCANN_EXP2_LIMIT:z);
+  n = (int32_t)(z>=0.0?z+0.5:z-0.5);
+  f = z-(pycann_float_t)n;
+  p = ((((PYCANN_EXP2_P0*f+PYCANN_EXP2_P1)*f+PYCANN_EXP2_P2)*f+PYCANN_EXP2_P3)*f+PYCANN_EXP2_P4)*f+PYCANN_EXP2_P5;
+  e.i = (n+127)<<23;
+  return 1.0/(1.0+(1.0+f*p)*e.f);
+}
+
+// Bits of a float
+typedef union {
+  float f;
+  uint32_t i;
+} pycann_float_bits_t;
+
+// IEEE half precision to float
+static inline pycann_float_t pycann_half_to_float(uint16_t h) {
+  pycann_float_bits_t u;
+  uint32_t e, m;
+
+  e = (h>>10)&0x1f;
+  m = h&0x3ff;
+  if (e==0) {
+    // zero or subnormal (m*2^-24)
+    u.f = (pycann_float_t)m*(1.0/16777216.0);
+  }
+  else if (e==31) {
+    // infinity or NaN
+    u.i = 0x7f800000|(m<<13);
+  }
+  else {
+    u.i = ((e+112)<<23)|(m<<13);
+  }
+  u.i = u.i|((uint32_t)(h&0x8000)<<16);
+  return u.f;
+}
+
+// Float to IEEE half precision (rounded to nearest even)
+static inline uint16_t pycann_float_to_half(pycann_float_t f) {
+  pycann_float_bits_t u, d;
+  uint32_t s, o;
+
+  u.f = f;
+  s = (u.i>>16)&0x8000;
+  u.i = u.i&0x7fffffff;
+  if (u.i>=(uint32_t)(127+16)<<23) {
+    // too large for a half: infinity (NaN stays NaN)
+    o = u.i>0x7f800000?0x7e00:0x7c00;
+  }
+  else if (u.i<(uint32_t)113<<23) {
+    // subnormal half: let the FPU round by adding 0.5
+    d.i = (uint32_t)126<<23;
+    u.f = u.f+d.f;
+    o = u.i-d.i;
+  }
+  else {
+    o = (u.i+((uint32_t)(15-127)<<23)+0xfff+((u.i>>13)&1))>>13;
+  }
+  return o|s;
+}
+
+// bfloat16 (upper half of a float) to float
+static inline pycann_float_t pycann_bf16_to_float(uint16_t h) {
+  pycann_float_bits_t u;
+
+  u.i = (uint32_t)h<<16;
+  return u.f;
+}
+
+// Float to bfloat16 (rounded to nearest even)
+static inline uint16_t pycann_float_to_bf16(pycann_float_t f) {
+  pycann_float_bits_t u;
+
+  u.f = f;
+  if ((u.i&0x7fffffff)>0x7f800000) {
+    return (u.i>>16)|0x40; // quiet NaN
+  }
+  return (u.i+0x7fff+((u.i>>16)&1))>>16;
+}
+
+// Kernels in use (selected on library load, see pycann_set_kernel)
+extern const pycann_kernels_t *pycann_kernels;
+
+// Scalar reference kernels (always available)
+extern const pycann_kernels_t pycann_kernels_scalar;
+
+// Select kernels by name, returns -1 if not supported by this CPU
+int pycann_kernels_select(const char *name);
+
+#endif /* _PYCANN_KERNELS_H_ */
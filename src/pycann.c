@@ -17,31 +17,82 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <stdlib.h> /* malloc, free */
+#define _GNU_SOURCE /* pthread_setaffinity_np, CPU_SET */
+
+#include <stdlib.h> /* malloc, free, getenv */
 #include <stdarg.h> /* va_list, va_start, va_end */
 #include <stdio.h> /* vsnprintf, fopen, fclose, fread, fwrite */
 #include <string.h> /* memcpy */
-#include <stdint.h> /* uint16_t, uint32_t */
-#include <math.h> /* exp */
+#include <stdint.h> /* uint16_t, uint32_t, uint64_t, SIZE_MAX */
+#include <limits.h> /* UINT_MAX */
+#include <math.h> /* expf, ldexp, lround, sqrt, log, cos */
+#include <unistd.h> /* sysconf, close, syscall */
+#include <sched.h> /* sched_getaffinity */
+#include <sys/syscall.h> /* SYS_getcpu, SYS_move_pages */
+#include <fcntl.h> /* open */
+#include <sys/stat.h> /* fstat */
+#include <sys/mman.h> /* mmap, munmap, memfd_create */
+#include <time.h> /* clock_gettime */
 
 #ifdef PYCANN_THREADING
 #include <pthread.h>
-#include <unistd.h> /* sleep */
 #endif /* PYCANN_THREADING */
 
 #include "pycann.h"
+#include "kernels.h"
+
+
+// Internal flag for pycann_new_ex: gammas, weights and thresholds are left to
+// the loader (mapped from a v4 file)
+#define PYCANN_NEW_MAPPED 0x8000
+
+// Parameters handed out in place (bits of params_exposed)
+#define PYCANN_EXPOSED_WEIGHTS    0x1 // see pycann_get_weights_buffer
+#define PYCANN_EXPOSED_THRESHOLDS 0x2 // see pycann_get_thresholds_buffer
+
+// Flags of pycann_load_file_ex passed on to pycann_new_ex
+#define PYCANN_NEW_LOAD_FLAGS (PYCANN_NEW_HUGEPAGES|PYCANN_NEW_SHARED_POOL|PYCANN_NEW_PIN_THREADS|PYCANN_NEW_FIRST_TOUCH)
+
+// Random weights are picked by scanning rows with at least 1/PYCANN_RANDOM_SCAN_DENSITY
+// of all synapses (see pycann_random_rows)
+#define PYCANN_RANDOM_SCAN_DENSITY 3
+
+// Arenas of at least this many bytes are mapped instead of allocated from the heap
+#define PYCANN_ARENA_MMAP_THRESHOLD (128*1024)
+
+// Round n up to a multiple of a
+#define PYCANN_ALIGN(n, a) (((n)+(a)-1)/(a)*(a))
 
+// Weights per dense row of a network with size neurons
+#define PYCANN_STRIDE(size) PYCANN_ALIGN((size), PYCANN_ALIGNMENT/sizeof(pycann_float_t))
+
+// Synchronous steps done in pairs: the head step also sums the part of the
+// next step's net inputs it can, the tail step sums the rest (see
+// pycann_single_step)
+typedef enum {
+  PYCANN_FUSE_NONE = 0,
+  PYCANN_FUSE_HEAD = 1,
+  PYCANN_FUSE_TAIL = 2
+} pycann_fuse_t;
 
 // Prototypes of static functions
 // TODO add remaining
-static void pycann_single_step(pycann_t *net, unsigned int first, unsigned int last);
+static unsigned long pycann_single_step(pycann_t *net, unsigned int first, unsigned int last, const pycann_float_t *src, pycann_float_t *dst, const pycann_float_t *inputs, pycann_fuse_t fuse);
+static inline pycann_fuse_t pycann_step_fuse(pycann_t *net, unsigned int s, unsigned int n, unsigned int first, unsigned int last);
+static inline const pycann_float_t *pycann_step_inputs(pycann_t *net, unsigned int s);
+static void pycann_sequence_record(pycann_t *net, unsigned int s, unsigned int first, unsigned int last, const pycann_float_t *a);
+static inline void pycann_step_buffers(pycann_t *net, unsigned int s, pycann_float_t **src, pycann_float_t **dst);
+static void pycann_delta_free(pycann_t *net);
+static inline void pycann_stable_before(pycann_t *net, unsigned int first, unsigned int last, const pycann_float_t *src, pycann_float_t *dst);
+static inline pycann_float_t pycann_stable_change(pycann_t *net, unsigned int first, unsigned int last, const pycann_float_t *src, const pycann_float_t *dst);
 
 
-// Buffer for current error
+// Buffer for current error (one per thread, so errors of networks used by
+// different threads don't mix)
 #define PYCANN_ERROR_SIZE 1024
-static char pycann_error[PYCANN_ERROR_SIZE];
+static __thread char pycann_error[PYCANN_ERROR_SIZE];
 
-// Get current error
+// Get current error of the calling thread
 const char *pycann_get_error(void) {
   return pycann_error;
 }
@@ -61,321 +112,2272 @@ static void pycann_set_error(const char *fmt, ...) {
 }
 
 
-// pycann's malloc functions (keeps track of used memory)
-static void *pycann_malloc(pycann_t *net, unsigned int n) {
-  net->memory_usage += n;
-  return malloc(n);
+// Seeds of networks not seeded with pycann_set_seed are taken from this
+// counter (in order of creation)
+static uint64_t pycann_seed_counter = 0;
+
+// Output function of SplitMix64
+static inline uint64_t pycann_mix64(uint64_t z) {
+  z = (z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+  z = (z^(z>>27))*0x94d049bb133111ebULL;
+  return z^(z>>31);
 }
 
+// Next 64 random bits of the network's generator (SplitMix64)
+static inline uint64_t pycann_random(pycann_t *net) {
+  net->random_state += 0x9e3779b97f4a7c15ULL;
+  return pycann_mix64(net->random_state);
+}
 
-#ifdef PYCANN_THREADING
-static void pycann_thread_yield(void) {
-  sleep(0);
+// Random bits number c of the stream seed (counter-based, the same as output
+// c+1 of SplitMix64 seeded with seed, so any thread can compute it)
+static inline uint64_t pycann_random_at(uint64_t seed, uint64_t c) {
+  return pycann_mix64(seed+(c+1)*0x9e3779b97f4a7c15ULL);
 }
 
-// Thread main function
-static void *pycann_thread_main(void *param) {
-  pycann_t *net = (pycann_t*)param;
-  pthread_t thread;
-  pycann_thread_t *self = NULL;
-  unsigned int n, i;
+// Random number in [0, 1)
+static inline pycann_float_t pycann_random_float(pycann_t *net) {
+  return (pycann_float_t)(pycann_random(net)>>40)*(1.0/16777216.0);
+}
 
-  unsigned int self_id;
 
-  // Find own thread structure
-  thread = pthread_self();
-  for (i=0; i<net->num_threads; i=i+1) {
-    if (pthread_equal(thread, net->threads[i].thread)) {
-      self = net->threads+i;
-      break;
-    }
+// Check if p points into the network's file mapping
+static inline int pycann_is_mapped(pycann_t *net, const void *p) {
+  return net->mapping!=NULL && (const char*)p>=(const char*)net->mapping && (const char*)p<(const char*)net->mapping+net->mapping_size;
+}
+
+// Check if p points into the network's arena
+static inline int pycann_in_arena(pycann_t *net, const void *p) {
+  return net->arena!=NULL && (const char*)p>=(const char*)net->arena && (const char*)p<(const char*)net->arena+net->arena_size;
+}
+
+// Give the whole pages of the n bytes at p (in the arena) back to the system
+static void pycann_arena_release(pycann_t *net, void *p, size_t n) {
+  uintptr_t a, b;
+
+  if (net->arena_page_size==0) {
+    return;
   }
-  if (self==NULL) {
-    pycann_set_error("THREAD INTERNAL ERROR: %s:%d\n", __FILE__, __LINE__);
+  a = PYCANN_ALIGN((uintptr_t)p, net->arena_page_size);
+  b = ((uintptr_t)p+n)/net->arena_page_size*net->arena_page_size;
+  if (a<b && madvise((void*)a, b-a, MADV_DONTNEED)==0) {
+    net->memory_usage -= b-a;
+  }
+}
+
+// pycann's malloc functions (keeps track of used memory, memory is aligned to
+// PYCANN_ALIGNMENT). Mapped memory isn't counted, it's copied when
+// reallocated and left alone when freed. The same goes for the arena, but
+// the pages of freed buffers are released.
+static void *pycann_malloc(pycann_t *net, size_t n) {
+  void *p;
+
+  if (posix_memalign(&p, PYCANN_ALIGNMENT, n)!=0) {
     return NULL;
   }
+  net->memory_usage += n;
+  return p;
+}
+static void *pycann_realloc(pycann_t *net, void *p, size_t old_n, size_t n) {
+  void *q;
 
-  self_id = i;
+  if (pycann_is_mapped(net, p) || pycann_in_arena(net, p)) {
+    q = malloc(n);
+    if (q!=NULL) {
+      memcpy(q, p, old_n<n?old_n:n);
+      net->memory_usage += n;
+    }
+    return q;
+  }
+  net->memory_usage += n-old_n;
+  return realloc(p, n);
+}
+static void pycann_free(pycann_t *net, void *p, size_t n) {
+  if (pycann_in_arena(net, p)) {
+    pycann_arena_release(net, p, n);
+  }
+  else if (p!=NULL && !pycann_is_mapped(net, p)) {
+    net->memory_usage -= n;
+    free(p);
+  }
+}
 
-  while (1) {
-    // Cancellation point
-    pthread_testcancel();
+// Bytes of a size*stride matrix of elements of n bytes, at most a float
+// (pycann_new_ex rejects networks whose dense weights don't fit in a size_t)
+static size_t pycann_matrix_size(pycann_t *net, size_t n) {
+  return n*net->size*net->stride;
+}
 
-    n = self->steps;
+// Allocate a zero-filled arena of at least n bytes. Small arenas come from
+// the heap (arena_page_size is 0 then), others are mapped anonymously (so
+// are all arenas with PYCANN_NEW_FIRST_TOUCH, their pages must be untouched). With
+// PYCANN_NEW_HUGEPAGES explicit huge pages are tried first, then transparent
+// huge pages.
+static int pycann_arena_new(pycann_t *net, size_t n, unsigned int flags) {
+  void *p;
 
-    if (n==0) {
-      // If nothing to do: sleep shortly to give CPU a rest
-      // this must be longer, if thread really idles
-      pycann_thread_yield();
+  if (n<PYCANN_ARENA_MMAP_THRESHOLD && !(flags&(PYCANN_NEW_HUGEPAGES|PYCANN_NEW_FIRST_TOUCH))) {
+    if (posix_memalign(&p, PYCANN_ALIGNMENT, n)!=0) {
+      net->arena = NULL;
+      return -1;
     }
-    else {
-      // Else do steps
-      for (i=0; i<n; i=i+1) {
-        pycann_single_step(net, self->first_neuron, self->last_neuron);
-      }
+    memset(p, 0, n);
+    net->arena = p;
+    net->arena_size = n;
+    net->arena_page_size = 0;
+    net->memory_usage += n;
+    return 0;
+  }
 
-      // Done. Reset 'steps' to 0
-      self->steps = 0;
+  p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (flags&PYCANN_NEW_HUGEPAGES) {
+    net->arena_page_size = PYCANN_HUGE_PAGE_SIZE;
+    net->arena_size = PYCANN_ALIGN(n, net->arena_page_size);
+    p = mmap(NULL, net->arena_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  }
+#endif /* MAP_HUGETLB */
+  if (p==MAP_FAILED) {
+    net->arena_page_size = sysconf(_SC_PAGESIZE);
+    net->arena_size = PYCANN_ALIGN(n, net->arena_page_size);
+    p = mmap(NULL, net->arena_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p==MAP_FAILED) {
+      net->arena = NULL;
+      return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    if (flags&PYCANN_NEW_HUGEPAGES) {
+      madvise(p, net->arena_size, MADV_HUGEPAGE);
     }
+#endif /* MADV_HUGEPAGE */
   }
-
-  return NULL;
+  net->arena = p;
+  net->memory_usage += net->arena_size;
+  return 0;
 }
-#endif /* PYCANN_THREADING */
 
-// Create new network
-pycann_t *pycann_new(unsigned int size, unsigned int num_inputs, unsigned int num_outputs, unsigned int num_threads) {
-  pycann_t *net;
-  unsigned int i, j, s, r;
+// Free the arena
+static void pycann_arena_del(pycann_t *net) {
+  if (net->arena_page_size==0) {
+    free(net->arena);
+  }
+  else {
+    munmap(net->arena, net->arena_size);
+  }
+}
 
-  // allocate memory
-  net = malloc(sizeof(pycann_t));
-  net->memory_usage = sizeof(pycann_t);
-  net->gammas = pycann_malloc(net, sizeof(pycann_float_t)*4*size);
-  net->weights = pycann_malloc(net, sizeof(pycann_float_t)*size*size);
-  net->thresholds = pycann_malloc(net, sizeof(pycann_float_t)*size);
-  net->activations = pycann_malloc(net, sizeof(pycann_float_t)*size);
-  net->activation_functions = pycann_malloc(net, sizeof(pycann_activation_function_t)*size);
-  net->mod_neurons = pycann_malloc(net, sizeof(pycann_float_t*)*size);
-  net->mod_weights = pycann_malloc(net, sizeof(pycann_float_t)*size);
-  net->inputs = pycann_malloc(net, sizeof(pycann_float_t)*num_inputs);
+// Check for quantized storage
+static inline int pycann_is_quantized(pycann_storage_t storage) {
+  return storage==PYCANN_STORAGE_FP16 || storage==PYCANN_STORAGE_BF16 || storage==PYCANN_STORAGE_INT8;
+}
 
-  // set values
-  net->size = size;
-  net->learning_rate = 0.0;
-  net->num_inputs = num_inputs;
-  net->num_outputs = num_outputs;
+// Check if any neuron can learn in a step (quantized storage is inference only)
+static inline int pycann_can_learn(pycann_t *net) {
+  return net->learning_rate!=0.0 && net->num_plastic!=0 && !pycann_is_quantized(net->storage);
+}
 
-  // init weights, thresholds, activations and modularity connections
-  for (i=0; i<size; i=i+1) {
-    for (j=0; j<4; j++) {
-      PYCANN_GAMMA(net, i, j) = 0.0;
-    }
-    for (j=0; j<size; j=j+1) {
-      PYCANN_WEIGHT(net, i, j) = 0.0;
-    }
-    net->thresholds[i] = 0.0;
-    net->activations[i] = 0.0;
-    net->activation_functions[i] = PYCANN_SIGMOID_STEP;
-    net->mod_neurons[i] = net->activations;
-    net->mod_weights[i] = 0.0;
+// Drop a reference to a snapshot, the last one closes it (networks mapping
+// it keep their mappings)
+static void pycann_snapshot_release(pycann_snapshot_t *snapshot) {
+  if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL)==0) {
+    close(snapshot->fd);
+    free(snapshot);
   }
+}
 
-  // init inputs
-  for (i=0; i<num_inputs; i=i+1) {
-    net->inputs[i] = 0.0;
+// The network's parameters (gammas, weights, thresholds) are about to
+// change, so they won't match its snapshot anymore (see pycann_clone)
+static inline void pycann_unshare(pycann_t *net) {
+  if (net->snapshot!=NULL) {
+    pycann_snapshot_release(net->snapshot);
+    net->snapshot = NULL;
   }
+}
 
-#ifdef PYCANN_THREADING
-  // Initialize threading
-  if (num_threads==0) {
-    num_threads = 1;
-  }
-  net->num_threads = num_threads;
-  net->threads = pycann_malloc(net, sizeof(pycann_thread_t)*num_threads);
-  s = net->size/num_threads;
-  r = net->size%num_threads;
-  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
 
-  // Main thread
-  net->threads[0].thread = pthread_self();
-  net->threads[0].first_neuron = 0;
-  net->threads[0].last_neuron = s+r;
-  net->threads[0].steps = 0;
+// Monotonic time in nanoseconds (for statistics)
+static inline uint64_t pycann_now(void) {
+  struct timespec t;
 
-  // Child threads
-  for (i=1; i<num_threads; i=i+1) {
-    net->threads[i].first_neuron = i*s+r;
-    net->threads[i].last_neuron = (i+1)*s+r;
-    net->threads[i].steps = 0;
-
-    if (pthread_create(&(net->threads[i].thread), NULL, pycann_thread_main, net)!=0) {
-      net->num_threads = 1;
-      net->threads[0].last_neuron = net->size;
-      pycann_set_error("Could not initialize thread #%d. Disabled multi-threading.\n", i);
-      break;
-    }
-  }
-#endif /* PYCANN_THREADING */
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec*1000000000+t.tv_nsec;
+}
 
-  return net;
+// Add a step that took t nanoseconds to the statistics
+static void pycann_stats_step(pycann_t *net, uint64_t t) {
+  uint64_t us;
+  unsigned int k;
+
+  us = t/1000;
+  k = us==0?0:64-__builtin_clzll(us);
+  k = k<PYCANN_STATS_BUCKETS?k:PYCANN_STATS_BUCKETS-1;
+  net->stats.latency[k] = net->stats.latency[k]+1;
+  net->stats.steps = net->stats.steps+1;
+  net->stats.step_time = net->stats.step_time+t;
 }
 
-// Delete network
-void pycann_del(pycann_t *net) {
-#ifdef PYCANN_THREADING
-  // Terminate all threads
+// Add neurons first upto (excluding) last, stepped by a thread in t
+// nanoseconds, to its statistics (a: activations after the step, u: weights
+// changed)
+static void pycann_stats_range(pycann_thread_stats_t *stats, unsigned int first, unsigned int last, const pycann_float_t *a, unsigned long u, uint64_t t) {
   unsigned int i;
+  unsigned long n;
 
-  for (i=1; i<net->num_threads; i=i+1) {
-    pthread_cancel(net->threads[i].thread);
-    pthread_join(net->threads[i].thread, NULL);
+  n = 0;
+  for (i=first; i<last; i=i+1) {
+    n = n+(a[i]>=PYCANN_STATS_FIRE_THRESHOLD);
   }
+  stats->neurons_fired = stats->neurons_fired+n;
+  stats->weight_updates = stats->weight_updates+u;
+  stats->busy_time = stats->busy_time+t;
+}
 
-  free(net->threads);
-#endif /* PYCANN_THREADING */
 
-  free(net->gammas);
-  free(net->weights);
-  free(net->thresholds);
-  free(net->activations);
-  free(net->mod_neurons);
-  free(net->mod_weights);
-  free(net->inputs);
-  free(net);
+// Get CPU and NUMA node the calling thread runs on (-1 if unknown)
+static void pycann_locate(int *cpu, int *node) {
+  unsigned int c, n;
+
+#ifdef SYS_getcpu
+  if (syscall(SYS_getcpu, &c, &n, NULL)==0) {
+    *cpu = c;
+    *node = n;
+    return;
+  }
+#endif /* SYS_getcpu */
+  *cpu = -1;
+  *node = -1;
 }
 
-// Get whether threading is enabled
-unsigned int pycann_is_threading_enabled(void) {
+
 #ifdef PYCANN_THREADING
-  return 1;
-#else
-  return 0;
-#endif /* PYCANN_THREADING */
+// Busy-wait hint for the CPU
+static inline void pycann_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif /* __x86_64__ || __i386__ */
 }
 
-// Get memory usage
-unsigned int pycann_get_memory_usage(pycann_t *net) {
-  return net->memory_usage;
-}
+// Wait at the pool's barrier until all threads arrived
+static void pycann_pool_barrier(pycann_pool_t *pool) {
+  unsigned int generation, k;
 
-// Get network size
-unsigned int pycann_get_size(pycann_t *net) {
-  return net->size;
+  if (pool->num_threads<2) {
+    return;
+  }
+
+  generation = __atomic_load_n(&pool->barrier_generation, __ATOMIC_ACQUIRE);
+  if (__atomic_add_fetch(&pool->barrier_count, 1, __ATOMIC_ACQ_REL)==pool->num_threads) {
+    // last thread: release all others
+    __atomic_store_n(&pool->barrier_count, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_store_n(&pool->barrier_generation, generation+1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->barrier_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return;
+  }
+
+  // spin, then park
+  for (k=0; k<pool->spin_count; k=k+1) {
+    if (__atomic_load_n(&pool->barrier_generation, __ATOMIC_ACQUIRE)!=generation) {
+      return;
+    }
+    pycann_cpu_relax();
+  }
+  pthread_mutex_lock(&pool->mutex);
+  while (__atomic_load_n(&pool->barrier_generation, __ATOMIC_ACQUIRE)==generation) {
+    pthread_cond_wait(&pool->barrier_cond, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
 }
 
-// Get number of threads
-unsigned int pycann_get_num_threads(pycann_t *net) {
-#ifdef PYCANN_THREADING
-  return net->num_threads;
-#else
-  return 1;
-#endif /* PYCANN_THREADING */
+// Worker thread main function
+static void *pycann_pool_main(void *param) {
+  pycann_pool_worker_t *self = (pycann_pool_worker_t*)param;
+  pycann_pool_t *pool = self->pool;
+  unsigned int job, k;
+
+  job = 0;
+  while (1) {
+    // wait for the next job: spin, then park
+    for (k=0; k<pool->spin_count && __atomic_load_n(&pool->job, __ATOMIC_ACQUIRE)==job; k=k+1) {
+      pycann_cpu_relax();
+    }
+    if (__atomic_load_n(&pool->job, __ATOMIC_ACQUIRE)==job) {
+      pthread_mutex_lock(&pool->mutex);
+      while (__atomic_load_n(&pool->job, __ATOMIC_ACQUIRE)==job) {
+        pthread_cond_wait(&pool->job_cond, &pool->mutex);
+      }
+      pthread_mutex_unlock(&pool->mutex);
+    }
+    job = __atomic_load_n(&pool->job, __ATOMIC_ACQUIRE);
+
+    if (pool->shutdown) {
+      break;
+    }
+
+    pool->job_func(pool, self->id, pool->job_arg);
+    pycann_pool_barrier(pool);
+  }
+
+  return NULL;
 }
 
+// Worker thread main function of the shared pool: runs the jobs of the team
+// it's lent to (see pycann_pool_run_team)
+static void *pycann_pool_shared_main(void *param) {
+  pycann_pool_worker_t *self = (pycann_pool_worker_t*)param;
+  pycann_pool_t *pool = self->pool, *team;
+  unsigned int k;
 
-// Get learning rate
-pycann_float_t pycann_get_learning_rate(pycann_t *net) {
-  return net->learning_rate;
+  while (1) {
+    // wait to be lent to a team: spin, then park
+    for (k=0; k<pool->spin_count && __atomic_load_n(&self->team, __ATOMIC_ACQUIRE)==NULL; k=k+1) {
+      pycann_cpu_relax();
+    }
+    if (__atomic_load_n(&self->team, __ATOMIC_ACQUIRE)==NULL) {
+      pthread_mutex_lock(&pool->mutex);
+      while (__atomic_load_n(&self->team, __ATOMIC_ACQUIRE)==NULL && !pool->shutdown) {
+        pthread_cond_wait(&pool->job_cond, &pool->mutex);
+      }
+      pthread_mutex_unlock(&pool->mutex);
+    }
+
+    if (pool->shutdown) {
+      break;
+    }
+
+    team = self->team;
+    team->job_func(team, self->team_id, team->job_arg);
+
+    // return to the shared pool, the team may be gone once it has all its
+    // workers back
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_store_n(&self->team, NULL, __ATOMIC_RELAXED);
+    pool->num_idle = pool->num_idle+1;
+    __atomic_sub_fetch(&team->active, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  return NULL;
 }
-// Set learning rate
-void pycann_set_learning_rate(pycann_t *net, pycann_float_t v) {
-  net->learning_rate = v;
+
+// Initialize the synchronization and job state of a pool
+static void pycann_pool_init(pycann_pool_t *pool, unsigned int num_threads) {
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->job_cond, NULL);
+  pthread_cond_init(&pool->barrier_cond, NULL);
+  pthread_cond_init(&pool->idle_cond, NULL);
+  pool->job = 0;
+  pool->job_func = NULL;
+  pool->job_arg = NULL;
+  pool->shutdown = 0;
+  pool->barrier_count = 0;
+  pool->barrier_generation = 0;
+  pool->parent = NULL;
+  pool->active = 0;
+  pool->num_idle = 0;
+  pool->next_ticket = 0;
+  pool->serving_ticket = 0;
+  // spinning only pays off if every thread has its own CPU
+  pool->spin_count = num_threads<=sysconf(_SC_NPROCESSORS_ONLN)?PYCANN_DEFAULT_SPIN_COUNT:0;
 }
 
-// Get activation function
-pycann_activation_function_t pycann_get_activation_function(pycann_t *net, unsigned int i) {
-  if (i<net->size) {
-    return net->activation_functions[i];
+// Create thread pool with up to num_threads threads (including the calling
+// thread). If a thread can't be created, the pool just has less threads.
+// Workers of a shared pool don't run the pool's jobs but those of the teams
+// they're lent to.
+static pycann_pool_t *pycann_pool_new(unsigned int num_threads, int shared) {
+  pycann_pool_t *pool;
+  unsigned int i;
+
+  pool = malloc(sizeof(pycann_pool_t));
+  if (pool==NULL) {
+    return NULL;
   }
-  else {
-    return 0;
+  pool->workers = malloc(sizeof(pycann_pool_worker_t)*num_threads);
+  if (pool->workers==NULL) {
+    free(pool);
+    return NULL;
   }
+  pycann_pool_init(pool, num_threads);
+
+  pool->num_threads = 1;
+  for (i=1; i<num_threads; i=i+1) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].id = i;
+    pool->workers[i].team = NULL;
+    pool->workers[i].team_id = 0;
+    if (pthread_create(&pool->workers[i].thread, NULL, shared?pycann_pool_shared_main:pycann_pool_main, pool->workers+i)!=0) {
+      pycann_set_error("Could not initialize thread #%d. Using %d threads.\n", i, i);
+      break;
+    }
+    pool->num_threads = i+1;
+  }
+  pool->num_idle = shared?pool->num_threads-1:0;
+
+  return pool;
 }
-// Set activation function
-void pycann_set_activation_function(pycann_t *net, unsigned int i, pycann_activation_function_t activation_function) {
-  if (i<net->size) {
-    net->activation_functions[i] = activation_function;
+
+// Create the team of a network on the shared pool parent, it has as many
+// threads as parent until the network's partition caps them
+static pycann_pool_t *pycann_pool_team_new(pycann_pool_t *parent) {
+  pycann_pool_t *pool;
+
+  pool = malloc(sizeof(pycann_pool_t));
+  if (pool==NULL) {
+    return NULL;
   }
+  pool->workers = NULL;
+  pycann_pool_init(pool, parent->num_threads);
+  pool->parent = parent;
+  pool->num_threads = parent->num_threads;
+  return pool;
 }
 
+// Terminate all threads of a pool (a team has none) and free it
+static void pycann_pool_del(pycann_pool_t *pool) {
+  unsigned int i;
+
+  if (pool->parent==NULL) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    __atomic_add_fetch(&pool->job, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i=1; i<pool->num_threads; i=i+1) {
+      pthread_join(pool->workers[i].thread, NULL);
+    }
+  }
 
+  pthread_cond_destroy(&pool->idle_cond);
+  pthread_cond_destroy(&pool->barrier_cond);
+  pthread_cond_destroy(&pool->job_cond);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->workers);
+  free(pool);
+}
 
+// Pin the workers of a pool to CPUs: worker i gets the i-th CPU the calling
+// thread may run on (counting from 0, wrapping around), so the first CPU is
+// left to the thread submitting jobs. Returns -1 if a worker couldn't be
+// pinned. Teams don't own workers, nothing is pinned for them.
+static int pycann_pool_pin(pycann_pool_t *pool) {
+  cpu_set_t allowed, set;
+  unsigned int i, k, n;
+  int cpu, r;
 
-// Get gamma
-void pycann_get_gamma(pycann_t *net, unsigned int i, pycann_float_t *gamma) {
-  if (i<net->size) {
-    memcpy(gamma, net->gammas+(i*4), 4*sizeof(pycann_float_t));
+  if (pool->parent!=NULL) {
+    return 0;
   }
-  else {
-    pycann_set_error("Invalid neuron index: %d", i);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)!=0) {
+    return -1;
+  }
+  n = CPU_COUNT(&allowed);
+  r = 0;
+  for (i=1; i<pool->num_threads; i=i+1) {
+    // find the (i mod n)-th allowed CPU
+    k = i%n;
+    for (cpu=0; cpu<CPU_SETSIZE; cpu=cpu+1) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        if (k==0) {
+          break;
+        }
+        k = k-1;
+      }
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pool->workers[i].thread, sizeof(set), &set)!=0) {
+      r = -1;
+    }
   }
+  return r;
 }
-// Set gamma
-void pycann_set_gamma(pycann_t *net, unsigned int i, pycann_float_t *gamma) {
-  if (i<net->size) {
-    memcpy(net->gammas+(i*4), gamma, 4*sizeof(pycann_float_t));
+
+// Dense weights written by pycann_first_touch_job (zeroed if weights is NULL)
+struct pycann_first_touch {
+  pycann_t *net;
+  const pycann_float_t *weights;
+};
+
+// Job: every thread writes its partition's dense weight rows, so pages that
+// weren't touched before are placed on its NUMA node by the first touch
+static void pycann_first_touch_job(pycann_pool_t *pool, unsigned int thread, void *arg) {
+  struct pycann_first_touch *touch = (struct pycann_first_touch*)arg;
+  pycann_t *net = touch->net;
+  pycann_thread_t *self = net->threads+thread;
+  size_t k, n;
+
+  k = (size_t)self->first_neuron*net->stride;
+  n = sizeof(pycann_float_t)*(self->last_neuron-self->first_neuron)*net->stride;
+  if (touch->weights==NULL) {
+    memset(net->weights+k, 0, n);
   }
   else {
-    pycann_set_error("Invalid neuron index: %d", i);
+    memcpy(net->weights+k, touch->weights+k, n);
   }
 }
 
+// Job: every thread records where it runs
+static void pycann_locate_job(pycann_pool_t *pool, unsigned int thread, void *arg) {
+  pycann_t *net = (pycann_t*)arg;
 
+  pycann_locate(&net->threads[thread].cpu, &net->threads[thread].node);
+}
 
+// Process-wide pool shared by networks created with PYCANN_NEW_SHARED_POOL,
+// created on first use with a thread per CPU (or PYCANN_SHARED_POOL_THREADS
+// threads) and never deleted
+static pycann_pool_t *pycann_shared_pool = NULL;
+static pthread_once_t pycann_shared_pool_once = PTHREAD_ONCE_INIT;
 
-// Get weight
-pycann_float_t pycann_get_weight(pycann_t *net, unsigned int i, unsigned int j) {
-  if (i<net->size && j<net->size) {
-    return PYCANN_WEIGHT(net, i, j);
-  }
-  else {
-    return 0.0;
+static void pycann_shared_pool_init(void) {
+  const char *env;
+  long n;
+
+  env = getenv("PYCANN_SHARED_POOL_THREADS");
+  n = env!=NULL?atol(env):0;
+  if (n<=0) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
   }
+  pycann_shared_pool = pycann_pool_new(n>1?n:1, 1);
 }
-// Set weight
-void pycann_set_weight(pycann_t *net, unsigned int i, unsigned int j, pycann_float_t v) {
-  if (i<net->size && j<net->size) {
-    PYCANN_WEIGHT(net, i, j) = v;
-  }
+
+// Get the shared pool (NULL if it couldn't be created)
+static pycann_pool_t *pycann_pool_get_shared(void) {
+  pthread_once(&pycann_shared_pool_once, pycann_shared_pool_init);
+  return pycann_shared_pool;
 }
-// Set random weights
-// FIXME: Definetely does NOT work!
-void pycann_set_random_weights(pycann_t *net, pycann_float_t connection_rate) {
-  unsigned int i, j, n;
-  pycann_float_t sign;
 
-  if (connection_rate>=0.0 && connection_rate<=1.0) {
-    n = (int)(connection_rate*net->size);
-    for (i=0; i<net->size; i=i+1) {
-      for (j=0; j<n; j=j+1) {
-	sign = rand()&1?+1.0:-1.0;
-        PYCANN_WEIGHT(net, i, j) = sign * (pycann_float_t)(((double)rand())/((double)RAND_MAX));
+// Run job on all threads of a team: borrow idle workers of the shared pool
+// (teams wait in turn until there are enough), run the job with them and wait until
+// they're back in the shared pool. Teams borrow disjoint workers, so their
+// jobs run at the same time.
+static void pycann_pool_run_team(pycann_pool_t *team, pycann_pool_job_t func, void *arg) {
+  pycann_pool_t *pool = team->parent;
+  unsigned int i, k, n, ticket;
+
+  team->job_func = func;
+  team->job_arg = arg;
+  n = team->num_threads-1;
+  if (n>0) {
+    __atomic_store_n(&team->active, n, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->mutex);
+    // first come, first served, so smaller teams can't starve a large one
+    ticket = pool->next_ticket;
+    pool->next_ticket = pool->next_ticket+1;
+    while (pool->serving_ticket!=ticket || pool->num_idle<n) {
+      pthread_cond_wait(&pool->idle_cond, &pool->mutex);
+    }
+    pool->serving_ticket = pool->serving_ticket+1;
+    pool->num_idle = pool->num_idle-n;
+    k = 0;
+    for (i=1; k<n; i=i+1) {
+      if (pool->workers[i].team==NULL) {
+        k = k+1;
+        pool->workers[i].team_id = k;
+        __atomic_store_n(&pool->workers[i].team, team, __ATOMIC_RELEASE);
       }
     }
+    pthread_cond_broadcast(&pool->job_cond);
+    // the next team may have enough idle workers already
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->mutex);
   }
-}
 
-// Get threshold
-pycann_float_t pycann_get_threshold(pycann_t *net, unsigned int i) {
-  if (i<net->size) {
-    return net->thresholds[i];
+  func(team, 0, arg);
+
+  // wait for the workers: spin, then park
+  for (k=0; k<team->spin_count && __atomic_load_n(&team->active, __ATOMIC_ACQUIRE)!=0; k=k+1) {
+    pycann_cpu_relax();
   }
-  else {
-    return 0.0;
+  if (__atomic_load_n(&team->active, __ATOMIC_ACQUIRE)!=0) {
+    pthread_mutex_lock(&pool->mutex);
+    while (__atomic_load_n(&team->active, __ATOMIC_ACQUIRE)!=0) {
+      pthread_cond_wait(&pool->idle_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
   }
 }
-// Set threshold
-void pycann_set_threshold(pycann_t *net, unsigned int i, pycann_float_t v) {
-  if (i<net->size) {
-    net->thresholds[i] = v;
+
+// Run job on all threads of the pool. Returns when all threads finished it.
+static void pycann_pool_run(pycann_pool_t *pool, pycann_pool_job_t func, void *arg) {
+  if (pool->parent!=NULL) {
+    pycann_pool_run_team(pool, func, arg);
+    return;
+  }
+  if (pool->num_threads>1) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->job_func = func;
+    pool->job_arg = arg;
+    __atomic_add_fetch(&pool->job, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->mutex);
   }
+
+  func(pool, 0, arg);
+  pycann_pool_barrier(pool);
 }
 
-// Get activation
-pycann_float_t pycann_get_activation(pycann_t *net, unsigned int i) {
-  if (i<net->size) {
-    return net->activations[i];
+// Estimated cost of stepping neuron i: one unit per visited synapse, plastic
+// rows count twice (every weight is loaded and stored)
+static unsigned long pycann_row_cost(pycann_t *net, unsigned int i) {
+  unsigned long c;
+
+  if (i<net->num_inputs) {
+    return 1;
+  }
+  if (net->storage==PYCANN_STORAGE_SPARSE) {
+    c = net->sparse_rows[i+1]-net->sparse_rows[i];
   }
   else {
-    return 0.0;
+    c = net->size;
   }
-}
-// Set activation
-void pycann_set_activation(pycann_t *net, unsigned int i, pycann_float_t v) {
-  if (i<net->size) {
-    net->activations[i] = v;
+  if (net->plastic[i] && pycann_can_learn(net)) {
+    c = 2*c;
   }
+  return c+PYCANN_ROW_OVERHEAD;
 }
 
-// Get modularity neuron
-unsigned int pycann_get_mod_neuron(pycann_t *net, unsigned int i) {
-  if (i<net->size) {
-    return net->mod_neurons[i]-net->activations;
-  }
-  else {
-    return 0;
+// Split [0, size) into n ranges of about the same cost. bounds gets n+1 entries.
+static void pycann_split_costs(pycann_t *net, unsigned int n, unsigned int *bounds) {
+  unsigned int i, k;
+  unsigned long total;
+
+  total = net->costs[net->size];
+  bounds[0] = 0;
+  i = 0;
+  for (k=1; k<n; k=k+1) {
+    while (i<net->size && net->costs[i]*n<total*k) {
+      i = i+1;
+    }
+    bounds[k] = i;
+  }
+  bounds[n] = net->size;
+}
+
+// (Re)compute row costs, static partition and chunks for dynamic scheduling.
+// Returns -1 if out of memory (the old partition is kept then).
+static int pycann_partition(pycann_t *net) {
+  unsigned int i, n, *bounds;
+
+  n = net->pool->parent!=NULL?net->pool->parent->num_threads:net->num_threads;
+  bounds = malloc(sizeof(unsigned int)*(n+1));
+  if (bounds==NULL) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  net->costs[0] = 0;
+  for (i=0; i<net->size; i=i+1) {
+    net->costs[i+1] = net->costs[i]+pycann_row_cost(net, i);
+  }
+  if (net->pool->parent!=NULL) {
+    // a thread of the shared pool per PYCANN_SHARED_POOL_GRAIN of cost
+    n = net->costs[net->size]/PYCANN_SHARED_POOL_GRAIN<n?net->costs[net->size]/PYCANN_SHARED_POOL_GRAIN:n;
+    net->num_threads = n>1?n:1;
+    net->pool->num_threads = net->num_threads;
+  }
+  pycann_split_costs(net, net->num_threads, bounds);
+  for (i=0; i<net->num_threads; i=i+1) {
+    net->threads[i].first_neuron = bounds[i];
+    net->threads[i].last_neuron = bounds[i+1];
+  }
+  free(bounds);
+
+  pycann_split_costs(net, net->num_chunks, net->chunks);
+
+  net->partition_dirty = 0;
+  return 0;
+}
+
+// Largest change of an activation in step s (made by any thread)
+static pycann_float_t pycann_threads_change(pycann_t *net, unsigned int s) {
+  unsigned int i;
+  pycann_float_t m;
+
+  m = 0.0;
+  for (i=0; i<net->num_threads; i=i+1) {
+    m = net->threads[i].change[s&1]>m?net->threads[i].change[s&1]:m;
+  }
+  return m;
+}
+
+// Job: do net->steps steps. With static scheduling every thread steps its
+// own partition, with dynamic scheduling threads grab chunks until none are
+// left. Threads meet at the barrier after every step, so no thread runs ahead.
+// Every thread records the neurons it stepped for pycann_run_sequence and the
+// largest change it made for pycann_step_until_stable.
+static void pycann_step_job(pycann_pool_t *pool, unsigned int thread, void *arg) {
+  pycann_t *net = (pycann_t*)arg;
+  pycann_thread_t *self = net->threads+thread;
+  unsigned int s, k, a, b, stats;
+  unsigned long u;
+  uint64_t t0, t1;
+  pycann_float_t *src, *dst, change;
+  const pycann_float_t *inputs;
+
+  stats = net->stats_enabled;
+  if (stats) {
+    t0 = pycann_now();
+    if (self->stats_mark!=0) {
+      self->stats.idle_time = self->stats.idle_time+t0-self->stats_mark;
+    }
+    if (thread==0) {
+      net->stats_step_start = t0;
+    }
+  }
+
+  for (s=0; s<net->steps; s=s+1) {
+    if (s>0) {
+      if (stats) {
+        // the barrier ends the last step, thread 0 takes its time
+        t0 = pycann_now();
+        pycann_pool_barrier(pool);
+        t1 = pycann_now();
+        self->stats.wait_time = self->stats.wait_time+t1-t0;
+        if (thread==0) {
+          pycann_stats_step(net, t1-net->stats_step_start);
+          net->stats_step_start = t1;
+        }
+      }
+      else {
+        pycann_pool_barrier(pool);
+      }
+      // every thread sees the same changes, so they all stop after the same step
+      if (net->stable!=NULL && pycann_threads_change(net, s-1)<=net->stable->tolerance) {
+        break;
+      }
+    }
+    pycann_step_buffers(net, s, &src, &dst);
+    inputs = pycann_step_inputs(net, s);
+    self->change[s&1] = 0.0;
+
+    if (net->schedule==PYCANN_SCHEDULE_DYNAMIC) {
+      // counters alternate between steps, the one of the next step is reset
+      // now and everybody sees it after the barrier
+      if (thread==0) {
+        net->chunk_counters[(s+1)&1] = 0;
+      }
+      while ((k = __atomic_fetch_add(net->chunk_counters+(s&1), 1, __ATOMIC_RELAXED))<net->num_chunks) {
+        a = net->chunks[k];
+        b = net->chunks[k+1];
+        t0 = stats?pycann_now():0;
+        pycann_stable_before(net, a, b, src, dst);
+        u = pycann_single_step(net, a, b, src, dst, inputs, pycann_step_fuse(net, s, net->steps, a, b));
+        pycann_sequence_record(net, s, a, b, dst);
+        change = pycann_stable_change(net, a, b, src, dst);
+        self->change[s&1] = change>self->change[s&1]?change:self->change[s&1];
+        self->work = self->work+net->costs[b]-net->costs[a];
+        if (stats) {
+          pycann_stats_range(&self->stats, a, b, dst, u, pycann_now()-t0);
+        }
+      }
+    }
+    else {
+      a = self->first_neuron;
+      b = self->last_neuron;
+      t0 = stats?pycann_now():0;
+      pycann_stable_before(net, a, b, src, dst);
+      u = pycann_single_step(net, a, b, src, dst, inputs, pycann_step_fuse(net, s, net->steps, a, b));
+      pycann_sequence_record(net, s, a, b, dst);
+      self->change[s&1] = pycann_stable_change(net, a, b, src, dst);
+      self->work = self->work+net->costs[b]-net->costs[a];
+      if (stats) {
+        pycann_stats_range(&self->stats, a, b, dst, u, pycann_now()-t0);
+      }
+    }
+  }
+
+  if (thread==0 && net->stable!=NULL) {
+    net->stable->steps = s;
+  }
+  if (stats) {
+    self->stats_mark = pycann_now();
+  }
+}
+// Move dense weights used in place (of a mapping) to new memory written by
+// the threads stepping them. Large buffers are fresh anonymous mappings, so
+// their pages are placed on the threads' nodes.
+static int pycann_first_touch_weights(pycann_t *net) {
+  struct pycann_first_touch touch;
+
+  if (pycann_partition(net)!=0) {
+    return -1;
+  }
+  touch.net = net;
+  touch.weights = net->weights;
+  net->weights = pycann_malloc(net, pycann_matrix_size(net, sizeof(pycann_float_t)));
+  if (net->weights==NULL) {
+    net->weights = (pycann_float_t*)touch.weights;
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  pycann_pool_run(net->pool, pycann_first_touch_job, &touch);
+  return 0;
+}
+
+#endif /* PYCANN_THREADING */
+
+// Rows per tile of synchronous stepping for a network with size neurons: the
+// weights of a tile should fit into half the L2 cache, so the head of a pair
+// of steps finds them cached (see pycann_single_step)
+static unsigned int pycann_step_tile(unsigned int size) {
+  long cache;
+  size_t rows;
+
+  cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (cache<=0) {
+    cache = PYCANN_STEP_CACHE;
+  }
+  rows = (size_t)cache/2/(sizeof(pycann_float_t)*PYCANN_STRIDE(size))/4*4;
+  return rows<4?4:(rows>PYCANN_STEP_TILE?PYCANN_STEP_TILE:rows);
+}
+
+// Create new network
+pycann_t *pycann_new(unsigned int size, unsigned int num_inputs, unsigned int num_outputs, unsigned int num_threads) {
+  return pycann_new_ex(size, num_inputs, num_outputs, num_threads, 0);
+}
+
+// Create new network with flags (PYCANN_NEW_*). All buffers of fixed size
+// are sections of one arena (see pycann_arena_new).
+pycann_t *pycann_new_ex(unsigned int size, unsigned int num_inputs, unsigned int num_outputs, unsigned int num_threads, unsigned int flags) {
+  pycann_t *net;
+  unsigned int i, k;
+  size_t n;
+  int mapped, sparse;
+#ifdef PYCANN_THREADING
+  struct pycann_first_touch touch;
+#endif /* PYCANN_THREADING */
+
+  mapped = (flags&PYCANN_NEW_MAPPED)!=0;
+  sparse = (flags&PYCANN_NEW_SPARSE)!=0;
+
+  // dense weights (the largest matrix any storage engine needs) must be
+  // addressable
+  if (size==0 || PYCANN_STRIDE(size)<size || PYCANN_STRIDE(size)>SIZE_MAX/sizeof(pycann_float_t)/size) {
+    pycann_set_error("Invalid network size: %u\n", size);
+    return NULL;
+  }
+
+  net = malloc(sizeof(pycann_t));
+  if (net==NULL) {
+    pycann_set_error("Out of memory\n");
+    return NULL;
+  }
+  net->memory_usage = sizeof(pycann_t);
+  net->mapping = NULL;
+  net->mapping_size = 0;
+  net->snapshot = NULL;
+  net->params_exposed = 0;
+  net->stride = PYCANN_STRIDE(size);
+
+  // sections of the arena (empty ones stay NULL, mapped ones are left to the loader)
+  struct {
+    void **p;
+    size_t n;
+  } sections[] = {
+    {(void**)&net->gammas,               mapped?0:sizeof(pycann_float_t)*4*size},
+    {(void**)&net->weights,              mapped || sparse?0:sizeof(pycann_float_t)*size*net->stride},
+    {(void**)&net->sparse_rows,          mapped || !sparse?0:sizeof(unsigned int)*(size+1)},
+    {(void**)&net->thresholds,           mapped?0:sizeof(pycann_float_t)*size},
+    {(void**)&net->activations,          sizeof(pycann_float_t)*size},
+    {(void**)&net->activation_functions, sizeof(pycann_activation_function_t)*size},
+    {(void**)&net->runs,                 sizeof(pycann_run_t)*size},
+    {(void**)&net->mod_neurons,          sizeof(unsigned int)*size},
+    {(void**)&net->mod_weights,          sizeof(pycann_float_t)*size},
+    {(void**)&net->plastic,              sizeof(unsigned char)*size},
+    {(void**)&net->inputs,               sizeof(pycann_float_t)*num_inputs}
+  };
+
+  // allocate memory
+  n = 0;
+  for (k=0; k<sizeof(sections)/sizeof(sections[0]); k=k+1) {
+    n = n+PYCANN_ALIGN(sections[k].n, PYCANN_ALIGNMENT);
+  }
+  if (pycann_arena_new(net, n, flags)!=0) {
+    pycann_set_error("Out of memory\n");
+    free(net);
+    return NULL;
+  }
+  n = 0;
+  for (k=0; k<sizeof(sections)/sizeof(sections[0]); k=k+1) {
+    *sections[k].p = sections[k].n==0?NULL:(char*)net->arena+n;
+    n = n+PYCANN_ALIGN(sections[k].n, PYCANN_ALIGNMENT);
+  }
+
+  // set values
+  net->size = size;
+  net->learning_rate = 0.0;
+  net->num_inputs = num_inputs;
+  net->num_outputs = num_outputs;
+  net->storage = sparse?PYCANN_STORAGE_SPARSE:PYCANN_STORAGE_DENSE;
+  net->sparse_columns = NULL;
+  net->sparse_values = NULL;
+  net->sparse_capacity = 0;
+  net->qweights = NULL;
+  net->qscales = NULL;
+  net->back_activations = NULL;
+  net->update_mode = PYCANN_UPDATE_ASYNC;
+  net->step_tile = pycann_step_tile(size);
+  net->fused_sums = NULL;
+  net->propagation = PYCANN_PROPAGATION_FULL;
+  net->delta_sums = NULL;
+  net->delta_basis = NULL;
+  net->delta_columns = NULL;
+  net->delta_valid = 0;
+  net->delta_steps = 0;
+  net->sequence = NULL;
+  net->stable = NULL;
+  net->random_state = __atomic_fetch_add(&pycann_seed_counter, 1, __ATOMIC_RELAXED);
+
+  // the arena is zero-filled, so gammas, weights (an empty CSR matrix if
+  // sparse), thresholds, activations, modularity connections and inputs are
+  // already zero
+  for (i=0; i<size; i=i+1) {
+    net->activation_functions[i] = PYCANN_SIGMOID_STEP;
+  }
+  net->num_plastic = 0;
+  net->partition_dirty = 1;
+  net->runs_dirty = 1;
+
+#ifdef PYCANN_THREADING
+  // Initialize threading (num_threads is ignored for the shared pool)
+  if (num_threads==0) {
+    num_threads = 1;
+  }
+  if (flags&PYCANN_NEW_SHARED_POOL) {
+    net->pool = pycann_pool_get_shared();
+    net->pool = net->pool!=NULL?pycann_pool_team_new(net->pool):NULL;
+    net->memory_usage += sizeof(pycann_pool_t);
+  }
+  else {
+    net->pool = pycann_pool_new(num_threads, 0);
+    net->memory_usage += sizeof(pycann_pool_t)+sizeof(pycann_pool_worker_t)*num_threads;
+  }
+  if (net->pool==NULL) {
+    pycann_set_error("Could not create thread pool\n");
+    pycann_arena_del(net);
+    free(net);
+    return NULL;
+  }
+  if ((flags&PYCANN_NEW_PIN_THREADS) && pycann_pool_pin(net->pool)!=0) {
+    pycann_set_error("Could not pin threads to CPUs\n");
+  }
+  net->num_threads = net->pool->num_threads;
+  net->schedule = PYCANN_SCHEDULE_STATIC;
+  net->num_chunks = net->num_threads*PYCANN_DEFAULT_CHUNKS_PER_THREAD;
+  net->threads = pycann_malloc(net, sizeof(pycann_thread_t)*net->num_threads);
+  net->chunks = pycann_malloc(net, sizeof(unsigned int)*(net->num_chunks+1));
+  net->costs = pycann_malloc(net, sizeof(unsigned long)*(size+1));
+  if (net->threads==NULL || net->chunks==NULL || net->costs==NULL) {
+    // everything pycann_del frees exists (or is NULL) by now
+    pycann_set_error("Out of memory\n");
+    pycann_del(net);
+    return NULL;
+  }
+  net->steps = 0;
+  for (i=0; i<net->num_threads; i=i+1) {
+    net->threads[i].work = 0;
+  }
+
+  // Scheduling (partitions of mapped networks are computed on first step)
+  if (!mapped) {
+    if (pycann_partition(net)!=0) {
+      pycann_del(net);
+      return NULL;
+    }
+    // the arena is mapped with PYCANN_NEW_FIRST_TOUCH, so its pages are untouched
+    if ((flags&PYCANN_NEW_FIRST_TOUCH) && net->weights!=NULL) {
+      touch.net = net;
+      touch.weights = NULL;
+      pycann_pool_run(net->pool, pycann_first_touch_job, &touch);
+    }
+  }
+#endif /* PYCANN_THREADING */
+
+  // statistics are off by default
+  net->stats_enabled = 0;
+  pycann_reset_stats(net);
+
+  return net;
+}
+
+// Delete network
+void pycann_del(pycann_t *net) {
+#ifdef PYCANN_THREADING
+  // Terminate all threads (the shared pool lives on, only the team goes)
+  pycann_pool_del(net->pool);
+  free(net->threads);
+  free(net->chunks);
+  free(net->costs);
+#endif /* PYCANN_THREADING */
+
+  // these may point into the arena or the file mapping
+  pycann_free(net, net->gammas, 0);
+  pycann_free(net, net->weights, 0);
+  pycann_free(net, net->sparse_rows, 0);
+  pycann_free(net, net->sparse_columns, 0);
+  pycann_free(net, net->sparse_values, 0);
+  pycann_free(net, net->qweights, 0);
+  pycann_free(net, net->qscales, 0);
+  pycann_free(net, net->thresholds, 0);
+  if (net->mapping!=NULL) {
+    munmap(net->mapping, net->mapping_size);
+  }
+  pycann_unshare(net);
+  free(net->back_activations);
+  free(net->fused_sums);
+  pycann_delta_free(net);
+  pycann_arena_del(net);
+  free(net);
+}
+
+// Get whether threading is enabled
+unsigned int pycann_is_threading_enabled(void) {
+#ifdef PYCANN_THREADING
+  return 1;
+#else
+  return 0;
+#endif /* PYCANN_THREADING */
+}
+
+// Get name of the compute kernels in use ("scalar", "sse2", "avx2" or "avx512")
+const char *pycann_get_kernel(void) {
+  return pycann_kernels->name;
+}
+
+// Select compute kernels by name ("auto" selects the best ones for this CPU).
+// NOTE: This affects all networks, don't call it while a network is stepping.
+int pycann_set_kernel(const char *name) {
+  if (pycann_kernels_select(name)!=0) {
+    pycann_set_error("Kernel not supported by this CPU: %s\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+// Get memory usage
+size_t pycann_get_memory_usage(pycann_t *net) {
+  return net->memory_usage;
+}
+
+// Get network size
+unsigned int pycann_get_size(pycann_t *net) {
+  return net->size;
+}
+
+// Get number of threads
+unsigned int pycann_get_num_threads(pycann_t *net) {
+#ifdef PYCANN_THREADING
+  return net->num_threads;
+#else
+  return 1;
+#endif /* PYCANN_THREADING */
+}
+
+
+// Get number of spins before an idle thread parks
+unsigned int pycann_get_spin_count(pycann_t *net) {
+#ifdef PYCANN_THREADING
+  return net->pool->spin_count;
+#else
+  return 0;
+#endif /* PYCANN_THREADING */
+}
+
+// Set number of spins before an idle thread parks. Higher values lower the
+// latency of a step, lower values free the CPU earlier between steps.
+// Networks on the shared pool only set the spins at their own barriers and
+// while waiting for their workers, not those of idle workers.
+void pycann_set_spin_count(pycann_t *net, unsigned int n) {
+#ifdef PYCANN_THREADING
+  net->pool->spin_count = n;
+#endif /* PYCANN_THREADING */
+}
+
+// Get scheduling of threads
+pycann_schedule_t pycann_get_schedule(pycann_t *net) {
+#ifdef PYCANN_THREADING
+  return net->schedule;
+#else
+  return PYCANN_SCHEDULE_STATIC;
+#endif /* PYCANN_THREADING */
+}
+
+// Set scheduling of threads. With dynamic scheduling the network is split
+// into chunks_per_thread*num_threads chunks of about the same cost, which
+// threads grab until none are left (0 keeps the current number of chunks).
+int pycann_set_schedule(pycann_t *net, pycann_schedule_t schedule, unsigned int chunks_per_thread) {
+#ifdef PYCANN_THREADING
+  unsigned int *chunks;
+
+  if (schedule!=PYCANN_SCHEDULE_STATIC && schedule!=PYCANN_SCHEDULE_DYNAMIC) {
+    pycann_set_error("Invalid schedule: %d\n", schedule);
+    return -1;
+  }
+  if (chunks_per_thread>0) {
+    chunks = pycann_realloc(net, net->chunks, sizeof(unsigned int)*(net->num_chunks+1), sizeof(unsigned int)*(net->num_threads*chunks_per_thread+1));
+    if (chunks==NULL) {
+      pycann_set_error("Out of memory\n");
+      return -1;
+    }
+    net->chunks = chunks;
+    net->num_chunks = net->num_threads*chunks_per_thread;
+    net->partition_dirty = 1;
+  }
+  net->schedule = schedule;
+#endif /* PYCANN_THREADING */
+  return 0;
+}
+
+// Get static partition of a thread (neurons 'first' upto (excluding) 'last').
+// Returns its estimated cost (see pycann_get_thread_work).
+unsigned long pycann_get_partition(pycann_t *net, unsigned int thread, unsigned int *first, unsigned int *last) {
+#ifdef PYCANN_THREADING
+  if (thread>=net->num_threads) {
+    pycann_set_error("Invalid thread index: %d\n", thread);
+    return 0;
+  }
+  if (net->partition_dirty && pycann_partition(net)!=0) {
+    return 0;
+  }
+  *first = net->threads[thread].first_neuron;
+  *last = net->threads[thread].last_neuron;
+  return net->costs[*last]-net->costs[*first];
+#else
+  if (thread>0) {
+    pycann_set_error("Invalid thread index: %d\n", thread);
+    return 0;
+  }
+  *first = 0;
+  *last = net->size;
+  return 0;
+#endif /* PYCANN_THREADING */
+}
+
+// Get estimated cost a thread processed during the last pycann_step. Costs
+// are counted in visited synapses (plastic rows twice) plus a per-row overhead.
+unsigned long pycann_get_thread_work(pycann_t *net, unsigned int thread) {
+#ifdef PYCANN_THREADING
+  if (thread<net->num_threads) {
+    return net->threads[thread].work;
+  }
+#endif /* PYCANN_THREADING */
+  return 0;
+}
+
+// Get CPU and NUMA node a thread currently runs on (-1 if unknown). Returns
+// -1 for an invalid thread index.
+int pycann_get_thread_placement(pycann_t *net, unsigned int thread, int *cpu, int *node) {
+#ifdef PYCANN_THREADING
+  if (thread>=net->num_threads) {
+    pycann_set_error("Invalid thread index: %d\n", thread);
+    return -1;
+  }
+  pycann_pool_run(net->pool, pycann_locate_job, net);
+  *cpu = net->threads[thread].cpu;
+  *node = net->threads[thread].node;
+#else
+  if (thread>0) {
+    pycann_set_error("Invalid thread index: %d\n", thread);
+    return -1;
+  }
+  pycann_locate(cpu, node);
+#endif /* PYCANN_THREADING */
+  return 0;
+}
+
+// Get NUMA node of the memory page holding the start of neuron i's weights
+// (dense or quantized storage). Returns -1 if unknown or the page is not
+// present yet.
+int pycann_get_row_node(pycann_t *net, unsigned int i) {
+  void *p;
+  int status;
+
+  if (i>=net->size) {
+    pycann_set_error("Invalid neuron index: %d\n", i);
+    return -1;
+  }
+  switch (net->storage) {
+    case PYCANN_STORAGE_DENSE:
+      p = net->weights+(size_t)i*net->stride;
+      break;
+    case PYCANN_STORAGE_FP16:
+    case PYCANN_STORAGE_BF16:
+      p = (uint16_t*)net->qweights+(size_t)i*net->stride;
+      break;
+    case PYCANN_STORAGE_INT8:
+      p = (int8_t*)net->qweights+(size_t)i*net->stride;
+      break;
+    default:
+      p = net->sparse_values+net->sparse_rows[i];
+      break;
+  }
+  if (p==NULL) {
+    return -1;
+  }
+  p = (void*)((uintptr_t)p/sysconf(_SC_PAGESIZE)*sysconf(_SC_PAGESIZE));
+#ifdef SYS_move_pages
+  // without target nodes move_pages only reports the pages' nodes
+  if (syscall(SYS_move_pages, 0, 1UL, &p, NULL, &status, 0)==0 && status>=0) {
+    return status;
+  }
+#endif /* SYS_move_pages */
+  return -1;
+}
+
+// Get whether statistics are collected
+unsigned int pycann_get_stats_enabled(pycann_t *net) {
+  return net->stats_enabled;
+}
+
+// Enable or disable collecting statistics (see pycann_get_stats). While
+// disabled steps don't even read the clock.
+void pycann_set_stats_enabled(pycann_t *net, unsigned int enabled) {
+#ifdef PYCANN_THREADING
+  unsigned int i;
+
+  // time spent while disabled doesn't count as idle
+  for (i=0; i<net->num_threads; i=i+1) {
+    net->threads[i].stats_mark = 0;
+  }
+#else
+  net->stats_mark = 0;
+#endif /* PYCANN_THREADING */
+  net->stats_enabled = enabled!=0;
+}
+
+// Get statistics of all steps since the last pycann_reset_stats
+void pycann_get_stats(pycann_t *net, pycann_stats_t *stats) {
+  pycann_thread_stats_t t;
+  unsigned int i;
+
+  *stats = net->stats;
+  stats->neurons_fired = 0;
+  stats->weight_updates = 0;
+  for (i=0; pycann_get_thread_stats(net, i, &t)==0; i=i+1) {
+    stats->neurons_fired = stats->neurons_fired+t.neurons_fired;
+    stats->weight_updates = stats->weight_updates+t.weight_updates;
+  }
+}
+
+// Get statistics of a thread (0 is the thread calling pycann_step)
+int pycann_get_thread_stats(pycann_t *net, unsigned int thread, pycann_thread_stats_t *stats) {
+#ifdef PYCANN_THREADING
+  if (thread<net->num_threads) {
+    *stats = net->threads[thread].stats;
+    return 0;
+  }
+#else
+  if (thread==0) {
+    *stats = net->thread_stats;
+    return 0;
+  }
+#endif /* PYCANN_THREADING */
+  pycann_set_error("Invalid thread index: %d\n", thread);
+  return -1;
+}
+
+// Reset statistics
+void pycann_reset_stats(pycann_t *net) {
+#ifdef PYCANN_THREADING
+  unsigned int i;
+
+  for (i=0; i<net->num_threads; i=i+1) {
+    memset(&net->threads[i].stats, 0, sizeof(pycann_thread_stats_t));
+    net->threads[i].stats_mark = 0;
+  }
+#else
+  memset(&net->thread_stats, 0, sizeof(pycann_thread_stats_t));
+  net->stats_mark = 0;
+#endif /* PYCANN_THREADING */
+  memset(&net->stats, 0, sizeof(pycann_stats_t));
+}
+
+// Get update order of neurons
+pycann_update_t pycann_get_update_mode(pycann_t *net) {
+  return net->update_mode;
+}
+
+// Set update order of neurons. Synchronous updates compute every neuron from
+// the activations of the previous step, so results don't depend on the number
+// of threads or the schedule (needs a second activation buffer).
+int pycann_set_update_mode(pycann_t *net, pycann_update_t mode) {
+  if (mode!=PYCANN_UPDATE_ASYNC && mode!=PYCANN_UPDATE_SYNC) {
+    pycann_set_error("Invalid update mode: %d\n", mode);
+    return -1;
+  }
+  if (mode==PYCANN_UPDATE_SYNC && net->back_activations==NULL) {
+    net->back_activations = pycann_malloc(net, sizeof(pycann_float_t)*net->size);
+    if (net->back_activations==NULL) {
+      pycann_set_error("Out of memory\n");
+      return -1;
+    }
+  }
+  if (mode==PYCANN_UPDATE_SYNC && net->fused_sums==NULL) {
+    net->fused_sums = pycann_malloc(net, sizeof(pycann_float_t)*net->size);
+    if (net->fused_sums==NULL) {
+      pycann_set_error("Out of memory\n");
+      return -1;
+    }
+  }
+  net->update_mode = mode;
+  return 0;
+}
+
+// Free the buffers of delta propagation
+static void pycann_delta_free(pycann_t *net) {
+  pycann_free(net, net->delta_sums, sizeof(pycann_float_t)*net->size);
+  pycann_free(net, net->delta_basis, sizeof(pycann_float_t)*net->size);
+  pycann_free(net, net->delta_columns, pycann_matrix_size(net, sizeof(pycann_float_t)));
+  net->delta_sums = NULL;
+  net->delta_basis = NULL;
+  net->delta_columns = NULL;
+}
+
+// Get propagation mode
+pycann_propagation_t pycann_get_propagation(pycann_t *net) {
+  return net->propagation;
+}
+
+// Set propagation mode. Delta propagation keeps the net input of every
+// neuron and only adds the columns of neurons whose activation changed (it
+// keeps a transposed copy of the weights). It's used for steps with dense
+// storage and without learning, which are done by the calling thread alone,
+// other steps fall back to full propagation. So do steps while the weights
+// are handed out in place (pycann_get_weights_buffer), they could change
+// between any two steps.
+int pycann_set_propagation(pycann_t *net, pycann_propagation_t mode) {
+  if (mode!=PYCANN_PROPAGATION_FULL && mode!=PYCANN_PROPAGATION_DELTA) {
+    pycann_set_error("Invalid propagation mode: %d\n", mode);
+    return -1;
+  }
+  if (mode==PYCANN_PROPAGATION_DELTA && net->delta_sums==NULL) {
+    net->delta_sums = pycann_malloc(net, sizeof(pycann_float_t)*net->size);
+    net->delta_basis = pycann_malloc(net, sizeof(pycann_float_t)*net->size);
+    net->delta_columns = pycann_malloc(net, pycann_matrix_size(net, sizeof(pycann_float_t)));
+    if (net->delta_sums==NULL || net->delta_basis==NULL || net->delta_columns==NULL) {
+      pycann_delta_free(net);
+      pycann_set_error("Out of memory\n");
+      return -1;
+    }
+  }
+  else if (mode==PYCANN_PROPAGATION_FULL) {
+    pycann_delta_free(net);
+  }
+  net->propagation = mode;
+  net->delta_valid = 0;
+  return 0;
+}
+
+// Get learning rate
+pycann_float_t pycann_get_learning_rate(pycann_t *net) {
+  return net->learning_rate;
+}
+// Set learning rate
+void pycann_set_learning_rate(pycann_t *net, pycann_float_t v) {
+  net->learning_rate = v;
+  net->partition_dirty = 1;
+}
+
+// Get activation function
+pycann_activation_function_t pycann_get_activation_function(pycann_t *net, unsigned int i) {
+  if (i<net->size) {
+    return net->activation_functions[i];
+  }
+  else {
+    return 0;
+  }
+}
+// Set activation function
+void pycann_set_activation_function(pycann_t *net, unsigned int i, pycann_activation_function_t activation_function) {
+  if (i<net->size) {
+    net->activation_functions[i] = activation_function;
+    net->runs_dirty = 1;
+  }
+}
+
+
+
+
+// Update whether neuron i is plastic, i.e. can change its weights (it needs
+// a modularity connection and non-zero gammas)
+static void pycann_update_plastic(pycann_t *net, unsigned int i) {
+  unsigned char p;
+
+  p = i>=net->num_inputs && net->mod_weights[i]!=0.0
+      && (PYCANN_GAMMA(net, i, 0)!=0.0 || PYCANN_GAMMA(net, i, 1)!=0.0 || PYCANN_GAMMA(net, i, 2)!=0.0 || PYCANN_GAMMA(net, i, 3)!=0.0);
+  net->num_plastic = net->num_plastic+p-net->plastic[i];
+  net->plastic[i] = p;
+  net->partition_dirty = 1;
+}
+
+// Get gamma
+void pycann_get_gamma(pycann_t *net, unsigned int i, pycann_float_t *gamma) {
+  if (i<net->size) {
+    memcpy(gamma, net->gammas+(i*4), 4*sizeof(pycann_float_t));
+  }
+  else {
+    pycann_set_error("Invalid neuron index: %d", i);
+  }
+}
+// Set gamma
+void pycann_set_gamma(pycann_t *net, unsigned int i, pycann_float_t *gamma) {
+  if (i<net->size) {
+    pycann_unshare(net);
+    memcpy(net->gammas+(i*4), gamma, 4*sizeof(pycann_float_t));
+    pycann_update_plastic(net, i);
+  }
+  else {
+    pycann_set_error("Invalid neuron index: %d", i);
+  }
+}
+// Get all gammas (4*size values, see PYCANN_GAMMA)
+void pycann_get_gammas(pycann_t *net, pycann_float_t *gammas) {
+  memcpy(gammas, net->gammas, 4*sizeof(pycann_float_t)*net->size);
+}
+// Set all gammas
+void pycann_set_gammas(pycann_t *net, const pycann_float_t *gammas) {
+  unsigned int i;
+
+  pycann_unshare(net);
+  memcpy(net->gammas, gammas, 4*sizeof(pycann_float_t)*net->size);
+  for (i=0; i<net->size; i=i+1) {
+    pycann_update_plastic(net, i);
+  }
+}
+
+
+
+
+// Find synapse from neuron j in sparse row i. Returns its position or, if it
+// doesn't exist, the position where it has to be inserted
+static unsigned int pycann_sparse_find(pycann_t *net, unsigned int i, unsigned int j) {
+  unsigned int a, b, c;
+
+  a = net->sparse_rows[i];
+  b = net->sparse_rows[i+1];
+  while (a<b) {
+    c = a+(b-a)/2;
+    if (net->sparse_columns[c]<j) {
+      a = c+1;
+    }
+    else {
+      b = c;
+    }
+  }
+  return a;
+}
+
+// Make room for at least n synapses in sparse storage
+static int pycann_sparse_reserve(pycann_t *net, unsigned int n) {
+  unsigned int c;
+  unsigned int *columns;
+  pycann_float_t *values;
+
+  if (n<=net->sparse_capacity) {
+    return 0;
+  }
+
+  c = net->sparse_capacity<16?16:net->sparse_capacity;
+  while (c<n) {
+    c = 2*c;
+  }
+
+  columns = pycann_realloc(net, net->sparse_columns, sizeof(unsigned int)*net->sparse_capacity, sizeof(unsigned int)*c);
+  if (columns==NULL) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  net->sparse_columns = columns;
+  values = pycann_realloc(net, net->sparse_values, sizeof(pycann_float_t)*net->sparse_capacity, sizeof(pycann_float_t)*c);
+  if (values==NULL) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  net->sparse_values = values;
+  net->sparse_capacity = c;
+
+  return 0;
+}
+
+// Set weight in sparse storage (inserts or removes synapses)
+static void pycann_sparse_set_weight(pycann_t *net, unsigned int i, unsigned int j, pycann_float_t v) {
+  unsigned int k, n, l;
+
+  k = pycann_sparse_find(net, i, j);
+  n = net->sparse_rows[net->size];
+
+  if (k<net->sparse_rows[i+1] && net->sparse_columns[k]==j) {
+    if (v!=0.0) {
+      net->sparse_values[k] = v;
+      return;
+    }
+
+    // remove synapse
+    memmove(net->sparse_columns+k, net->sparse_columns+k+1, sizeof(unsigned int)*(n-k-1));
+    memmove(net->sparse_values+k, net->sparse_values+k+1, sizeof(pycann_float_t)*(n-k-1));
+    for (l=i+1; l<=net->size; l=l+1) {
+      net->sparse_rows[l] = net->sparse_rows[l]-1;
+    }
+    net->partition_dirty = 1;
+  }
+  else if (v!=0.0) {
+    // insert synapse
+    if (pycann_sparse_reserve(net, n+1)!=0) {
+      return;
+    }
+    memmove(net->sparse_columns+k+1, net->sparse_columns+k, sizeof(unsigned int)*(n-k));
+    memmove(net->sparse_values+k+1, net->sparse_values+k, sizeof(pycann_float_t)*(n-k));
+    net->sparse_columns[k] = j;
+    net->sparse_values[k] = v;
+    for (l=i+1; l<=net->size; l=l+1) {
+      net->sparse_rows[l] = net->sparse_rows[l]+1;
+    }
+    net->partition_dirty = 1;
+  }
+}
+
+// Quantize weight v of an INT8 row with the given scale
+static inline int8_t pycann_quantize_i8(pycann_float_t v, pycann_float_t scale) {
+  long q;
+
+  if (scale==0.0) {
+    return 0;
+  }
+  q = lrintf(v/scale);
+  return (int8_t)(q>127?127:(q<-127?-127:q));
+}
+
+// Get weight from quantized storage
+static inline pycann_float_t pycann_quantized_weight(pycann_t *net, unsigned int i, unsigned int j) {
+  size_t k = (size_t)i*net->stride+j;
+
+  switch (net->storage) {
+    case PYCANN_STORAGE_FP16:
+      return pycann_half_to_float(((const uint16_t*)net->qweights)[k]);
+    case PYCANN_STORAGE_BF16:
+      return pycann_bf16_to_float(((const uint16_t*)net->qweights)[k]);
+    default:
+      return net->qscales[i]*((const int8_t*)net->qweights)[k];
+  }
+}
+
+// Set weight in INT8 storage. If v doesn't fit the row's scale the row is
+// requantized with a larger one.
+static void pycann_i8_set_weight(pycann_t *net, unsigned int i, unsigned int j, pycann_float_t v) {
+  int8_t *row = (int8_t*)net->qweights+(size_t)i*net->stride;
+  pycann_float_t scale, old;
+  unsigned int k;
+
+  old = net->qscales[i];
+  if (fabsf(v)>127.0*old) {
+    scale = fabsf(v)/127.0;
+    for (k=0; k<net->size; k=k+1) {
+      row[k] = pycann_quantize_i8(old*row[k], scale);
+    }
+    net->qscales[i] = scale;
+  }
+  row[j] = pycann_quantize_i8(v, net->qscales[i]);
+}
+
+// Get weight
+pycann_float_t pycann_get_weight(pycann_t *net, unsigned int i, unsigned int j) {
+  unsigned int k;
+
+  if (i<net->size && j<net->size) {
+    if (net->storage==PYCANN_STORAGE_SPARSE) {
+      k = pycann_sparse_find(net, i, j);
+      if (k<net->sparse_rows[i+1] && net->sparse_columns[k]==j) {
+        return net->sparse_values[k];
+      }
+      return 0.0;
+    }
+    if (pycann_is_quantized(net->storage)) {
+      return pycann_quantized_weight(net, i, j);
+    }
+    return PYCANN_WEIGHT(net, i, j);
+  }
+  else {
+    return 0.0;
+  }
+}
+// Set weight
+// NOTE: With sparse storage inserting a new synapse is O(number of synapses).
+//       Quantized storage rounds v, INT8 may have to requantize the row.
+void pycann_set_weight(pycann_t *net, unsigned int i, unsigned int j, pycann_float_t v) {
+  size_t k;
+
+  if (i<net->size && j<net->size) {
+    k = (size_t)i*net->stride+j;
+    pycann_unshare(net);
+    switch (net->storage) {
+      case PYCANN_STORAGE_SPARSE:
+        pycann_sparse_set_weight(net, i, j, v);
+        break;
+      case PYCANN_STORAGE_FP16:
+        ((uint16_t*)net->qweights)[k] = pycann_float_to_half(v);
+        break;
+      case PYCANN_STORAGE_BF16:
+        ((uint16_t*)net->qweights)[k] = pycann_float_to_bf16(v);
+        break;
+      case PYCANN_STORAGE_INT8:
+        pycann_i8_set_weight(net, i, j, v);
+        break;
+      default:
+        if (net->delta_valid) {
+          // patch the transposed weight and the net input using it
+          net->delta_sums[i] = net->delta_sums[i]+(v-PYCANN_WEIGHT(net, i, j))*net->delta_basis[j];
+          net->delta_columns[(size_t)j*net->stride+i] = v;
+        }
+        PYCANN_WEIGHT(net, i, j) = v;
+        break;
+    }
+  }
+}
+// Seed the network's random number generator (used by
+// pycann_set_random_weights_ex), networks are seeded in order of creation
+// otherwise
+void pycann_set_seed(pycann_t *net, uint64_t seed) {
+  net->random_state = seed;
+}
+
+// Get weight storage engine
+pycann_storage_t pycann_get_storage(pycann_t *net) {
+  return net->storage;
+}
+
+// Size of a quantized weight in bytes
+static inline size_t pycann_quantized_size(pycann_storage_t storage) {
+  return storage==PYCANN_STORAGE_INT8?sizeof(int8_t):sizeof(uint16_t);
+}
+
+// Convert dense weights to sparse storage
+static int pycann_dense_to_sparse(pycann_t *net) {
+  unsigned int i, j, n;
+  pycann_float_t w;
+
+  // count synapses
+  n = pycann_get_num_synapses(net);
+
+  // build CSR matrix
+  net->sparse_rows = pycann_malloc(net, sizeof(unsigned int)*(net->size+1));
+  if (net->sparse_rows==NULL || pycann_sparse_reserve(net, n)!=0) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  n = 0;
+  for (i=0; i<net->size; i=i+1) {
+    net->sparse_rows[i] = n;
+    for (j=0; j<net->size; j=j+1) {
+      w = PYCANN_WEIGHT(net, i, j);
+      if (w!=0.0) {
+        net->sparse_columns[n] = j;
+        net->sparse_values[n] = w;
+        n = n+1;
+      }
+    }
+  }
+  net->sparse_rows[net->size] = n;
+
+  pycann_free(net, net->weights, pycann_matrix_size(net, sizeof(pycann_float_t)));
+  net->weights = NULL;
+  net->storage = PYCANN_STORAGE_SPARSE;
+  return 0;
+}
+
+// Convert sparse weights to dense storage
+static int pycann_sparse_to_dense(pycann_t *net) {
+  unsigned int i, j, n;
+
+  net->stride = PYCANN_STRIDE(net->size);
+  net->weights = pycann_malloc(net, pycann_matrix_size(net, sizeof(pycann_float_t)));
+  if (net->weights==NULL) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  for (i=0; i<net->size; i=i+1) {
+    for (j=0; j<net->size; j=j+1) {
+      PYCANN_WEIGHT(net, i, j) = 0.0;
+    }
+    for (n=net->sparse_rows[i]; n<net->sparse_rows[i+1]; n=n+1) {
+      PYCANN_WEIGHT(net, i, net->sparse_columns[n]) = net->sparse_values[n];
+    }
+  }
+
+  pycann_free(net, net->sparse_rows, sizeof(unsigned int)*(net->size+1));
+  pycann_free(net, net->sparse_columns, sizeof(unsigned int)*net->sparse_capacity);
+  pycann_free(net, net->sparse_values, sizeof(pycann_float_t)*net->sparse_capacity);
+  net->sparse_rows = NULL;
+  net->sparse_columns = NULL;
+  net->sparse_values = NULL;
+  net->sparse_capacity = 0;
+  net->storage = PYCANN_STORAGE_DENSE;
+  return 0;
+}
+
+// Quantize the size weights w into row i of quantized storage (the padding
+// is zeroed)
+static void pycann_quantize_row(pycann_t *net, pycann_storage_t storage, unsigned int i, const pycann_float_t *w) {
+  unsigned int j;
+  size_t k;
+  pycann_float_t v, m;
+
+  if (storage==PYCANN_STORAGE_INT8) {
+    // symmetric scale per row, the largest weight maps to 127
+    m = 0.0;
+    for (j=0; j<net->size; j=j+1) {
+      v = fabsf(w[j]);
+      m = v>m?v:m;
+    }
+    net->qscales[i] = m/127.0;
+  }
+  for (j=0; j<net->stride; j=j+1) {
+    k = (size_t)i*net->stride+j;
+    v = j<net->size?w[j]:0.0;
+    if (storage==PYCANN_STORAGE_FP16) {
+      ((uint16_t*)net->qweights)[k] = pycann_float_to_half(v);
+    }
+    else if (storage==PYCANN_STORAGE_BF16) {
+      ((uint16_t*)net->qweights)[k] = pycann_float_to_bf16(v);
+    }
+    else {
+      ((int8_t*)net->qweights)[k] = pycann_quantize_i8(v, net->qscales[i]);
+    }
+  }
+}
+
+// Convert dense weights to quantized storage (keeps the row stride, the
+// padding is zeroed)
+static int pycann_quantize(pycann_t *net, pycann_storage_t storage) {
+  unsigned int i;
+
+  net->qweights = pycann_malloc(net, pycann_matrix_size(net, pycann_quantized_size(storage)));
+  if (net->qweights==NULL) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  if (storage==PYCANN_STORAGE_INT8) {
+    net->qscales = pycann_malloc(net, sizeof(pycann_float_t)*net->size);
+    if (net->qscales==NULL) {
+      pycann_free(net, net->qweights, pycann_matrix_size(net, pycann_quantized_size(storage)));
+      net->qweights = NULL;
+      pycann_set_error("Out of memory\n");
+      return -1;
+    }
+  }
+
+  for (i=0; i<net->size; i=i+1) {
+    pycann_quantize_row(net, storage, i, &PYCANN_WEIGHT(net, i, 0));
+  }
+
+  pycann_free(net, net->weights, pycann_matrix_size(net, sizeof(pycann_float_t)));
+  net->weights = NULL;
+  net->storage = storage;
+  return 0;
+}
+
+// Convert the quantized rows first upto (excluding) last to floats. w gets
+// (last-first)*stride weights, rows are stride weights apart.
+static void pycann_dequantize_rows(pycann_t *net, unsigned int first, unsigned int last, pycann_float_t *w) {
+  unsigned int i, j;
+
+  for (i=first; i<last; i=i+1) {
+    for (j=0; j<net->stride; j=j+1) {
+      w[(size_t)(i-first)*net->stride+j] = j<net->size?pycann_quantized_weight(net, i, j):0.0;
+    }
+  }
+}
+
+// Convert quantized weights back to dense storage
+static int pycann_dequantize(pycann_t *net) {
+  net->weights = pycann_malloc(net, pycann_matrix_size(net, sizeof(pycann_float_t)));
+  if (net->weights==NULL) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  pycann_dequantize_rows(net, 0, net->size, net->weights);
+
+  pycann_free(net, net->qweights, pycann_matrix_size(net, pycann_quantized_size(net->storage)));
+  pycann_free(net, net->qscales, sizeof(pycann_float_t)*net->size);
+  net->qweights = NULL;
+  net->qscales = NULL;
+  net->storage = PYCANN_STORAGE_DENSE;
+  return 0;
+}
+
+// Convert weights to another storage engine. Conversions go through dense
+// storage, converting to a quantized engine loses precision.
+int pycann_set_storage(pycann_t *net, pycann_storage_t storage) {
+  if (storage==net->storage) {
+    return 0;
+  }
+  if (storage>PYCANN_STORAGE_INT8) {
+    pycann_set_error("Invalid storage engine: %d\n", storage);
+    return -1;
+  }
+
+  net->partition_dirty = 1;
+  net->delta_valid = 0;
+  pycann_unshare(net);
+  // buffers of the weights are invalid now
+  net->params_exposed = net->params_exposed&~PYCANN_EXPOSED_WEIGHTS;
+  if (pycann_is_quantized(net->storage) && pycann_dequantize(net)!=0) {
+    return -1;
+  }
+  if (net->storage==PYCANN_STORAGE_SPARSE && pycann_sparse_to_dense(net)!=0) {
+    return -1;
+  }
+  if (storage==PYCANN_STORAGE_SPARSE) {
+    return pycann_dense_to_sparse(net);
+  }
+  if (pycann_is_quantized(storage)) {
+    return pycann_quantize(net, storage);
+  }
+  return 0;
+}
+
+// Get number of synapses (non-zero weights)
+unsigned int pycann_get_num_synapses(pycann_t *net) {
+  unsigned int i, j, n;
+
+  if (net->storage==PYCANN_STORAGE_SPARSE) {
+    return net->sparse_rows[net->size];
+  }
+
+  n = 0;
+  for (i=0; i<net->size; i=i+1) {
+    for (j=0; j<net->size; j=j+1) {
+      if (pycann_get_weight(net, i, j)!=0.0) {
+        n = n+1;
+      }
+    }
+  }
+  return n;
+}
+
+// Replace sparse row i by the non-zero weights of w (size weights)
+static int pycann_sparse_set_row(pycann_t *net, unsigned int i, const pycann_float_t *w) {
+  unsigned int j, k, e, c, n, l;
+
+  c = 0;
+  for (j=0; j<net->size; j=j+1) {
+    c = c+(w[j]!=0.0);
+  }
+  k = net->sparse_rows[i];
+  e = net->sparse_rows[i+1];
+  n = net->sparse_rows[net->size];
+  if (pycann_sparse_reserve(net, n-(e-k)+c)!=0) {
+    return -1;
+  }
+
+  // move the following rows and fill in the new one
+  memmove(net->sparse_columns+k+c, net->sparse_columns+e, sizeof(unsigned int)*(n-e));
+  memmove(net->sparse_values+k+c, net->sparse_values+e, sizeof(pycann_float_t)*(n-e));
+  for (l=i+1; l<=net->size; l=l+1) {
+    net->sparse_rows[l] = net->sparse_rows[l]-(e-k)+c;
+  }
+  for (j=0; j<net->size; j=j+1) {
+    if (w[j]!=0.0) {
+      net->sparse_columns[k] = j;
+      net->sparse_values[k] = w[j];
+      k = k+1;
+    }
+  }
+  net->partition_dirty = 1;
+  return 0;
+}
+
+// Get the weights of the synapses to neuron i (w gets size weights, w[j] is
+// pycann_get_weight(net, i, j))
+void pycann_get_weight_row(pycann_t *net, unsigned int i, pycann_float_t *w) {
+  unsigned int j, k;
+
+  if (i>=net->size) {
+    pycann_set_error("Invalid neuron index: %d", i);
+    return;
+  }
+  switch (net->storage) {
+    case PYCANN_STORAGE_DENSE:
+      memcpy(w, &PYCANN_WEIGHT(net, i, 0), sizeof(pycann_float_t)*net->size);
+      break;
+    case PYCANN_STORAGE_SPARSE:
+      memset(w, 0, sizeof(pycann_float_t)*net->size);
+      for (k=net->sparse_rows[i]; k<net->sparse_rows[i+1]; k=k+1) {
+        w[net->sparse_columns[k]] = net->sparse_values[k];
+      }
+      break;
+    default:
+      for (j=0; j<net->size; j=j+1) {
+        w[j] = pycann_quantized_weight(net, i, j);
+      }
+      break;
+  }
+}
+// Set the weights of the synapses to neuron i (see pycann_get_weight_row).
+// Quantized storage requantizes the whole row.
+int pycann_set_weight_row(pycann_t *net, unsigned int i, const pycann_float_t *w) {
+  if (i>=net->size) {
+    pycann_set_error("Invalid neuron index: %d", i);
+    return -1;
+  }
+  net->delta_valid = 0;
+  pycann_unshare(net);
+  switch (net->storage) {
+    case PYCANN_STORAGE_DENSE:
+      memcpy(&PYCANN_WEIGHT(net, i, 0), w, sizeof(pycann_float_t)*net->size);
+      return 0;
+    case PYCANN_STORAGE_SPARSE:
+      return pycann_sparse_set_row(net, i, w);
+    default:
+      pycann_quantize_row(net, net->storage, i, w);
+      return 0;
+  }
+}
+
+// Get all weights (w gets size*size weights, row i as of pycann_get_weight_row)
+void pycann_get_weights(pycann_t *net, pycann_float_t *w) {
+  unsigned int i;
+
+  for (i=0; i<net->size; i=i+1) {
+    pycann_get_weight_row(net, i, w+(size_t)i*net->size);
+  }
+}
+// Set all weights (see pycann_get_weights). Sparse storage is rebuilt from
+// the non-zero weights.
+int pycann_set_weights(pycann_t *net, const pycann_float_t *w) {
+  unsigned int i, j, n;
+  size_t k;
+
+  pycann_unshare(net);
+  if (net->storage==PYCANN_STORAGE_SPARSE) {
+    n = 0;
+    for (k=0; k<(size_t)net->size*net->size; k=k+1) {
+      n = n+(w[k]!=0.0);
+    }
+    if (pycann_sparse_reserve(net, n)!=0) {
+      return -1;
+    }
+    n = 0;
+    for (i=0; i<net->size; i=i+1) {
+      net->sparse_rows[i] = n;
+      for (j=0; j<net->size; j=j+1) {
+        k = (size_t)i*net->size+j;
+        if (w[k]!=0.0) {
+          net->sparse_columns[n] = j;
+          net->sparse_values[n] = w[k];
+          n = n+1;
+        }
+      }
+    }
+    net->sparse_rows[net->size] = n;
+    net->partition_dirty = 1;
+    return 0;
+  }
+
+  for (i=0; i<net->size; i=i+1) {
+    pycann_set_weight_row(net, i, w+(size_t)i*net->size);
+  }
+  return 0;
+}
+
+// Random weights of a call to pycann_set_random_weights_ex
+typedef struct {
+  pycann_t *net;
+  uint64_t select_seed; // stream picking the synapses of row i (counters i<<32|k or i<<32|j)
+  uint64_t value_seed;  // stream of weight (i, j) (counter i<<32|j)
+  unsigned int synapses; // per row
+  int scan;              // pick synapses by scanning the row (see pycann_random_rows)
+  pycann_distribution_t distribution;
+  pycann_float_t scale;
+  int error;
+} pycann_random_init_t;
+
+// Normal random number with standard deviation scale from 64 random bits r
+// (Box-Muller, u in (0, 1), in double precision so libm's rounding doesn't
+// matter)
+static PYCANN_NO_VECTORIZE pycann_float_t pycann_random_normal(pycann_float_t scale, uint64_t r) {
+  double u, v;
+
+  u = ((double)(r>>32)+0.5)*(1.0/4294967296.0);
+  v = (double)(r&0xffffffff)*(1.0/4294967296.0);
+  return scale*sqrt(-2.0*log(u))*cos(6.283185307179586*v);
+}
+
+// Random weight from 64 random bits r
+static inline pycann_float_t pycann_random_weight(pycann_random_init_t *init, uint64_t r) {
+  if (init->distribution==PYCANN_RANDOM_NORMAL) {
+    return pycann_random_normal(init->scale, r);
+  }
+  // uniform in (-1, 1): odd multiples of 2^-24, never 0 (exact in a float)
+  return init->scale*(pycann_float_t)((int32_t)(r>>39|1)-16777216)*(1.0/16777216.0);
+}
+
+// Set random weights of rows first upto (excluding) last, w is scratch space
+// for a row of quantized storage. Every number comes from the row's and
+// weight's counters, so the rows can be split between threads any way.
+// Sparse rows (see PYCANN_RANDOM_SCAN_DENSITY) pick their synapses with
+// Floyd's algorithm into the bitmap bits (size bits) and read it in column
+// order. Denser rows are scanned once: column j is picked with probability
+// (synapses still to pick)/(columns left), which also picks exactly the
+// requested number, with a single random number per column for the pick and
+// a uniform weight.
+static void pycann_random_rows(pycann_random_init_t *init, unsigned int first, unsigned int last, uint64_t *bits, pycann_float_t *w) {
+  pycann_t *net = init->net;
+  unsigned int i, j, k, n, m, t, words;
+  uint64_t b, r;
+  pycann_float_t *row;
+  pycann_float_bits_t v;
+  int sparse;
+
+  n = init->synapses;
+  words = (net->size+63)/64;
+  sparse = net->storage==PYCANN_STORAGE_SPARSE;
+  for (i=first; i<last; i=i+1) {
+    row = net->storage==PYCANN_STORAGE_DENSE?&PYCANN_WEIGHT(net, i, 0):w;
+    k = sparse?net->sparse_rows[i]:0;
+
+    if (init->scan) {
+      // the low bits of r pick, the high bits are the uniform weight. About
+      // every other column is picked, so the weight is masked instead of
+      // branched on, and the scan stops after the last pick.
+      for (j=0, m=n; m>0; j=j+1) {
+        r = pycann_random_at(init->value_seed, (uint64_t)i<<32|j);
+        t = ((r&0xffffffff)*(net->size-j))>>32<m;
+        if (init->distribution==PYCANN_RANDOM_NORMAL) {
+          v.f = t?pycann_random_weight(init, pycann_random_at(init->select_seed, (uint64_t)i<<32|j)):0.0;
+        }
+        else {
+          v.f = pycann_random_weight(init, r);
+          v.i = v.i&-t;
+        }
+        m = m-t;
+        if (sparse) {
+          // k is inside the row while m>0, a column not picked is overwritten
+          net->sparse_columns[k] = j;
+          net->sparse_values[k] = v.f;
+          k = k+t;
+        }
+        else {
+          row[j] = v.f;
+        }
+      }
+      if (!sparse) {
+        memset(row+j, 0, sizeof(pycann_float_t)*(net->size-j));
+      }
+    }
+    else {
+      // pick n of size neurons
+      memset(bits, 0, sizeof(uint64_t)*words);
+      for (k=0; k<n; k=k+1) {
+        j = net->size-n+k;
+        r = pycann_random_at(init->select_seed, (uint64_t)i<<32|k);
+        t = (unsigned int)(((r>>32)*((uint64_t)j+1))>>32);
+        t = bits[t/64]&(1ULL<<(t%64))?j:t;
+        bits[t/64] = bits[t/64]|(1ULL<<(t%64));
+      }
+
+      // weights of the picked synapses in column order
+      if (!sparse) {
+        memset(row, 0, sizeof(pycann_float_t)*net->size);
+      }
+      k = sparse?net->sparse_rows[i]:0;
+      for (t=0; t<words; t=t+1) {
+        for (b=bits[t]; b!=0; b=b&(b-1)) {
+          j = t*64+__builtin_ctzll(b);
+          if (sparse) {
+            net->sparse_columns[k] = j;
+            net->sparse_values[k] = pycann_random_weight(init, pycann_random_at(init->value_seed, (uint64_t)i<<32|j));
+            k = k+1;
+          }
+          else {
+            row[j] = pycann_random_weight(init, pycann_random_at(init->value_seed, (uint64_t)i<<32|j));
+          }
+        }
+      }
+    }
+    if (pycann_is_quantized(net->storage)) {
+      pycann_quantize_row(net, net->storage, i, w);
+    }
+  }
+}
+
+// Set random weights of rows first upto (excluding) last with scratch space
+// of its own
+static void pycann_random_range(pycann_random_init_t *init, unsigned int first, unsigned int last) {
+  uint64_t *bits;
+  pycann_float_t *w;
+
+  bits = malloc(sizeof(uint64_t)*((init->net->size+63)/64));
+  w = malloc(sizeof(pycann_float_t)*init->net->size);
+  if (bits==NULL || w==NULL) {
+    init->error = 1;
+  }
+  else {
+    pycann_random_rows(init, first, last, bits, w);
+  }
+  free(bits);
+  free(w);
+}
+
+#ifdef PYCANN_THREADING
+// Job: every thread sets the random weights of an equal share of the rows
+static void pycann_random_job(pycann_pool_t *pool, unsigned int thread, void *arg) {
+  pycann_random_init_t *init = (pycann_random_init_t*)arg;
+  unsigned int size = init->net->size;
+
+  pycann_random_range(init, (uint64_t)size*thread/pool->num_threads, (uint64_t)size*(thread+1)/pool->num_threads);
+}
+#endif /* PYCANN_THREADING */
+
+// Set random weights: every neuron gets round(connection_rate*size)
+// synapses from randomly picked neurons, the others are removed. Weights are
+// uniform in (-scale, scale) or normal with standard deviation scale, with
+// PYCANN_RANDOM_FAN_IN scale is divided by the square root of the synapses
+// per neuron. Rows are filled by the network's threads, the weights only
+// depend on the seed (see pycann_set_seed), not on the number of threads.
+int pycann_set_random_weights_ex(pycann_t *net, pycann_float_t connection_rate, pycann_distribution_t distribution, pycann_float_t scale, unsigned int flags) {
+  pycann_random_init_t init;
+  unsigned int i;
+
+  if (!(connection_rate>=0.0 && connection_rate<=1.0)) {
+    pycann_set_error("Invalid connection rate: %f\n", connection_rate);
+    return -1;
+  }
+  if (distribution!=PYCANN_RANDOM_UNIFORM && distribution!=PYCANN_RANDOM_NORMAL) {
+    pycann_set_error("Invalid distribution: %d\n", distribution);
+    return -1;
+  }
+
+  init.net = net;
+  init.select_seed = pycann_random(net);
+  init.value_seed = pycann_random(net);
+  init.synapses = (unsigned int)(connection_rate*net->size+0.5);
+  init.synapses = init.synapses<net->size?init.synapses:net->size;
+  init.scan = (uint64_t)init.synapses*PYCANN_RANDOM_SCAN_DENSITY>=net->size;
+  init.distribution = distribution;
+  init.scale = (flags&PYCANN_RANDOM_FAN_IN) && init.synapses>0?scale/sqrtf(init.synapses):scale;
+  init.error = 0;
+
+  if (net->storage==PYCANN_STORAGE_SPARSE) {
+    // every row has the same number of synapses
+    if ((uint64_t)init.synapses*net->size>UINT_MAX) {
+      pycann_set_error("Too many synapses: %u per neuron\n", init.synapses);
+      return -1;
+    }
+    if (pycann_sparse_reserve(net, init.synapses*net->size)!=0) {
+      return -1;
+    }
+    for (i=0; i<=net->size; i=i+1) {
+      net->sparse_rows[i] = i*init.synapses;
+    }
+    net->partition_dirty = 1;
+  }
+  net->delta_valid = 0;
+  pycann_unshare(net);
+
+#ifdef PYCANN_THREADING
+  pycann_pool_run(net->pool, pycann_random_job, &init);
+#else
+  pycann_random_range(&init, 0, net->size);
+#endif /* PYCANN_THREADING */
+  if (init.error) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Set random weights uniform in (-1, 1) (see pycann_set_random_weights_ex)
+void pycann_set_random_weights(pycann_t *net, pycann_float_t connection_rate) {
+  pycann_set_random_weights_ex(net, connection_rate, PYCANN_RANDOM_UNIFORM, 1.0, 0);
+}
+
+// Get the dense weights in place (rows are *stride weights apart, see
+// PYCANN_WEIGHT). Returns NULL if weights aren't stored dense. The buffer is
+// valid until the storage engine is changed or the network is deleted, steps
+// use full propagation until then (see pycann_set_propagation).
+pycann_float_t *pycann_get_weights_buffer(pycann_t *net, unsigned int *stride) {
+  if (net->storage!=PYCANN_STORAGE_DENSE) {
+    pycann_set_error("Weights aren't stored dense\n");
+    return NULL;
+  }
+  pycann_unshare(net);
+  net->params_exposed = net->params_exposed|PYCANN_EXPOSED_WEIGHTS;
+  net->delta_valid = 0;
+  *stride = net->stride;
+  return net->weights;
+}
+
+// Get threshold
+pycann_float_t pycann_get_threshold(pycann_t *net, unsigned int i) {
+  if (i<net->size) {
+    return net->thresholds[i];
+  }
+  else {
+    return 0.0;
+  }
+}
+// Set threshold
+void pycann_set_threshold(pycann_t *net, unsigned int i, pycann_float_t v) {
+  if (i<net->size) {
+    pycann_unshare(net);
+    net->thresholds[i] = v;
+  }
+}
+// Get all thresholds (size values)
+void pycann_get_thresholds(pycann_t *net, pycann_float_t *v) {
+  memcpy(v, net->thresholds, sizeof(pycann_float_t)*net->size);
+}
+// Set all thresholds
+void pycann_set_thresholds(pycann_t *net, const pycann_float_t *v) {
+  pycann_unshare(net);
+  memcpy(net->thresholds, v, sizeof(pycann_float_t)*net->size);
+}
+// Get the thresholds in place (valid until the network is deleted)
+pycann_float_t *pycann_get_thresholds_buffer(pycann_t *net) {
+  pycann_unshare(net);
+  net->params_exposed = net->params_exposed|PYCANN_EXPOSED_THRESHOLDS;
+  return net->thresholds;
+}
+
+// Get activation
+pycann_float_t pycann_get_activation(pycann_t *net, unsigned int i) {
+  if (i<net->size) {
+    return net->activations[i];
+  }
+  else {
+    return 0.0;
+  }
+}
+// Set activation
+void pycann_set_activation(pycann_t *net, unsigned int i, pycann_float_t v) {
+  if (i<net->size) {
+    net->activations[i] = v;
+  }
+}
+// Get all activations (size values)
+void pycann_get_activations(pycann_t *net, pycann_float_t *v) {
+  memcpy(v, net->activations, sizeof(pycann_float_t)*net->size);
+}
+// Set all activations
+void pycann_set_activations(pycann_t *net, const pycann_float_t *v) {
+  memcpy(net->activations, v, sizeof(pycann_float_t)*net->size);
+}
+// Get the activations in place (valid until the network is deleted)
+pycann_float_t *pycann_get_activations_buffer(pycann_t *net) {
+  return net->activations;
+}
+
+// Get modularity neuron
+unsigned int pycann_get_mod_neuron(pycann_t *net, unsigned int i) {
+  if (i<net->size) {
+    return net->mod_neurons[i];
+  }
+  else {
+    return 0;
   }
 }
 // Get modularity weight
@@ -384,139 +2386,1289 @@ pycann_float_t pycann_get_mod_weight(pycann_t *net, unsigned int i) {
     return net->mod_weights[i];
   }
   else {
-    return 0.0;
+    return 0.0;
+  }
+}
+// Set modularity connection
+void pycann_set_mod(pycann_t *net, unsigned int i, unsigned int j, pycann_float_t weight) {
+  if (i<net->size && j<net->size) {
+    net->mod_neurons[i] = j;
+    net->mod_weights[i] = net->learning_rate*weight;
+    pycann_update_plastic(net, i);
+  }
+}
+
+// Set inputs
+void pycann_set_inputs(pycann_t *net, pycann_float_t *inputs) {
+  memcpy(net->inputs, inputs, sizeof(pycann_float_t)*net->num_inputs);
+}
+// Get outputs
+void pycann_get_outputs(pycann_t *net, pycann_float_t *outputs) {
+  unsigned int i, o;
+
+  o = net->size-net->num_outputs;
+  for (i=0; i<net->num_outputs; i=i+1) {
+    outputs[i] = net->activations[o+i];
+  }
+}
+// Get number of inputs
+unsigned int pycann_get_num_inputs(pycann_t *net) {
+  return net->num_inputs;
+}
+// Get number of outputs
+unsigned int pycann_get_num_outputs(pycann_t *net) {
+  return net->num_outputs;
+}
+
+// Sigmoid 1/(1+exp(PYCANN_SIGMOID_BETA*x)) in single precision. The exponent
+// is clamped, so expf doesn't overflow (-ffast-math assumes finite math).
+static inline pycann_float_t pycann_sigmoid_exp(pycann_float_t x) {
+  x = PYCANN_SIGMOID_BETA*x;
+  x = x>80.0?80.0:(x<-80.0?-80.0:x);
+  return 1.0/(1.0+expf(x));
+}
+
+// Propagation of neuron i without plasticity (matrix-vector product of its
+// row with the activations a)
+static inline pycann_float_t pycann_propagate(pycann_t *net, unsigned int i, const pycann_float_t *a) {
+  unsigned int k;
+  size_t r;
+
+  r = (size_t)i*net->stride;
+  switch (net->storage) {
+    case PYCANN_STORAGE_SPARSE:
+      k = net->sparse_rows[i];
+      return pycann_kernels->dot_sparse(net->sparse_values+k, net->sparse_columns+k, a, net->sparse_rows[i+1]-k);
+    case PYCANN_STORAGE_FP16:
+      return pycann_kernels->dot_f16((const uint16_t*)net->qweights+r, a, net->size);
+    case PYCANN_STORAGE_BF16:
+      return pycann_kernels->dot_bf16((const uint16_t*)net->qweights+r, a, net->size);
+    case PYCANN_STORAGE_INT8:
+      return net->qscales[i]*pycann_kernels->dot_i8((const int8_t*)net->qweights+r, a, net->size);
+    default:
+      return pycann_kernels->dot(net->weights+r, a, net->size);
+  }
+}
+
+// Add the columns first upto (excluding) last of the dense rows r0 upto
+// (excluding) r1 to the net inputs o[r0..r1), in blocks of PYCANN_STEP_BLOCK
+// columns, so the block of a stays cached for all rows and every load of it
+// is used for several rows. Blocks are aligned to the columns (first must be
+// a multiple of PYCANN_STEP_BLOCK), so the sum of a row doesn't depend on the
+// rows stepped along with it (or on the thread stepping it), nor on how the
+// columns are split between calls.
+static void pycann_propagate_columns(pycann_t *net, unsigned int r0, unsigned int r1, unsigned int first, unsigned int last, const pycann_float_t *a, pycann_float_t *o) {
+  unsigned int c0, c1;
+
+  for (c0=first; c0<last; c0=c1) {
+    c1 = last-c0>PYCANN_STEP_BLOCK?c0+PYCANN_STEP_BLOCK:last;
+    pycann_kernels->gemv(o+r0, r1-r0, &PYCANN_WEIGHT(net, r0, c0), net->stride, a+c0, c1-c0);
+  }
+}
+
+// End of the tile of synchronous stepping starting at row r0 of rows upto
+// (excluding) last
+static inline unsigned int pycann_tile_end(pycann_t *net, unsigned int r0, unsigned int last) {
+  return last-r0>net->step_tile?r0+net->step_tile:last;
+}
+
+// Columns of the next step a pair's head step can sum for the tile ending at
+// row r1: the blocks whose activations are known once the tile is done
+static inline unsigned int pycann_fused_columns(pycann_t *net, unsigned int r1) {
+  return r1==net->size?r1:r1/PYCANN_STEP_BLOCK*PYCANN_STEP_BLOCK;
+}
+
+// Propagation of dense rows first upto (excluding) last into o[first..last),
+// in tiles of net->step_tile rows
+static void pycann_propagate_block(pycann_t *net, unsigned int first, unsigned int last, const pycann_float_t *a, pycann_float_t *o) {
+  unsigned int r0, r1;
+
+  memset(o+first, 0, sizeof(pycann_float_t)*(last-first));
+  for (r0=first; r0<last; r0=r1) {
+    r1 = pycann_tile_end(net, r0, last);
+    pycann_propagate_columns(net, r0, r1, 0, net->size, a, o);
+  }
+}
+
+// Propagation of neuron i fused with the Hebbian update of its row (m: modulation)
+static inline pycann_float_t pycann_propagate_hebbian(pycann_t *net, unsigned int i, const pycann_float_t *a, pycann_float_t m) {
+  unsigned int k;
+  pycann_float_t u;
+
+  u = a[i];
+  if (net->storage==PYCANN_STORAGE_SPARSE) {
+    // only visit existing synapses, plasticity doesn't create new ones
+    k = net->sparse_rows[i];
+    return pycann_kernels->dot_hebbian_sparse(net->sparse_values+k, net->sparse_columns+k, a, net->sparse_rows[i+1]-k, net->gammas+4*i, u, m);
+  }
+  return pycann_kernels->dot_hebbian(&PYCANN_WEIGHT(net, i, 0), a, net->size, net->gammas+4*i, u, m);
+}
+
+// Modulation of neuron i in the current step (0 if it doesn't learn)
+static inline pycann_float_t pycann_modulation(pycann_t *net, unsigned int i, const pycann_float_t *a) {
+  if (!net->plastic[i]) {
+    return 0.0;
+  }
+  return a[net->mod_neurons[i]] * net->mod_weights[i] * net->learning_rate;
+}
+
+// Activation function f with threshold t. The step loops call this with a
+// constant f, so the switch is resolved at compile time.
+static inline __attribute__((always_inline)) pycann_float_t pycann_activation(pycann_activation_function_t f, pycann_float_t t, pycann_float_t o) {
+  switch (f) {
+    case PYCANN_SIGMOID_STEP:
+      return o>=t?1.0:0.0;
+    case PYCANN_SIGMOID_EXP:
+      return pycann_sigmoid_exp(t-o);
+    case PYCANN_SIGMOID_APPROX:
+      return pycann_sigmoid_approx(t-o);
+    case PYCANN_LINEAR:
+      return o>1.0?1.0:(o<-0.0?0.0:o);
+    default:
+      return 0.0;
+  }
+}
+
+// Exponential sigmoid of neurons first upto (excluding) last in place. A
+// vectorized expf rounds differently than the scalar one, so vectorizing this
+// would make results depend on where threads split a run.
+static PYCANN_NO_VECTORIZE void pycann_activate_run_exp(pycann_t *net, unsigned int first, unsigned int last, pycann_float_t *a) {
+  unsigned int i;
+
+  for (i=first; i<last; i=i+1) {
+    a[i] = pycann_sigmoid_exp(net->thresholds[i]-a[i]);
+  }
+}
+
+// Activation of neurons first upto (excluding) last with activation function
+// f in place (a[i] holds the net input of neuron i)
+static inline __attribute__((always_inline)) void pycann_activate_run(pycann_t *net, pycann_activation_function_t f, unsigned int first, unsigned int last, pycann_float_t *a) {
+  unsigned int i;
+
+  if (f==PYCANN_SIGMOID_APPROX) {
+    for (i=first; i<last; i=i+1) {
+      a[i] = net->thresholds[i]-a[i];
+    }
+    pycann_kernels->sigmoid(a+first, a+first, last-first);
+  }
+  else if (f==PYCANN_SIGMOID_EXP) {
+    pycann_activate_run_exp(net, first, last, a);
+  }
+  else {
+    for (i=first; i<last; i=i+1) {
+      a[i] = pycann_activation(f, net->thresholds[i], a[i]);
+    }
+  }
+}
+
+// Step neurons first upto (excluding) last, which all have activation
+// function f (instantiated for every activation function by pycann_single_step).
+// Returns the number of weights changed by the Hebbian rule.
+static inline __attribute__((always_inline)) unsigned long pycann_step_run(pycann_t *net, pycann_activation_function_t f, unsigned int first, unsigned int last, const pycann_float_t *src, pycann_float_t *dst, const pycann_float_t *inputs) {
+  unsigned int i;
+  unsigned long u;
+  pycann_float_t o, m;
+  int sync;
+
+  if (first<net->num_inputs) {
+    // input neurons
+    memcpy(dst+first, inputs+first, sizeof(pycann_float_t)*(last-first));
+    pycann_activate_run(net, f, first, last, dst);
+    return 0;
+  }
+
+  // synchronous updates store net inputs and activate the whole run at the
+  // end, asynchronous updates must activate a neuron before the next one reads it
+  sync = src!=dst;
+  u = 0;
+  if (!pycann_can_learn(net)) {
+    // inference fast path: no neuron can learn in this step
+    if (sync && net->storage==PYCANN_STORAGE_DENSE) {
+      // net inputs were propagated by pycann_single_step
+      pycann_activate_run(net, f, first, last, dst);
+      return 0;
+    }
+    for (i=first; i<last; i=i+1) {
+      o = pycann_propagate(net, i, src);
+      dst[i] = sync?o:pycann_activation(f, net->thresholds[i], o);
+    }
+  }
+  else {
+    // only rows with a non-zero modulation go through the fused update kernel
+    for (i=first; i<last; i=i+1) {
+      m = pycann_modulation(net, i, src);
+      if (m!=0.0) {
+        o = pycann_propagate_hebbian(net, i, src, m);
+        u = u+(net->storage==PYCANN_STORAGE_SPARSE?net->sparse_rows[i+1]-net->sparse_rows[i]:net->size);
+      }
+      else {
+        o = pycann_propagate(net, i, src);
+      }
+      dst[i] = sync?o:pycann_activation(f, net->thresholds[i], o);
+    }
+  }
+  if (sync) {
+    pycann_activate_run(net, f, first, last, dst);
+  }
+  return u;
+}
+
+// Group neurons into runs with the same activation function
+static void pycann_update_runs(pycann_t *net) {
+  unsigned int i;
+
+  net->num_runs = 0;
+  for (i=0; i<net->size; i=i+1) {
+    if (i==0 || i==net->num_inputs || net->activation_functions[i]!=net->activation_functions[i-1]) {
+      net->runs[net->num_runs].first = i;
+      net->runs[net->num_runs].activation_function = net->activation_functions[i];
+      net->num_runs = net->num_runs+1;
+    }
+    net->runs[net->num_runs-1].last = i+1;
+  }
+  net->runs_dirty = 0;
+}
+
+// Step the neurons first upto (excluding) last run by run (see pycann_single_step)
+static unsigned long pycann_step_runs(pycann_t *net, unsigned int first, unsigned int last, const pycann_float_t *src, pycann_float_t *dst, const pycann_float_t *inputs) {
+  unsigned int r, lo, hi, a, b;
+  unsigned long u;
+
+  // find run containing neuron 'first'
+  lo = 0;
+  hi = net->num_runs;
+  while (hi-lo>1) {
+    r = (lo+hi)/2;
+    if (net->runs[r].first<=first) {
+      lo = r;
+    }
+    else {
+      hi = r;
+    }
+  }
+
+  u = 0;
+  for (r=lo; r<net->num_runs && net->runs[r].first<last; r=r+1) {
+    a = net->runs[r].first>first?net->runs[r].first:first;
+    b = net->runs[r].last<last?net->runs[r].last:last;
+    switch (net->runs[r].activation_function) {
+      case PYCANN_SIGMOID_STEP:
+        u = u+pycann_step_run(net, PYCANN_SIGMOID_STEP, a, b, src, dst, inputs);
+        break;
+      case PYCANN_SIGMOID_EXP:
+        u = u+pycann_step_run(net, PYCANN_SIGMOID_EXP, a, b, src, dst, inputs);
+        break;
+      case PYCANN_SIGMOID_APPROX:
+        u = u+pycann_step_run(net, PYCANN_SIGMOID_APPROX, a, b, src, dst, inputs);
+        break;
+      case PYCANN_LINEAR:
+        u = u+pycann_step_run(net, PYCANN_LINEAR, a, b, src, dst, inputs);
+        break;
+      default:
+        u = u+pycann_step_run(net, PYCANN_INVALID_ACTIVATION_FUNCTION, a, b, src, dst, inputs);
+    }
+  }
+  return u;
+}
+
+// Do a single step in a neural network (from neuron 'first' upto (excluding) neuron 'last').
+// Activations are read from src and written to dst. For asynchronous
+// updates both are the same buffer, so neurons see the new activations of
+// the neurons updated before them. Returns the number of weights changed by
+// the Hebbian rule.
+//
+// Dense synchronous inference propagates all non-input neurons at once, in
+// tiles (runs may be too short for the blocked kernel). Such steps of the
+// whole network go in pairs (fuse, see pycann_step_fuse): the head step
+// activates every tile right after summing it and, while the tile's weights
+// are still cached, sums the columns of the next step whose activations are
+// known by then into net->fused_sums. The tail step adds the other columns.
+// A row's blocks are summed in the same order either way, so pairs give the
+// same results as single steps, with about a quarter less weight traffic.
+static unsigned long pycann_single_step(pycann_t *net, unsigned int first, unsigned int last, const pycann_float_t *src, pycann_float_t *dst, const pycann_float_t *inputs, pycann_fuse_t fuse) {
+  unsigned int a, r0, r1;
+  unsigned long u;
+
+  a = first>net->num_inputs?first:net->num_inputs;
+  if (src==dst || a>=last || net->storage!=PYCANN_STORAGE_DENSE || pycann_can_learn(net)) {
+    return pycann_step_runs(net, first, last, src, dst, inputs);
+  }
+
+  if (fuse==PYCANN_FUSE_HEAD) {
+    u = first<a?pycann_step_runs(net, first, a, src, dst, inputs):0;
+    for (r0=a; r0<last; r0=r1) {
+      r1 = pycann_tile_end(net, r0, last);
+      memset(dst+r0, 0, sizeof(pycann_float_t)*(r1-r0));
+      pycann_propagate_columns(net, r0, r1, 0, net->size, src, dst);
+      u = u+pycann_step_runs(net, r0, r1, src, dst, inputs);
+      memset(net->fused_sums+r0, 0, sizeof(pycann_float_t)*(r1-r0));
+      pycann_propagate_columns(net, r0, r1, 0, pycann_fused_columns(net, r1), dst, net->fused_sums);
+    }
+    return u;
+  }
+
+  if (fuse==PYCANN_FUSE_TAIL) {
+    memcpy(dst+a, net->fused_sums+a, sizeof(pycann_float_t)*(last-a));
+    for (r0=a; r0<last; r0=r1) {
+      r1 = pycann_tile_end(net, r0, last);
+      pycann_propagate_columns(net, r0, r1, pycann_fused_columns(net, r1), net->size, src, dst);
+    }
+  }
+  else {
+    pycann_propagate_block(net, a, last, src, dst);
   }
+  return pycann_step_runs(net, first, last, src, dst, inputs);
 }
-// Set modularity connection
-void pycann_set_mod(pycann_t *net, unsigned int i, unsigned int j, pycann_float_t weight) {
-  if (i<net->size && j<net->size) {
-    net->mod_neurons[i] = net->activations+j;
-    net->mod_weights[i] = net->learning_rate*weight;
+
+// Activations read (src) and written (dst) in step s of pycann_step. With
+// synchronous updates the buffers alternate, pycann_step copies the back
+// buffer to the network's activations after an odd number of steps.
+static inline void pycann_step_buffers(pycann_t *net, unsigned int s, pycann_float_t **src, pycann_float_t **dst) {
+  if (net->update_mode==PYCANN_UPDATE_SYNC) {
+    *src = s&1?net->back_activations:net->activations;
+    *dst = s&1?net->activations:net->back_activations;
+  }
+  else {
+    *src = net->activations;
+    *dst = net->activations;
   }
 }
 
-// Set inputs
-void pycann_set_inputs(pycann_t *net, pycann_float_t *inputs) {
-  memcpy(net->inputs, inputs, sizeof(pycann_float_t)*net->num_inputs);
+// How step s of n steps of neurons first upto (excluding) last is fused
+// with its neighbour (see pycann_single_step). Only dense synchronous
+// inference steps of the whole network can be fused, a step of fewer
+// neurons doesn't know the activations of the others. Pairs are an even and
+// the following odd step.
+static inline pycann_fuse_t pycann_step_fuse(pycann_t *net, unsigned int s, unsigned int n, unsigned int first, unsigned int last) {
+  if (net->update_mode!=PYCANN_UPDATE_SYNC || net->storage!=PYCANN_STORAGE_DENSE || net->fused_sums==NULL || first!=0 || last!=net->size || pycann_can_learn(net)) {
+    return PYCANN_FUSE_NONE;
+  }
+  if (s&1) {
+    return PYCANN_FUSE_TAIL;
+  }
+  return s+1<n?PYCANN_FUSE_HEAD:PYCANN_FUSE_NONE;
 }
-// Get outputs
-void pycann_get_outputs(pycann_t *net, pycann_float_t *outputs) {
-  unsigned int i, o;
 
+// Make the result of n synchronous steps the network's activations. They're
+// copied instead of swapping the buffers, so net->activations never moves
+// (see pycann_get_activations_buffer).
+static void pycann_step_commit(pycann_t *net, unsigned int n) {
+  if (net->update_mode==PYCANN_UPDATE_SYNC && (n&1)) {
+    memcpy(net->activations, net->back_activations, sizeof(pycann_float_t)*net->size);
+  }
+}
+
+// Inputs of step s (the current row of a sequence, see pycann_run_sequence)
+static inline const pycann_float_t *pycann_step_inputs(pycann_t *net, unsigned int s) {
+  if (net->sequence==NULL) {
+    return net->inputs;
+  }
+  return net->sequence->inputs+(size_t)(s/net->sequence->steps)*net->num_inputs;
+}
+
+// Record the activations a of neurons first upto (excluding) last after step
+// s, if it's the last step of a sequence row
+static void pycann_sequence_record(pycann_t *net, unsigned int s, unsigned int first, unsigned int last, const pycann_float_t *a) {
+  pycann_sequence_t *seq = net->sequence;
+  unsigned int o, t;
+
+  if (seq==NULL || (s+1)%seq->steps!=0) {
+    return;
+  }
+  t = s/seq->steps;
+  if (seq->trace!=NULL) {
+    memcpy(seq->trace+(size_t)t*net->size+first, a+first, sizeof(pycann_float_t)*(last-first));
+  }
   o = net->size-net->num_outputs;
-  for (i=0; i<net->num_outputs; i=i+1) {
-    outputs[i] = net->activations[o+i];
+  if (seq->outputs!=NULL && last>o) {
+    first = first>o?first:o;
+    memcpy(seq->outputs+(size_t)t*net->num_outputs+first-o, a+first, sizeof(pycann_float_t)*(last-first));
   }
 }
-// Get number of inputs
-unsigned int pycann_get_num_inputs(pycann_t *net) {
-  return net->num_inputs;
+
+// Keep the activations of neurons first upto (excluding) last before an
+// asynchronous step (overwritten in place) for pycann_stable_change
+static inline void pycann_stable_before(pycann_t *net, unsigned int first, unsigned int last, const pycann_float_t *src, pycann_float_t *dst) {
+  if (net->stable!=NULL && src==dst) {
+    memcpy(net->back_activations+first, dst+first, sizeof(pycann_float_t)*(last-first));
+  }
 }
-// Get number of outputs
-unsigned int pycann_get_num_outputs(pycann_t *net) {
-  return net->num_outputs;
+
+// Largest change of the activations of neurons first upto (excluding) last
+// in a step that read src and wrote dst (0 unless stepping until stable)
+static inline pycann_float_t pycann_stable_change(pycann_t *net, unsigned int first, unsigned int last, const pycann_float_t *src, const pycann_float_t *dst) {
+  unsigned int i;
+  pycann_float_t d, m;
+
+  if (net->stable==NULL) {
+    return 0.0;
+  }
+  if (src==dst) {
+    src = net->back_activations;
+  }
+  m = 0.0;
+  for (i=first; i<last; i=i+1) {
+    d = fabsf(dst[i]-src[i]);
+    m = d>m?d:m;
+  }
+  return m;
+}
+
+// Check if steps use delta propagation (see pycann_set_propagation)
+static inline int pycann_delta_enabled(pycann_t *net) {
+  return net->propagation==PYCANN_PROPAGATION_DELTA && net->storage==PYCANN_STORAGE_DENSE && !pycann_can_learn(net)
+         && !(net->params_exposed&PYCANN_EXPOSED_WEIGHTS);
+}
+
+// Add d times the weights from neuron j (a column of the weights) to the net
+// inputs of all non-input neurons
+static inline void pycann_delta_scatter(pycann_t *net, unsigned int j, pycann_float_t d) {
+  pycann_kernels->axpy(net->delta_sums+net->num_inputs, d, net->delta_columns+(size_t)j*net->stride+net->num_inputs, net->size-net->num_inputs);
+}
+
+// Set the activation of neuron j in the basis of the net inputs to v
+static inline void pycann_delta_change(pycann_t *net, unsigned int j, pycann_float_t v) {
+  if (v!=net->delta_basis[j]) {
+    pycann_delta_scatter(net, j, v-net->delta_basis[j]);
+    net->delta_basis[j] = v;
+  }
+}
+
+// Bring the net inputs up to date with the activations a: recompute them
+// if invalid (the transposed weights, too), due for a refresh (rounding
+// errors add up) or too many neurons changed, otherwise add the columns of
+// the neurons whose activation changed since the last update
+static void pycann_delta_update(pycann_t *net, const pycann_float_t *a) {
+  unsigned int i, j, n;
+
+  // every change costs a column, with many changes a full update is cheaper
+  n = 0;
+  if (net->delta_valid) {
+    for (j=0; j<net->size; j=j+1) {
+      n = n+(a[j]!=net->delta_basis[j]);
+    }
+  }
+  if (!net->delta_valid) {
+    // transpose the weights, so columns are contiguous
+    for (i=0; i<net->size; i=i+1) {
+      for (j=0; j<net->size; j=j+1) {
+        net->delta_columns[(size_t)j*net->stride+i] = PYCANN_WEIGHT(net, i, j);
+      }
+    }
+  }
+  if (!net->delta_valid || net->delta_steps>=PYCANN_DELTA_REFRESH || n>net->size/PYCANN_DELTA_DENSITY) {
+    // synchronous updates use the same sums as pycann_single_step
+    if (net->update_mode==PYCANN_UPDATE_SYNC) {
+      pycann_propagate_block(net, net->num_inputs, net->size, a, net->delta_sums);
+    }
+    else {
+      for (j=net->num_inputs; j<net->size; j=j+1) {
+        net->delta_sums[j] = pycann_propagate(net, j, a);
+      }
+    }
+    memcpy(net->delta_basis, a, sizeof(pycann_float_t)*net->size);
+    net->delta_valid = 1;
+    net->delta_steps = 0;
+    return;
+  }
+  for (j=0; j<net->size; j=j+1) {
+    pycann_delta_change(net, j, a[j]);
+  }
+}
+
+// Step neurons first upto (excluding) last with activation function f using
+// the cached net inputs (see pycann_step_run). Asynchronous updates add the
+// change of every neuron right away, so the next neuron sees it. Synchronous
+// updates leave the changes to the next pycann_delta_update.
+static inline __attribute__((always_inline)) void pycann_delta_run(pycann_t *net, pycann_activation_function_t f, unsigned int first, unsigned int last, pycann_float_t *dst, const pycann_float_t *inputs, int sync) {
+  unsigned int i;
+
+  if (first<net->num_inputs) {
+    memcpy(dst+first, inputs+first, sizeof(pycann_float_t)*(last-first));
+    pycann_activate_run(net, f, first, last, dst);
+    for (i=first; i<last && !sync; i=i+1) {
+      pycann_delta_change(net, i, dst[i]);
+    }
+  }
+  else if (sync) {
+    memcpy(dst+first, net->delta_sums+first, sizeof(pycann_float_t)*(last-first));
+    pycann_activate_run(net, f, first, last, dst);
+  }
+  else {
+    for (i=first; i<last; i=i+1) {
+      dst[i] = pycann_activation(f, net->thresholds[i], net->delta_sums[i]);
+      pycann_delta_change(net, i, dst[i]);
+    }
+  }
+}
+
+// Do a single step with delta propagation (see pycann_single_step)
+static void pycann_delta_step(pycann_t *net, const pycann_float_t *src, pycann_float_t *dst, const pycann_float_t *inputs) {
+  unsigned int r, a, b;
+  int sync;
+
+  pycann_delta_update(net, src);
+  net->delta_steps = net->delta_steps+1;
+  sync = src!=dst;
+  for (r=0; r<net->num_runs; r=r+1) {
+    a = net->runs[r].first;
+    b = net->runs[r].last;
+    switch (net->runs[r].activation_function) {
+      case PYCANN_SIGMOID_STEP:
+        pycann_delta_run(net, PYCANN_SIGMOID_STEP, a, b, dst, inputs, sync);
+        break;
+      case PYCANN_SIGMOID_EXP:
+        pycann_delta_run(net, PYCANN_SIGMOID_EXP, a, b, dst, inputs, sync);
+        break;
+      case PYCANN_SIGMOID_APPROX:
+        pycann_delta_run(net, PYCANN_SIGMOID_APPROX, a, b, dst, inputs, sync);
+        break;
+      case PYCANN_LINEAR:
+        pycann_delta_run(net, PYCANN_LINEAR, a, b, dst, inputs, sync);
+        break;
+      default:
+        pycann_delta_run(net, PYCANN_INVALID_ACTIVATION_FUNCTION, a, b, dst, inputs, sync);
+    }
+  }
+}
+
+// Do n steps on the calling thread (full or delta propagation), stepping
+// until stable stops after the first stable step
+static void pycann_do_steps_serial(pycann_t *net, unsigned int n, int delta) {
+  unsigned int s;
+  int stable;
+  unsigned long u;
+  uint64_t t0, t1;
+  pycann_float_t *src, *dst;
+  pycann_thread_stats_t *stats;
+  uint64_t *mark;
+
+#ifdef PYCANN_THREADING
+  stats = &net->threads[0].stats;
+  mark = &net->threads[0].stats_mark;
+#else
+  stats = &net->thread_stats;
+  mark = &net->stats_mark;
+#endif /* PYCANN_THREADING */
+  if (net->stats_enabled && *mark!=0) {
+    stats->idle_time = stats->idle_time+pycann_now()-*mark;
+  }
+  stable = 0;
+  for (s=0; s<n && !stable; s=s+1) {
+    t0 = net->stats_enabled?pycann_now():0;
+    pycann_step_buffers(net, s, &src, &dst);
+    pycann_stable_before(net, 0, net->size, src, dst);
+    if (delta) {
+      pycann_delta_step(net, src, dst, pycann_step_inputs(net, s));
+      u = 0;
+    }
+    else {
+      u = pycann_single_step(net, 0, net->size, src, dst, pycann_step_inputs(net, s), pycann_step_fuse(net, s, n, 0, net->size));
+    }
+    pycann_sequence_record(net, s, 0, net->size, dst);
+    if (net->stats_enabled) {
+      t1 = pycann_now();
+      pycann_stats_range(stats, 0, net->size, dst, u, t1-t0);
+      pycann_stats_step(net, t1-t0);
+      *mark = t1;
+    }
+    stable = net->stable!=NULL && pycann_stable_change(net, 0, net->size, src, dst)<=net->stable->tolerance;
+  }
+  if (net->stable!=NULL) {
+    net->stable->steps = s;
+    net->stable->stable = stable;
+  }
+  pycann_step_commit(net, s);
+}
+
+// Do n steps (work is split between threads)
+static int pycann_do_steps(pycann_t *net, unsigned int n) {
+#ifdef PYCANN_THREADING
+  unsigned int i;
+#endif /* PYCANN_THREADING */
+
+  if (n==0) {
+    return 0;
+  }
+  if (net->runs_dirty) {
+    pycann_update_runs(net);
+  }
+  if (pycann_delta_enabled(net)) {
+    pycann_do_steps_serial(net, n, 1);
+    return 0;
+  }
+  // the full path may change weights (learning)
+  net->delta_valid = 0;
+  if (pycann_can_learn(net)) {
+    pycann_unshare(net);
+  }
+
+#ifdef PYCANN_THREADING
+  if (net->partition_dirty && pycann_partition(net)!=0) {
+    return -1;
+  }
+  for (i=0; i<net->num_threads; i=i+1) {
+    net->threads[i].work = 0;
+  }
+  net->chunk_counters[0] = 0;
+  net->chunk_counters[1] = 0;
+  net->steps = n;
+  pycann_pool_run(net->pool, pycann_step_job, net);
+  if (net->stable!=NULL && net->stable->steps<n) {
+    // threads stopped after the first stable step, which ended with the
+    // barrier before they checked it (and was counted there)
+    n = net->stable->steps;
+    net->stable->stable = 1;
+  }
+  else {
+    if (net->stable!=NULL) {
+      net->stable->stable = pycann_threads_change(net, n-1)<=net->stable->tolerance;
+    }
+    if (net->stats_enabled) {
+      // the last step ends with the pool's barrier
+      pycann_stats_step(net, pycann_now()-net->stats_step_start);
+    }
+  }
+  pycann_step_commit(net, n);
+#else
+  pycann_do_steps_serial(net, n, 0);
+#endif /* PYCANN_THREADING */
+  return 0;
+}
+
+// Do 'n' steps in a neural network (if the partition can't be computed no
+// step is done, see pycann_get_error)
+void pycann_step(pycann_t *net, unsigned int n) {
+  pycann_do_steps(net, n);
+}
+
+// Step until no activation changes by more than tolerance in a step (0:
+// until a step repeats the activations exactly), but at most max_steps
+// steps. Returns the number of steps done (including the stable one), stable
+// (if not NULL) is set if the last step was stable. The changes are checked
+// by the threads right after stepping their neurons, they all stop after the
+// same step.
+int pycann_step_until_stable(pycann_t *net, unsigned int max_steps, pycann_float_t tolerance, int *stable) {
+  pycann_stable_t check;
+
+  if (max_steps>INT_MAX) {
+    pycann_set_error("Invalid number of steps: %u\n", max_steps);
+    return -1;
+  }
+  if (net->update_mode!=PYCANN_UPDATE_SYNC && net->back_activations==NULL) {
+    net->back_activations = pycann_malloc(net, sizeof(pycann_float_t)*net->size);
+    if (net->back_activations==NULL) {
+      pycann_set_error("Out of memory\n");
+      return -1;
+    }
+  }
+
+  check.tolerance = tolerance;
+  check.steps = 0;
+  check.stable = 0;
+  net->stable = &check;
+  if (pycann_do_steps(net, max_steps)!=0) {
+    net->stable = NULL;
+    return -1;
+  }
+  net->stable = NULL;
+
+  if (stable!=NULL) {
+    *stable = check.stable;
+  }
+  return (int)check.steps;
+}
+
+// Drive the network with a sequence of length input rows (length*num_inputs
+// values): every row is applied to the input neurons for 'steps' steps, then
+// the outputs are written to row t of outputs (length*num_outputs values)
+// and, if trace isn't NULL, all activations to row t of trace (length*size
+// values). outputs may be NULL, too. Afterwards the inputs of the network are
+// the last row. All steps run in one go, threads don't wait between rows.
+int pycann_run_sequence(pycann_t *net, unsigned int length, const pycann_float_t *inputs, unsigned int steps, pycann_float_t *outputs, pycann_float_t *trace) {
+  pycann_sequence_t seq;
+
+  if (steps==0 || (uint64_t)length*steps>UINT_MAX) {
+    pycann_set_error("Invalid number of steps: %u rows of %u steps\n", length, steps);
+    return -1;
+  }
+  if (length==0) {
+    return 0;
+  }
+
+  seq.inputs = inputs;
+  seq.steps = steps;
+  seq.outputs = outputs;
+  seq.trace = trace;
+  net->sequence = &seq;
+  if (pycann_do_steps(net, length*steps)!=0) {
+    net->sequence = NULL;
+    return -1;
+  }
+  net->sequence = NULL;
+
+  memcpy(net->inputs, inputs+(size_t)(length-1)*net->num_inputs, sizeof(pycann_float_t)*net->num_inputs);
+  return 0;
+}
+
+// Activation function of neuron i applied to nb batched inputs o, results go to a
+static void pycann_activate_batch(pycann_t *net, unsigned int i, const pycann_float_t *o, pycann_float_t *a, unsigned int nb) {
+  unsigned int b;
+  pycann_float_t t;
+
+  t = net->thresholds[i];
+  switch (net->activation_functions[i]) {
+    case PYCANN_SIGMOID_STEP:
+      for (b=0; b<nb; b=b+1) {
+        a[b] = o[b]>=t?1.0:0.0;
+      }
+      break;
+    case PYCANN_SIGMOID_EXP:
+      for (b=0; b<nb; b=b+1) {
+        a[b] = pycann_sigmoid_exp(t-o[b]);
+      }
+      break;
+    case PYCANN_SIGMOID_APPROX:
+      for (b=0; b<nb; b=b+1) {
+        a[b] = t-o[b];
+      }
+      pycann_kernels->sigmoid(a, a, nb);
+      break;
+    case PYCANN_LINEAR:
+      for (b=0; b<nb; b=b+1) {
+        a[b] = o[b]>1.0?1.0:(o[b]<-0.0?0.0:o[b]);
+      }
+      break;
+    default:
+      for (b=0; b<nb; b=b+1) {
+        a[b] = 0.0;
+      }
+  }
+}
+
+// o += w[k]*a[k] for neurons k in [c0, c1) (w is a row of weights, a and o
+// hold nb batched values per neuron)
+static inline void pycann_batch_propagate(const pycann_float_t *w, unsigned int c0, unsigned int c1, const pycann_float_t *a, pycann_float_t *o, unsigned int nb) {
+  unsigned int k;
+
+  for (k=c0; k<c1; k=k+1) {
+    if (w[k]!=0.0) {
+      pycann_kernels->axpy(o, w[k], a+k*nb, nb);
+    }
+  }
+}
+
+// Do a single step for nb batched activation states. States are read from
+// src and written to dst (the same buffer for asynchronous updates), they're
+// neuron-major (a[i*nb+b]). o is scratch space for PYCANN_BATCH_TILE*nb
+// values, inputs is batch-major (inputs[b*num_inputs+i]). With quantized
+// storage w is scratch space for PYCANN_BATCH_TILE*stride weights, the rows
+// of each tile are converted to floats once per step.
+//
+// Dense rows are processed in tiles: the contributions of all neurons outside
+// the tile are already final for this step (updated before the tile or not
+// updated until after it), so they're computed as a blocked matrix-matrix
+// product. Only the synapses within the tile are added in neuron order, so
+// every state sees the same (already updated) activations as in
+// pycann_single_step. The result is equal up to rounding, the products are
+// summed in another order than by the row's dot product. With synchronous
+// updates there's no order at all and the whole step is a matrix-matrix
+// product.
+static void pycann_batch_single_step(pycann_t *net, const pycann_float_t *src, pycann_float_t *dst, pycann_float_t *o, pycann_float_t *w, const pycann_float_t *inputs, unsigned int nb) {
+  unsigned int r0, r1, r, c0, c1, k, b;
+  const pycann_float_t *rows;
+  int sync;
+
+  sync = src!=dst;
+
+  for (r0=0; r0<net->size; r0=r1) {
+    r1 = net->storage==PYCANN_STORAGE_SPARSE?r0+1:r0+PYCANN_BATCH_TILE;
+    if (r1>net->size) {
+      r1 = net->size;
+    }
+
+    memset(o, 0, sizeof(pycann_float_t)*(r1-r0)*nb);
+
+    // weights of the tile's rows (row r is at rows+(r-r0)*stride)
+    r = r0>net->num_inputs?r0:net->num_inputs;
+    rows = NULL;
+    if (net->storage==PYCANN_STORAGE_DENSE) {
+      rows = &PYCANN_WEIGHT(net, r0, 0);
+    }
+    else if (net->storage!=PYCANN_STORAGE_SPARSE && r<r1) {
+      pycann_dequantize_rows(net, r, r1, w+(size_t)(r-r0)*net->stride);
+      rows = w;
+    }
+
+    // neurons outside the tile, blocked by columns so they stay in cache for all rows of the tile
+    if (rows!=NULL && r<r1) {
+      for (c0=0; c0<net->size; c0=c1) {
+        c1 = c0+PYCANN_BATCH_BLOCK<net->size?c0+PYCANN_BATCH_BLOCK:net->size;
+        if (sync) {
+          pycann_kernels->gemm(o+(r-r0)*nb, r1-r, rows+(size_t)(r-r0)*net->stride+c0, net->stride, src+c0*nb, c1-c0, nb);
+          continue;
+        }
+        if (c0<r0) {
+          k = c1<r0?c1:r0;
+          pycann_kernels->gemm(o+(r-r0)*nb, r1-r, rows+(size_t)(r-r0)*net->stride+c0, net->stride, src+c0*nb, k-c0, nb);
+        }
+        if (c1>r1) {
+          k = c0>r1?c0:r1;
+          pycann_kernels->gemm(o+(r-r0)*nb, r1-r, rows+(size_t)(r-r0)*net->stride+k, net->stride, src+k*nb, c1-k, nb);
+        }
+      }
+    }
+
+    // neurons of the tile, in order
+    for (r=r0; r<r1; r=r+1) {
+      if (r<net->num_inputs) {
+        for (b=0; b<nb; b=b+1) {
+          o[(r-r0)*nb+b] = inputs==NULL?net->inputs[r]:inputs[b*net->num_inputs+r];
+        }
+      }
+      else if (net->storage==PYCANN_STORAGE_SPARSE) {
+        for (k=net->sparse_rows[r]; k<net->sparse_rows[r+1]; k=k+1) {
+          pycann_kernels->axpy(o, net->sparse_values[k], src+net->sparse_columns[k]*nb, nb);
+        }
+      }
+      else if (!sync) {
+        pycann_batch_propagate(rows+(size_t)(r-r0)*net->stride, r0, r1, src, o+(r-r0)*nb, nb);
+      }
+      pycann_activate_batch(net, r, o+(r-r0)*nb, dst+r*nb, nb);
+    }
+  }
+}
+
+// Do n steps for the states b0 upto (excluding) b1 of a batch
+static int pycann_batch_run(pycann_t *net, pycann_float_t *activations, const pycann_float_t *inputs, unsigned int b0, unsigned int b1, unsigned int n) {
+  unsigned int nb, i, b, s;
+  pycann_float_t *a, *a2, *o, *w, *t;
+
+  nb = b1-b0;
+  if (nb==0) {
+    return 0;
+  }
+
+  a = malloc(sizeof(pycann_float_t)*net->size*nb);
+  a2 = net->update_mode==PYCANN_UPDATE_SYNC?malloc(sizeof(pycann_float_t)*net->size*nb):a;
+  o = malloc(sizeof(pycann_float_t)*PYCANN_BATCH_TILE*nb);
+  w = pycann_is_quantized(net->storage)?malloc(sizeof(pycann_float_t)*PYCANN_BATCH_TILE*net->stride):NULL;
+  if (a==NULL || a2==NULL || o==NULL || (w==NULL && pycann_is_quantized(net->storage))) {
+    free(a);
+    if (a2!=a) {
+      free(a2);
+    }
+    free(o);
+    free(w);
+    return -1;
+  }
+  if (inputs!=NULL) {
+    inputs = inputs+b0*net->num_inputs;
+  }
+
+  // states are batch-major for the caller, but neuron-major internally
+  for (b=0; b<nb; b=b+1) {
+    for (i=0; i<net->size; i=i+1) {
+      a[i*nb+b] = activations[(b0+b)*net->size+i];
+    }
+  }
+  for (s=0; s<n; s=s+1) {
+    pycann_batch_single_step(net, a, a2, o, w, inputs, nb);
+    t = a;
+    a = a2;
+    a2 = t;
+  }
+  for (b=0; b<nb; b=b+1) {
+    for (i=0; i<net->size; i=i+1) {
+      activations[(b0+b)*net->size+i] = a[i*nb+b];
+    }
+  }
+
+  free(a);
+  if (a2!=a) {
+    free(a2);
+  }
+  free(o);
+  free(w);
+  return 0;
+}
+
+#ifdef PYCANN_THREADING
+// Batch stepping job: the states of the batch are split between threads
+typedef struct {
+  pycann_t *net;
+  unsigned int batch_size;
+  pycann_float_t *activations;
+  const pycann_float_t *inputs;
+  unsigned int n;
+  int error;
+} pycann_batch_job_t;
+
+static void pycann_batch_job(pycann_pool_t *pool, unsigned int thread, void *arg) {
+  pycann_batch_job_t *job = (pycann_batch_job_t*)arg;
+  unsigned int b0, b1;
+
+  b0 = (unsigned long)job->batch_size*thread/pool->num_threads;
+  b1 = (unsigned long)job->batch_size*(thread+1)/pool->num_threads;
+  if (pycann_batch_run(job->net, job->activations, job->inputs, b0, b1, job->n)!=0) {
+    job->error = 1;
+  }
+}
+#endif /* PYCANN_THREADING */
+
+// Initialize batch_size activation states (batch-major, batch_size*size
+// values) with the current activations of the network
+void pycann_init_batch(pycann_t *net, unsigned int batch_size, pycann_float_t *activations) {
+  unsigned int b;
+
+  for (b=0; b<batch_size; b=b+1) {
+    memcpy(activations+b*net->size, net->activations, sizeof(pycann_float_t)*net->size);
+  }
+}
+
+// Do 'n' steps for batch_size independent activation states against the
+// weights of the network. activations holds the states (batch-major,
+// batch_size*size values) and is updated in place, inputs holds the inputs
+// of every state (batch_size*num_inputs values, NULL to use the network's
+// inputs for all). The network's own activations don't change and weights
+// are not updated (no plasticity in batch mode).
+int pycann_step_batch(pycann_t *net, unsigned int batch_size, pycann_float_t *activations, const pycann_float_t *inputs, unsigned int n) {
+#ifdef PYCANN_THREADING
+  pycann_batch_job_t job;
+
+  if (n==0 || batch_size==0) {
+    return 0;
+  }
+  job.net = net;
+  job.batch_size = batch_size;
+  job.activations = activations;
+  job.inputs = inputs;
+  job.n = n;
+  job.error = 0;
+  pycann_pool_run(net->pool, pycann_batch_job, &job);
+  if (job.error) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+#else
+  if (n==0 || batch_size==0) {
+    return 0;
+  }
+  if (pycann_batch_run(net, activations, inputs, 0, batch_size, n)!=0) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+#endif /* PYCANN_THREADING */
+
+  return 0;
+}
+
+// Get outputs of batch_size activation states (batch_size*num_outputs values)
+void pycann_get_batch_outputs(pycann_t *net, unsigned int batch_size, const pycann_float_t *activations, pycann_float_t *outputs) {
+  unsigned int b;
+
+  for (b=0; b<batch_size; b=b+1) {
+    memcpy(outputs+b*net->num_outputs, activations+b*net->size+net->size-net->num_outputs, sizeof(pycann_float_t)*net->num_outputs);
+  }
+}
+
+// Checksum of a v4 file's sections: FNV-1a over 64 bit words (n is a
+// multiple of PYCANN_FILE_ALIGNMENT)
+static uint64_t pycann_checksum(const void *p, size_t n) {
+  const uint64_t *w;
+  uint64_t h;
+  size_t i;
+
+  w = p;
+  h = 0xcbf29ce484222325ULL;
+  for (i=0; i<n/8; i=i+1) {
+    h = (h^w[i])*0x100000001b3ULL;
+  }
+  return h;
 }
 
-// Sigmoidal approximation
-static pycann_float_t pycann_sigmoid_approx(pycann_float_t x) {
-  return x>=0.0?1.0:0.0; // TODO
+// Length of section id in a v4 file with this header, returns 0 if the file
+// has no such section
+static int pycann_section_length(const struct pycann_file_header_v4 *header, unsigned int id, uint64_t *length) {
+  uint64_t size;
+
+  size = header->size;
+  switch (id) {
+    case PYCANN_SECTION_GAMMAS:
+      *length = 4*size*sizeof(pycann_float_t);
+      return 1;
+    case PYCANN_SECTION_WEIGHTS:
+      *length = size*header->stride*sizeof(pycann_float_t);
+      return header->storage==PYCANN_STORAGE_DENSE;
+    case PYCANN_SECTION_WEIGHTS_FP16:
+      *length = size*header->stride*sizeof(uint16_t);
+      return header->storage==PYCANN_STORAGE_FP16;
+    case PYCANN_SECTION_WEIGHTS_BF16:
+      *length = size*header->stride*sizeof(uint16_t);
+      return header->storage==PYCANN_STORAGE_BF16;
+    case PYCANN_SECTION_WEIGHTS_INT8:
+      *length = size*header->stride*sizeof(int8_t);
+      return header->storage==PYCANN_STORAGE_INT8;
+    case PYCANN_SECTION_WEIGHT_SCALES:
+      *length = size*sizeof(pycann_float_t);
+      return header->storage==PYCANN_STORAGE_INT8;
+    case PYCANN_SECTION_SPARSE_ROWS:
+      *length = (size+1)*sizeof(unsigned int);
+      return header->storage==PYCANN_STORAGE_SPARSE;
+    case PYCANN_SECTION_SPARSE_COLUMNS:
+      *length = (uint64_t)header->num_synapses*sizeof(unsigned int);
+      return header->storage==PYCANN_STORAGE_SPARSE;
+    case PYCANN_SECTION_SPARSE_VALUES:
+      *length = (uint64_t)header->num_synapses*sizeof(pycann_float_t);
+      return header->storage==PYCANN_STORAGE_SPARSE;
+    case PYCANN_SECTION_THRESHOLDS:
+    case PYCANN_SECTION_ACTIVATIONS:
+    case PYCANN_SECTION_MOD_WEIGHTS:
+      *length = size*sizeof(pycann_float_t);
+      return 1;
+    case PYCANN_SECTION_MOD_NEURONS:
+      *length = size*sizeof(unsigned int);
+      return 1;
+    case PYCANN_SECTION_INPUTS:
+      *length = (uint64_t)header->num_inputs*sizeof(pycann_float_t);
+      return 1;
+    case PYCANN_SECTION_ACTIVATION_FUNCTIONS:
+      *length = size*sizeof(pycann_activation_function_t);
+      return 1;
+    default:
+      return 0;
+  }
 }
 
-// Internals of a neuron (propagation and activation function)
-static pycann_float_t pycann_neuron_internal(pycann_t *net, unsigned int i) {
-  unsigned int j;
-  pycann_float_t o, u, v, w, dw, m, mw, t;
+// Section holding the (row by row) weights of non-sparse storage
+static unsigned int pycann_weights_section(pycann_storage_t storage) {
+  switch (storage) {
+    case PYCANN_STORAGE_FP16:
+      return PYCANN_SECTION_WEIGHTS_FP16;
+    case PYCANN_STORAGE_BF16:
+      return PYCANN_SECTION_WEIGHTS_BF16;
+    case PYCANN_STORAGE_INT8:
+      return PYCANN_SECTION_WEIGHTS_INT8;
+    default:
+      return PYCANN_SECTION_WEIGHTS;
+  }
+}
 
-  t = net->thresholds[i];
+// Check header and section table of a mapped v4 file, sets sections[id] to
+// the start of each section. Returns an error message or NULL.
+static const char *pycann_check_file_v4(char *map, size_t length, unsigned int flags, char **sections) {
+  const struct pycann_file_header_v4 *header;
+  const struct pycann_file_section *table;
+  uint64_t expected, data;
+  unsigned int k, id;
 
-  // propagation
-  if (i<net->num_inputs) {
-    o = net->inputs[i];
+  header = (const struct pycann_file_header_v4*)map;
+  table = (const struct pycann_file_section*)(map+sizeof(*header));
+  if (header->byte_order!=PYCANN_FILE_BYTE_ORDER) {
+    return "Unsupported byte order";
+  }
+  if (header->header_size<sizeof(*header)+(uint64_t)header->num_sections*sizeof(*table) || header->header_size>length
+      || header->storage>PYCANN_STORAGE_INT8
+      || (header->storage!=PYCANN_STORAGE_SPARSE && header->stride<header->size)
+      || header->num_inputs>header->size || header->num_outputs>header->size) {
+    return "Invalid file header";
   }
-  else {
-    u = net->activations[i];
-    o = 0.0;
-    mw = net->mod_weights[i];
-    m = (*net->mod_neurons[i]) * mw * net->learning_rate;
 
-    for (j=0; j<net->size; j=j+1) {
-      w = PYCANN_WEIGHT(net, i, j);
-      v = net->activations[j];
-      o = o+w*v;
+  for (id=0; id<PYCANN_SECTION_MAX; id=id+1) {
+    sections[id] = NULL;
+  }
+  for (k=0; k<header->num_sections; k=k+1) {
+    id = table[k].id;
+    if (id>=PYCANN_SECTION_MAX || !pycann_section_length(header, id, &expected) || sections[id]!=NULL
+        || table[k].length!=expected || table[k].offset%PYCANN_FILE_ALIGNMENT!=0
+        || table[k].offset<header->header_size || table[k].offset>length || expected>length-table[k].offset) {
+      return "Invalid section table";
+    }
+    sections[id] = map+table[k].offset;
+  }
+  for (id=1; id<PYCANN_SECTION_MAX; id=id+1) {
+    if (pycann_section_length(header, id, &expected) && sections[id]==NULL) {
+      return "Missing section";
+    }
+  }
 
-      if (m!=0.0) {
-        dw = (signbit(w)?-1.0:1.0) * m * (PYCANN_GAMMA(net, i, 0)*u*v + PYCANN_GAMMA(net, i, 1)*v + PYCANN_GAMMA(net, i, 2)*u + PYCANN_GAMMA(net, i, 3));
-        PYCANN_WEIGHT(net, i, j) = w+dw;
-      }
+  if (flags&PYCANN_LOAD_VERIFY) {
+    data = PYCANN_ALIGN((uint64_t)header->header_size, PYCANN_FILE_ALIGNMENT);
+    if (data>length || pycann_checksum(map+data, length-data)!=header->checksum) {
+      return "Checksum mismatch";
     }
   }
 
-  // activations
-  switch (net->activation_functions[i]) {
-    case PYCANN_SIGMOID_STEP:
-      return o>=t?1.0:0.0;
-    case PYCANN_SIGMOID_EXP:
-      return 1.0/(1.0+exp(PYCANN_SIGMOID_BETA*(t-o)));
-    case PYCANN_SIGMOID_APPROX:
-      return pycann_sigmoid_approx(t-o);
-    case PYCANN_LINEAR:
-      return o>1.0?1.0:(o<-0.0?0.0:o);
-    default:
-      return 0.0;
+  return NULL;
+}
+
+// Check the CSR matrix of a loaded network, so steps don't access memory
+// outside of it and lookups find every synapse (one pass over the synapses,
+// done on every load)
+static int pycann_check_sparse(pycann_t *net, unsigned int num_synapses) {
+  unsigned int i, k;
+
+  if (net->sparse_rows[0]!=0 || net->sparse_rows[net->size]!=num_synapses) {
+    return -1;
+  }
+  for (i=0; i<net->size; i=i+1) {
+    if (net->sparse_rows[i]>net->sparse_rows[i+1] || net->sparse_rows[i+1]>num_synapses) {
+      return -1;
+    }
+    // columns of a row are strictly increasing (pycann_sparse_find does a
+    // binary search)
+    for (k=net->sparse_rows[i]; k<net->sparse_rows[i+1]; k=k+1) {
+      if (net->sparse_columns[k]>=net->size || (k>net->sparse_rows[i] && net->sparse_columns[k-1]>=net->sparse_columns[k])) {
+        return -1;
+      }
+    }
   }
+  return 0;
 }
 
-// Do a single step in a neural network (from neuron 'first' upto (excluding) neuron 'last')
-static void pycann_single_step(pycann_t *net, unsigned int first, unsigned int last) {
+// Check modulation neurons of a loaded network and update plasticity
+static int pycann_check_mod_neurons(pycann_t *net, const char *path) {
   unsigned int i;
 
-  for (i=first; i<last; i=i+1) {
-    net->activations[i] = pycann_neuron_internal(net, i);
+  for (i=0; i<net->size; i++) {
+    if (net->mod_neurons[i]>=net->size) {
+      pycann_set_error("Invalid modulation neuron %u: %s\n", net->mod_neurons[i], path);
+      return -1;
+    }
+    pycann_update_plastic(net, i);
   }
+  return 0;
 }
 
-// Do 'n' steps in a neural network (work is split between threads)
-void pycann_step(pycann_t *net, unsigned int n) {
-#ifdef PYCANN_THREADING
-  unsigned int i, s;
-  pycann_thread_t *self = net->threads;
+// Create a network from a privately mapped v4 file (of at least a header's
+// length): gammas, weights and thresholds are used in place, everything else
+// is copied. The network owns the mapping, it's unmapped on errors. path is
+// only used in error messages.
+static pycann_t *pycann_new_mapped(char *map, size_t length, const char *path, unsigned int num_threads, unsigned int flags) {
+  pycann_t *net;
+  char *sections[PYCANN_SECTION_MAX];
+  const struct pycann_file_header_v4 *header;
+  const char *error;
 
-  // tell  other threads number of steps (n)
-  for (i=1; i<net->num_threads; i=i+1) {
-    net->threads[i].steps = n;
+  error = pycann_check_file_v4(map, length, flags, sections);
+  if (error!=NULL) {
+    pycann_set_error("%s: %s\n", error, path);
+    munmap(map, length);
+    return NULL;
   }
+  header = (const struct pycann_file_header_v4*)map;
 
-  // calculate main threads part
-  for (s=0; s<n; s=s+1) {
-    pycann_single_step(net, self->first_neuron, self->last_neuron);
+  // create ANN from header information, parameters point into the mapping
+  net = pycann_new_ex(header->size, header->num_inputs, header->num_outputs, num_threads, PYCANN_NEW_MAPPED|(flags&PYCANN_NEW_LOAD_FLAGS)|(header->storage==PYCANN_STORAGE_SPARSE?PYCANN_NEW_SPARSE:0));
+  if (net==NULL) {
+    munmap(map, length);
+    return NULL;
+  }
+  net->mapping = map;
+  net->mapping_size = length;
+  net->learning_rate = header->learning_rate;
+  net->gammas = (pycann_float_t*)sections[PYCANN_SECTION_GAMMAS];
+  net->thresholds = (pycann_float_t*)sections[PYCANN_SECTION_THRESHOLDS];
+  if (header->storage==PYCANN_STORAGE_SPARSE) {
+    net->sparse_rows = (unsigned int*)sections[PYCANN_SECTION_SPARSE_ROWS];
+    net->sparse_columns = (unsigned int*)sections[PYCANN_SECTION_SPARSE_COLUMNS];
+    net->sparse_values = (pycann_float_t*)sections[PYCANN_SECTION_SPARSE_VALUES];
+    net->sparse_capacity = header->num_synapses;
+    if (pycann_check_sparse(net, header->num_synapses)!=0) {
+      pycann_set_error("Invalid sparse weight section: %s\n", path);
+      pycann_del(net);
+      return NULL;
+    }
+  }
+  else if (header->storage==PYCANN_STORAGE_DENSE) {
+    net->weights = (pycann_float_t*)sections[PYCANN_SECTION_WEIGHTS];
+    net->stride = header->stride;
+  }
+  else {
+    net->storage = header->storage;
+    net->qweights = sections[pycann_weights_section(net->storage)];
+    net->qscales = (pycann_float_t*)sections[PYCANN_SECTION_WEIGHT_SCALES];
+    net->stride = header->stride;
   }
 
-  // done
-  self->steps = 0;
+  // copy state
+  memcpy(net->activations, sections[PYCANN_SECTION_ACTIVATIONS], sizeof(pycann_float_t)*net->size);
+  memcpy(net->mod_weights, sections[PYCANN_SECTION_MOD_WEIGHTS], sizeof(pycann_float_t)*net->size);
+  memcpy(net->mod_neurons, sections[PYCANN_SECTION_MOD_NEURONS], sizeof(unsigned int)*net->size);
+  memcpy(net->inputs, sections[PYCANN_SECTION_INPUTS], sizeof(pycann_float_t)*net->num_inputs);
+  memcpy(net->activation_functions, sections[PYCANN_SECTION_ACTIVATION_FUNCTIONS], sizeof(pycann_activation_function_t)*net->size);
+  net->runs_dirty = 1;
+  net->partition_dirty = 1;
+  if (pycann_check_mod_neurons(net, path)!=0) {
+    pycann_del(net);
+    return NULL;
+  }
 
-  // wait for other threads to finish, before returning
-  for (i=1; i<net->num_threads; i=i+1) {
-    while (net->threads[i].steps>0) {
-      pycann_thread_yield();
+  if ((flags&PYCANN_NEW_SPARSE) && header->storage==PYCANN_STORAGE_DENSE) {
+    if (pycann_set_storage(net, PYCANN_STORAGE_SPARSE)!=0) {
+      pycann_del(net);
+      return NULL;
     }
   }
-#else
-  unsigned int s;
-
-  for (s=0; s<n; s=s+1) {
-    pycann_single_step(net, 0, net->size);
+#ifdef PYCANN_THREADING
+  // the mapping's pages were touched by the loader already
+  else if ((flags&PYCANN_NEW_FIRST_TOUCH) && header->storage==PYCANN_STORAGE_DENSE) {
+    if (pycann_first_touch_weights(net)!=0) {
+      pycann_del(net);
+      return NULL;
+    }
   }
 #endif /* PYCANN_THREADING */
+
+  return net;
+}
+
+// Loads a v4 file. The file is mapped privately (see pycann_new_mapped), so
+// processes loading the same file share the page cache until they change
+// the parameters.
+static pycann_t *pycann_load_file_v4(const char *path, unsigned int num_threads, unsigned int flags) {
+  int fd;
+  struct stat st;
+  char *map;
+  size_t length;
+
+  // map file
+  fd = open(path, O_RDONLY);
+  if (fd<0) {
+    pycann_set_error("Can't open file (for reading): %s\n", path);
+    return NULL;
+  }
+  if (fstat(fd, &st)!=0 || st.st_size<(off_t)sizeof(struct pycann_file_header_v4)) {
+    pycann_set_error("Invalid file header: %s\n", path);
+    close(fd);
+    return NULL;
+  }
+  length = st.st_size;
+  map = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map==MAP_FAILED) {
+    pycann_set_error("Can't map file: %s\n", path);
+    return NULL;
+  }
+  return pycann_new_mapped(map, length, path, num_threads, flags);
 }
 
 // Loads network from pycann format file
 // File extension .pcn
 pycann_t *pycann_load_file(const char *path, unsigned int num_threads) {
+  return pycann_load_file_ex(path, num_threads, 0);
+}
+
+// Loads network from pycann format file with flags (PYCANN_NEW_*, PYCANN_LOAD_*)
+// Sparse files are always loaded into sparse storage, dense files only if
+// PYCANN_NEW_SPARSE is given. Version 4 files are mapped (see
+// pycann_load_file_v4), older versions are read.
+pycann_t *pycann_load_file_ex(const char *path, unsigned int num_threads, unsigned int flags) {
   pycann_t *net;
   FILE *fd;
-  unsigned int i;
-  unsigned int *mod_neurons;
+  unsigned int i, n;
   struct pycann_file_header header;
+  int sparse, ok;
 
   // open file
   fd = fopen(path, "rb");
@@ -526,100 +3678,549 @@ pycann_t *pycann_load_file(const char *path, unsigned int num_threads) {
   }
 
   // load header
-  fread(&header, sizeof(header), 1, fd);
-  if (memcmp(header.magic, PYCANN_FILE_MAGIC, PYCANN_FILE_MAGIC_LENGTH)!=0) {
+  if (fread(&header, sizeof(header), 1, fd)!=1) {
+    memset(header.magic, 0, PYCANN_FILE_MAGIC_LENGTH);
+  }
+  if (memcmp(header.magic, PYCANN_FILE_MAGIC_V4, PYCANN_FILE_MAGIC_LENGTH)==0) {
+    fclose(fd);
+    return pycann_load_file_v4(path, num_threads, flags);
+  }
+  else if (memcmp(header.magic, PYCANN_FILE_MAGIC, PYCANN_FILE_MAGIC_LENGTH)==0) {
+    sparse = 0;
+  }
+  else if (memcmp(header.magic, PYCANN_FILE_MAGIC_SPARSE, PYCANN_FILE_MAGIC_LENGTH)==0) {
+    sparse = 1;
+  }
+  else {
     pycann_set_error("Invalid file signature: %s\n", path);
     fclose(fd);
     return NULL;
   }
+  if (header.num_inputs>header.size || header.num_outputs>header.size) {
+    pycann_set_error("Invalid file header: %s\n", path);
+    fclose(fd);
+    return NULL;
+  }
 
   // create ANN from header information
-  net = pycann_new(header.size, header.num_inputs, header.num_outputs, num_threads);
+  net = pycann_new_ex(header.size, header.num_inputs, header.num_outputs, num_threads, (flags&PYCANN_NEW_LOAD_FLAGS)|(sparse?PYCANN_NEW_SPARSE:0));
   if (net==NULL) {
     fclose(fd);
     return NULL;
   }
   net->learning_rate = header.learning_rate;
+  net->partition_dirty = 1;
 
   // load weights, etc.
-  fread(net->gammas, 4*sizeof(pycann_float_t), header.size, fd);
-  fread(net->weights, sizeof(pycann_float_t), header.size*header.size, fd);
-  fread(net->thresholds, sizeof(pycann_float_t), header.size, fd);
-  fread(net->activations, sizeof(pycann_float_t), header.size, fd);
-  fread(net->mod_weights, sizeof(pycann_float_t), header.size, fd);
-  fread(net->inputs, sizeof(pycann_float_t), header.num_inputs, fd);
-  fread(net->activation_functions, sizeof(pycann_activation_function_t), net->size, fd);
-  // load mod_neurons
-  mod_neurons = malloc(sizeof(unsigned int)*header.size);
-  fread(mod_neurons, sizeof(unsigned int), header.size, fd);
-  for (i=0; i<header.size; i++) {
-    net->mod_neurons[i] = net->activations+mod_neurons[i];
-  }
-  free(mod_neurons);
+  ok = fread(net->gammas, 4*sizeof(pycann_float_t), header.size, fd)==header.size;
+  if (sparse) {
+    // CSR section: number of synapses, row offsets, columns, values
+    if (!ok || fread(&n, sizeof(unsigned int), 1, fd)!=1 || pycann_sparse_reserve(net, n)!=0
+        || fread(net->sparse_rows, sizeof(unsigned int), header.size+1, fd)!=header.size+1
+        || fread(net->sparse_columns, sizeof(unsigned int), n, fd)!=n
+        || fread(net->sparse_values, sizeof(pycann_float_t), n, fd)!=n
+        || pycann_check_sparse(net, n)!=0) {
+      pycann_set_error("Invalid sparse weight section: %s\n", path);
+      pycann_del(net);
+      fclose(fd);
+      return NULL;
+    }
+  }
+  else {
+    for (i=0; i<header.size; i=i+1) {
+      ok = ok && fread(&PYCANN_WEIGHT(net, i, 0), sizeof(pycann_float_t), header.size, fd)==header.size;
+    }
+  }
+  ok = ok && fread(net->thresholds, sizeof(pycann_float_t), header.size, fd)==header.size;
+  ok = ok && fread(net->activations, sizeof(pycann_float_t), header.size, fd)==header.size;
+  ok = ok && fread(net->mod_weights, sizeof(pycann_float_t), header.size, fd)==header.size;
+  ok = ok && fread(net->inputs, sizeof(pycann_float_t), header.num_inputs, fd)==header.num_inputs;
+  ok = ok && fread(net->activation_functions, sizeof(pycann_activation_function_t), header.size, fd)==header.size;
+  ok = ok && fread(net->mod_neurons, sizeof(unsigned int), header.size, fd)==header.size;
+  net->runs_dirty = 1;
 
   // close file
   fclose(fd);
 
+  if (!ok) {
+    pycann_set_error("Unexpected end of file: %s\n", path);
+    pycann_del(net);
+    return NULL;
+  }
+  if (pycann_check_mod_neurons(net, path)!=0) {
+    pycann_del(net);
+    return NULL;
+  }
+
+  if ((flags&PYCANN_NEW_SPARSE) && !sparse) {
+    if (pycann_set_storage(net, PYCANN_STORAGE_SPARSE)!=0) {
+      pycann_del(net);
+      return NULL;
+    }
+  }
+
   return net;
 }
 
-// Saves network into the pycann format file
+// Write zeros to pad n bytes to a multiple of PYCANN_FILE_ALIGNMENT
+static int pycann_write_padding(FILE *fd, uint64_t n) {
+  static const char zeros[PYCANN_FILE_ALIGNMENT];
+
+  n = PYCANN_ALIGN(n, PYCANN_FILE_ALIGNMENT)-n;
+  return fwrite(zeros, 1, n, fd)==n;
+}
+
+// Write the network as v4 file to fd (at its start), length gets the file's
+// length. Returns 0 on errors.
+static int pycann_write_v4(FILE *fd, pycann_t *net, uint64_t *length) {
+  struct pycann_file_header_v4 header;
+  struct pycann_file_section table[PYCANN_SECTION_MAX];
+  const void *data[PYCANN_SECTION_MAX];
+  static const pycann_float_t zeros[PYCANN_FILE_ROW_ALIGNMENT];
+  void *map;
+  uint64_t offset;
+  const char *row;
+  size_t esize;
+  unsigned int i, k, n, w;
+  int ok;
+
+  // fill in header
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PYCANN_FILE_MAGIC_V4, PYCANN_FILE_MAGIC_LENGTH);
+  header.byte_order = PYCANN_FILE_BYTE_ORDER;
+  header.size = net->size;
+  header.num_inputs = net->num_inputs;
+  header.num_outputs = net->num_outputs;
+  header.storage = net->storage;
+  header.learning_rate = net->learning_rate;
+  if (net->storage==PYCANN_STORAGE_SPARSE) {
+    header.num_synapses = net->sparse_rows[net->size];
+  }
+  else {
+    header.stride = PYCANN_ALIGN(net->size, PYCANN_FILE_ROW_ALIGNMENT);
+  }
+
+  // section table (dense and quantized weights are written row by row)
+  w = pycann_weights_section(net->storage);
+  esize = pycann_is_quantized(net->storage)?pycann_quantized_size(net->storage):sizeof(pycann_float_t);
+  n = 0;
+  table[n].id = PYCANN_SECTION_GAMMAS;
+  data[n++] = net->gammas;
+  if (net->storage==PYCANN_STORAGE_SPARSE) {
+    table[n].id = PYCANN_SECTION_SPARSE_ROWS;
+    data[n++] = net->sparse_rows;
+    table[n].id = PYCANN_SECTION_SPARSE_COLUMNS;
+    data[n++] = net->sparse_columns;
+    table[n].id = PYCANN_SECTION_SPARSE_VALUES;
+    data[n++] = net->sparse_values;
+  }
+  else {
+    table[n].id = w;
+    data[n++] = NULL;
+  }
+  if (net->storage==PYCANN_STORAGE_INT8) {
+    table[n].id = PYCANN_SECTION_WEIGHT_SCALES;
+    data[n++] = net->qscales;
+  }
+  table[n].id = PYCANN_SECTION_THRESHOLDS;
+  data[n++] = net->thresholds;
+  table[n].id = PYCANN_SECTION_ACTIVATIONS;
+  data[n++] = net->activations;
+  table[n].id = PYCANN_SECTION_MOD_WEIGHTS;
+  data[n++] = net->mod_weights;
+  table[n].id = PYCANN_SECTION_MOD_NEURONS;
+  data[n++] = net->mod_neurons;
+  table[n].id = PYCANN_SECTION_INPUTS;
+  data[n++] = net->inputs;
+  table[n].id = PYCANN_SECTION_ACTIVATION_FUNCTIONS;
+  data[n++] = net->activation_functions;
+  header.num_sections = n;
+  header.header_size = sizeof(header)+n*sizeof(table[0]);
+  offset = PYCANN_ALIGN(header.header_size, PYCANN_FILE_ALIGNMENT);
+  for (k=0; k<n; k=k+1) {
+    pycann_section_length(&header, table[k].id, &table[k].length);
+    table[k].reserved = 0;
+    table[k].offset = offset;
+    offset = offset+PYCANN_ALIGN(table[k].length, PYCANN_FILE_ALIGNMENT);
+  }
+  *length = offset;
+
+  // write header and sections
+  ok = fwrite(&header, sizeof(header), 1, fd)==1 && fwrite(table, sizeof(table[0]), n, fd)==n;
+  ok = ok && pycann_write_padding(fd, header.header_size);
+  for (k=0; k<n; k=k+1) {
+    if (table[k].id==w) {
+      row = pycann_is_quantized(net->storage)?(const char*)net->qweights:(const char*)net->weights;
+      for (i=0; i<net->size; i=i+1) {
+        ok = ok && fwrite(row+(size_t)i*net->stride*esize, esize, net->size, fd)==net->size;
+        ok = ok && fwrite(zeros, esize, header.stride-net->size, fd)==header.stride-net->size;
+      }
+    }
+    else {
+      ok = ok && fwrite(data[k], 1, table[k].length, fd)==table[k].length;
+    }
+    ok = ok && pycann_write_padding(fd, table[k].length);
+  }
+
+  // checksum of the sections as written
+  ok = ok && fflush(fd)==0;
+  if (ok) {
+    map = mmap(NULL, offset, PROT_READ, MAP_SHARED, fileno(fd), 0);
+    if (map==MAP_FAILED) {
+      ok = 0;
+    }
+    else {
+      header.checksum = pycann_checksum((char*)map+table[0].offset, offset-table[0].offset);
+      munmap(map, offset);
+    }
+  }
+  return ok && fseek(fd, 0, SEEK_SET)==0 && fwrite(&header, sizeof(header), 1, fd)==1 && fflush(fd)==0;
+}
+
+// Saves network into the pycann format file (version 4)
 // File extension .pcn
+// The file is written to path.tmp and renamed afterwards, so networks mapped
+// from path keep their (old) file.
 int pycann_save_file(const char *path, pycann_t *net) {
   FILE *fd;
-  struct pycann_file_header header;
-  unsigned int i;
-  unsigned int *mod_neurons;
+  char *tmp;
+  uint64_t length;
+  int ok;
 
   // open file
-  fd = fopen(path, "w");
+  tmp = malloc(strlen(path)+5);
+  if (tmp==NULL) {
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+  sprintf(tmp, "%s.tmp", path);
+  fd = fopen(tmp, "w+b");
   if (fd==NULL) {
-    pycann_set_error("Can't open file (for writing): %s\n", path);
+    pycann_set_error("Can't open file (for writing): %s\n", tmp);
+    free(tmp);
     return -1;
   }
 
-  // fill in header
-  memcpy(header.magic, PYCANN_FILE_MAGIC, PYCANN_FILE_MAGIC_LENGTH);
-  header.size = net->size;
-  header.learning_rate = net->learning_rate;
-  header.num_inputs = net->num_inputs;
-  header.num_outputs = net->num_outputs;
-  fwrite(&header, sizeof(header), 1, fd);
-
-  // write weights, etc.
-  fwrite(net->gammas, 4*sizeof(pycann_float_t), net->size, fd);
-  fwrite(net->weights, sizeof(pycann_float_t), net->size*net->size, fd);
-  fwrite(net->thresholds, sizeof(pycann_float_t), net->size, fd);
-  fwrite(net->activations, sizeof(pycann_float_t), net->size, fd);
-  fwrite(net->mod_weights, sizeof(pycann_float_t), net->size, fd);
-  fwrite(net->inputs, sizeof(pycann_float_t), net->num_inputs, fd);
-  fwrite(net->activation_functions, sizeof(pycann_activation_function_t), net->size, fd);
-  // write mod neurons
-  mod_neurons = malloc(sizeof(unsigned int)*net->size);
-  for (i=0; i<header.size; i++) {
-    mod_neurons[i] = net->mod_neurons[i]-net->activations;
-  }
-  fwrite(mod_neurons, sizeof(unsigned int), net->size, fd);
-  free(mod_neurons);
+  // write and close file
+  ok = pycann_write_v4(fd, net, &length);
+  ok = fclose(fd)==0 && ok;
+  if (!ok || rename(tmp, path)!=0) {
+    pycann_set_error("Can't write file: %s\n", path);
+    remove(tmp);
+    free(tmp);
+    return -1;
+  }
+  free(tmp);
 
-  // close file
-  fclose(fd);
+  return 0;
+}
+
+// Write a snapshot of the network into memory (with one reference)
+static pycann_snapshot_t *pycann_snapshot_new(pycann_t *net) {
+  pycann_snapshot_t *snapshot;
+  FILE *fd;
+  uint64_t length;
+  int ok;
+
+  snapshot = malloc(sizeof(pycann_snapshot_t));
+  if (snapshot==NULL) {
+    return NULL;
+  }
+#ifdef MFD_CLOEXEC
+  snapshot->fd = memfd_create("pycann-snapshot", MFD_CLOEXEC);
+  fd = snapshot->fd<0?NULL:fdopen(dup(snapshot->fd), "w+b");
+#else
+  fd = tmpfile();
+  snapshot->fd = fd==NULL?-1:dup(fileno(fd));
+#endif /* MFD_CLOEXEC */
+  ok = fd!=NULL && snapshot->fd>=0 && pycann_write_v4(fd, net, &length);
+  if (fd!=NULL) {
+    ok = fclose(fd)==0 && ok;
+  }
+  if (!ok) {
+    if (snapshot->fd>=0) {
+      close(snapshot->fd);
+    }
+    free(snapshot);
+    return NULL;
+  }
+  snapshot->length = length;
+  snapshot->refs = 1;
+  return snapshot;
+}
+
+// Clone network with num_threads threads and flags (PYCANN_NEW_* of
+// pycann_load_file_ex). Gammas, weights and thresholds are shared
+// copy-on-write: they're written once into a snapshot in memory, which the
+// clones map privately (like a loaded v4 file), so a clone only gets its own
+// copy of a page of parameters when it first changes it. Clones of a network
+// share its snapshot until the network's parameters change (or are handed
+// out in place, see pycann_get_weights_buffer). The other state is copied,
+// but delta propagation isn't enabled and the clone's random number
+// generator is seeded like a new network's.
+pycann_t *pycann_clone(pycann_t *net, unsigned int num_threads, unsigned int flags) {
+  pycann_snapshot_t *snapshot;
+  pycann_t *clone;
+  char *map;
+
+  // get a reference to the network's snapshot
+  if (net->snapshot==NULL) {
+    snapshot = pycann_snapshot_new(net);
+    if (snapshot==NULL) {
+      pycann_set_error("Can't write snapshot\n");
+      return NULL;
+    }
+    if (!net->params_exposed) {
+      net->snapshot = snapshot;
+      snapshot->refs = 2;
+    }
+  }
+  else {
+    snapshot = net->snapshot;
+    __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+  }
+
+  // the clone's parameters point into its mapping
+  map = mmap(NULL, snapshot->length, PROT_READ|PROT_WRITE, MAP_PRIVATE, snapshot->fd, 0);
+  if (map==MAP_FAILED) {
+    pycann_set_error("Can't map snapshot\n");
+    pycann_snapshot_release(snapshot);
+    return NULL;
+  }
+  clone = pycann_new_mapped(map, snapshot->length, "snapshot", num_threads, flags&PYCANN_NEW_LOAD_FLAGS);
+  if (clone==NULL) {
+    pycann_snapshot_release(snapshot);
+    return NULL;
+  }
+  clone->snapshot = snapshot;
+
+  // copy state (the snapshot's may be older)
+  clone->learning_rate = net->learning_rate;
+  memcpy(clone->activations, net->activations, sizeof(pycann_float_t)*net->size);
+  memcpy(clone->inputs, net->inputs, sizeof(pycann_float_t)*net->num_inputs);
+  memcpy(clone->mod_weights, net->mod_weights, sizeof(pycann_float_t)*net->size);
+  memcpy(clone->mod_neurons, net->mod_neurons, sizeof(unsigned int)*net->size);
+  memcpy(clone->activation_functions, net->activation_functions, sizeof(pycann_activation_function_t)*net->size);
+  memcpy(clone->plastic, net->plastic, sizeof(unsigned char)*net->size);
+  clone->num_plastic = net->num_plastic;
+  if (pycann_set_update_mode(clone, net->update_mode)!=0) {
+    pycann_del(clone);
+    return NULL;
+  }
+#ifdef PYCANN_THREADING
+  if (pycann_set_schedule(clone, net->schedule, net->num_chunks/net->num_threads)!=0) {
+    pycann_del(clone);
+    return NULL;
+  }
+#endif /* PYCANN_THREADING */
+  pycann_set_stats_enabled(clone, net->stats_enabled);
+
+  return clone;
+}
+
+// Check if the network can be exported in the embedded format and get the
+// scale of fixed-point weights (weights are q/2^shift, q has 15 or 7 bits)
+static int pycann_embedded_scale(pycann_t *net, int format, unsigned int *shift) {
+  unsigned int i, j, n, k, bits, row_synapses, linear_synapses;
+  pycann_float_bits_t w;
+  pycann_float_t m;
+  double q, r, row_sum, linear_sum;
+
+  if (format!=PYCANN_EMBEDDED_NXT && format!=PYCANN_EMBEDDED_NXT_Q15 && format!=PYCANN_EMBEDDED_NXT_Q7) {
+    pycann_set_error("Invalid embedded format: %d\n", format);
+    return -1;
+  }
+  if (net->size>UINT16_MAX) {
+    pycann_set_error("Network too large for the embedded format: %u neurons\n", net->size);
+    return -1;
+  }
+  if (format==PYCANN_EMBEDDED_NXT) {
+    return 0;
+  }
+
+  // the device steps asynchronously with integer math only
+  if (pycann_can_learn(net)) {
+    pycann_set_error("Network learns, the fixed-point embedded format is inference only\n");
+    return -1;
+  }
+  for (i=0; i<net->size; i=i+1) {
+    if (net->activation_functions[i]!=PYCANN_SIGMOID_STEP && net->activation_functions[i]!=PYCANN_LINEAR) {
+      pycann_set_error("Activation function of neuron %u not supported by the fixed-point embedded format\n", i);
+      return -1;
+    }
+  }
+
+  // largest weight, number of synapses and the largest sum of the weights'
+  // magnitudes of a row (with its number of synapses), the latter also of
+  // linear neurons (input neurons aren't propagated)
+  m = 0.0;
+  n = 0;
+  row_sum = 0.0;
+  row_synapses = 0;
+  linear_sum = 0.0;
+  linear_synapses = 0;
+  for (i=net->num_inputs; i<net->size; i=i+1) {
+    r = 0.0;
+    k = 0;
+    for (j=0; j<net->size; j=j+1) {
+      // (checked on the bits, -ffast-math assumes finite math)
+      w.f = fabsf(pycann_get_weight(net, i, j));
+      if ((w.i&0x7f800000)==0x7f800000) {
+        pycann_set_error("Weight (%u, %u) is not finite\n", i, j);
+        return -1;
+      }
+      m = w.f>m?w.f:m;
+      r = r+w.f;
+      k = k+(w.f!=0.0);
+    }
+    n = n+k;
+    row_sum = r>row_sum?r:row_sum;
+    row_synapses = k>row_synapses?k:row_synapses;
+    if (net->activation_functions[i]==PYCANN_LINEAR) {
+      linear_sum = r>linear_sum?r:linear_sum;
+      linear_synapses = k>linear_synapses?k:linear_synapses;
+    }
+  }
+  if (n>UINT16_MAX) {
+    pycann_set_error("Too many synapses for the embedded format: %u\n", n);
+    return -1;
+  }
 
+  // finest scale the largest weight fits in, and in which the device's 32 bit
+  // net inputs can't overflow: a product of a weight and an activation
+  // (at most 2^PYCANN_EMBEDDED_ONE_BITS) is scaled back to at most the
+  // weight's magnitude, so a row sums to at most the sum of its rounded
+  // weights' magnitudes
+  bits = format==PYCANN_EMBEDDED_NXT_Q7?7:15;
+  *shift = PYCANN_EMBEDDED_MAX_SHIFT;
+  while (*shift>0 && (m*ldexp(1.0, *shift)+0.5>(double)((1<<bits)-1) || row_sum*ldexp(1.0, *shift)+0.5*row_synapses>(double)INT32_MAX)) {
+    *shift = *shift-1;
+  }
+  if (m+0.5>(double)((1<<bits)-1)) {
+    pycann_set_error("Weights too large for Q%u: %g\n", bits, m);
+    return -1;
+  }
+  if (row_sum+0.5*row_synapses>(double)INT32_MAX) {
+    pycann_set_error("Net inputs too large for the fixed-point embedded format: %g\n", row_sum);
+    return -1;
+  }
+  // linear neurons scale their net input up to activations if the scale is
+  // coarser than the activations'
+  if (*shift<PYCANN_EMBEDDED_ONE_BITS && (linear_sum*ldexp(1.0, *shift)+0.5*linear_synapses)*ldexp(1.0, PYCANN_EMBEDDED_ONE_BITS-*shift)>(double)INT32_MAX) {
+    pycann_set_error("Net inputs of linear neurons too large for the fixed-point embedded format: %g\n", linear_sum);
+    return -1;
+  }
+  for (i=0; i<net->size; i=i+1) {
+    w.f = net->thresholds[i];
+    q = fabs(net->thresholds[i])*ldexp(1.0, *shift);
+    if ((w.i&0x7f800000)==0x7f800000 || q+0.5>=(double)INT32_MAX) {
+      pycann_set_error("Threshold of neuron %u too large for the fixed-point embedded format: %g\n", i, net->thresholds[i]);
+      return -1;
+    }
+  }
   return 0;
 }
 
-// Exports into the pycann embedded format
+// Check if the network can be exported in the embedded format (sets the
+// error if not)
+int pycann_check_embedded(pycann_t *net, int format) {
+  unsigned int shift;
+
+  return pycann_embedded_scale(net, format, &shift);
+}
+
+// Write the network in the fixed-point embedded format (version 2): neurons
+// of non-input rows with a non-zero weight (after rounding) are listed in
+// CSR order, weights are q/2^shift with 16 bit (Q15) or 8 bit (Q7) q,
+// thresholds are 32 bit in the same scale
+static int pycann_export_embedded_fixed(FILE *fd, pycann_t *net, int format, unsigned int shift) {
+  unsigned int i, j, n;
+  uint16_t tmp, *rows, *columns;
+  int16_t *weights;
+  int8_t q7;
+  int32_t t;
+  double s;
+  long q;
+  int ok;
+
+  rows = malloc(sizeof(uint16_t)*(net->size+1));
+  columns = malloc(sizeof(uint16_t)*UINT16_MAX);
+  weights = malloc(sizeof(int16_t)*UINT16_MAX);
+  if (rows==NULL || columns==NULL || weights==NULL) {
+    free(rows);
+    free(columns);
+    free(weights);
+    pycann_set_error("Out of memory\n");
+    return -1;
+  }
+
+  // quantize, zero synapses are skipped
+  s = ldexp(1.0, shift);
+  n = 0;
+  for (i=0; i<net->size; i=i+1) {
+    rows[i] = n;
+    for (j=0; j<net->size && i>=net->num_inputs; j=j+1) {
+      q = lround(pycann_get_weight(net, i, j)*s);
+      if (q!=0) {
+        columns[n] = j;
+        weights[n] = q;
+        n = n+1;
+      }
+    }
+  }
+  rows[net->size] = n;
+
+  // header
+  ok = fwrite("RN", 1, 2, fd)==2 && fputc(PYCANN_EMBEDDED_VERSION_FIXED, fd)!=EOF;
+  tmp = net->size;
+  ok = ok && fwrite(&tmp, sizeof(tmp), 1, fd)==1;
+  tmp = net->num_inputs;
+  ok = ok && fwrite(&tmp, sizeof(tmp), 1, fd)==1;
+  tmp = net->num_outputs;
+  ok = ok && fwrite(&tmp, sizeof(tmp), 1, fd)==1;
+  ok = ok && fputc(format==PYCANN_EMBEDDED_NXT_Q7?7:15, fd)!=EOF && fputc(shift, fd)!=EOF;
+  tmp = n;
+  ok = ok && fwrite(&tmp, sizeof(tmp), 1, fd)==1;
+
+  // synapses
+  ok = ok && fwrite(rows, sizeof(uint16_t), net->size+1, fd)==net->size+1;
+  ok = ok && fwrite(columns, sizeof(uint16_t), n, fd)==n;
+  if (format==PYCANN_EMBEDDED_NXT_Q7) {
+    for (i=0; i<n && ok; i=i+1) {
+      q7 = weights[i];
+      ok = fwrite(&q7, sizeof(q7), 1, fd)==1;
+    }
+  }
+  else {
+    ok = ok && fwrite(weights, sizeof(int16_t), n, fd)==n;
+  }
+
+  // thresholds and activation functions
+  for (i=0; i<net->size && ok; i=i+1) {
+    t = lround(net->thresholds[i]*s);
+    ok = fwrite(&t, sizeof(t), 1, fd)==1;
+  }
+  for (i=0; i<net->size && ok; i=i+1) {
+    ok = fputc(net->activation_functions[i], fd)!=EOF;
+  }
+
+  free(rows);
+  free(columns);
+  free(weights);
+  return ok?0:-1;
+}
+
+// Exports into the pycann embedded format (see pycann_embedded_format_t)
 // File extension: .rnn
-// TODO export gamma and learning rate
+// TODO export gamma and learning rate (version 1)
 int pycann_export_embedded(const char *path, pycann_t *net, int format) {
   FILE *fd;
-  unsigned int i;
+  unsigned int i, j, shift;
   uint16_t tmp;
+  pycann_float_t w;
+  int ok;
 
-  // TODO check if net is exportable
-
-  // currently only NXT is supported
-  if (format!=PYCANN_EMBEDDED_NXT) {
+  if (pycann_embedded_scale(net, format, &shift)!=0) {
     return -1;
   }
 
@@ -630,33 +4231,52 @@ int pycann_export_embedded(const char *path, pycann_t *net, int format) {
     return -1;
   }
 
+  if (format!=PYCANN_EMBEDDED_NXT) {
+    ok = pycann_export_embedded_fixed(fd, net, format, shift)==0;
+    ok = fclose(fd)==0 && ok;
+    if (!ok) {
+      pycann_set_error("Can't write file: %s\n", path);
+      return -1;
+    }
+    return 0;
+  }
+
   // write signature
-  fwrite("RN", 1, 2, fd);
+  ok = fwrite("RN", 1, 2, fd)==2;
   // write format version
-  fputc(PYCANN_EMBEDDED_VERSION, fd);
+  ok = ok && fputc(PYCANN_EMBEDDED_VERSION, fd)!=EOF;
   // write network size
   tmp = net->size;
-  fwrite(&tmp, sizeof(tmp), 1, fd);
+  ok = ok && fwrite(&tmp, sizeof(tmp), 1, fd)==1;
   // write number of inputs
   tmp = net->num_inputs;
-  fwrite(&tmp, sizeof(tmp), 1, fd);
+  ok = ok && fwrite(&tmp, sizeof(tmp), 1, fd)==1;
   // write number of outputs
   tmp = net->num_outputs;
-  fwrite(&tmp, sizeof(tmp), 1, fd);
+  ok = ok && fwrite(&tmp, sizeof(tmp), 1, fd)==1;
   // write learning rate and gamma
-  fwrite(&net->learning_rate, sizeof(pycann_float_t), 1, fd);
+  ok = ok && fwrite(&net->learning_rate, sizeof(pycann_float_t), 1, fd)==1;
 
   // write gammas, thresholds and weights
-  fwrite(net->gammas, 4*sizeof(pycann_float_t), net->size, fd);
-  fwrite(net->weights, sizeof(pycann_float_t), net->size*net->size, fd);
-  fwrite(net->thresholds, sizeof(pycann_float_t), net->size, fd);
+  ok = ok && fwrite(net->gammas, 4*sizeof(pycann_float_t), net->size, fd)==net->size;
+  for (i=0; i<net->size && ok; i=i+1) {
+    for (j=0; j<net->size && ok; j=j+1) {
+      w = pycann_get_weight(net, i, j);
+      ok = fwrite(&w, sizeof(pycann_float_t), 1, fd)==1;
+    }
+  }
+  ok = ok && fwrite(net->thresholds, sizeof(pycann_float_t), net->size, fd)==net->size;
   // write activation functions
-  for (i=0; i<net->size; i=i+1) {
-    fputc(net->activation_functions[i], fd);
+  for (i=0; i<net->size && ok; i=i+1) {
+    ok = fputc(net->activation_functions[i], fd)!=EOF;
   }
 
   // clean up
-  fclose(fd);
+  ok = fclose(fd)==0 && ok;
+  if (!ok) {
+    pycann_set_error("Can't write file: %s\n", path);
+    return -1;
+  }
 
   return 0;
 }
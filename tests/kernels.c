@@ -0,0 +1,282 @@
+/*
+ pycann - Neural network library
+ A Python/C hybrid for fast neural networks in Python
+ Copyright (C) 2010  Janosch Gräf <janosch.graef@gmx.net>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Test of the vector kernels: every kernel of every kernel set the CPU
+// supports is compared with the scalar reference on random inputs of all
+// lengths up to a few vectors and some longer ones, so the tails are
+// covered. Vector kernels sum in another order, so results must agree up to
+// TEST_TOLERANCE times the sum of the magnitudes of the summed terms.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "pycann.h"
+#include "kernels.h"
+
+// Relative tolerance
+#define TEST_TOLERANCE 1e-5
+
+// Lengths are 0 upto (excluding) TEST_SHORT and the ones in test_lengths
+#define TEST_SHORT 68
+
+// Size of the buffers (at least the longest length plus an offset)
+#define TEST_MAX 1040
+
+static const unsigned int test_lengths[] = {127, 128, 129, 255, 256, 257, 1000, 1031};
+
+static const char *test_kernel_names[] = {"sse2", "avx2", "avx512"};
+
+static uint64_t test_state = 0x9e3779b97f4a7c15ULL;
+static unsigned int test_failures = 0;
+
+// 64 random bits (xorshift64*)
+static uint64_t test_random(void) {
+  test_state = test_state^(test_state>>12);
+  test_state = test_state^(test_state<<25);
+  test_state = test_state^(test_state>>27);
+  return test_state*0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in [-1, 1), every 8th value is 0 (like unconnected synapses)
+static pycann_float_t test_uniform(void) {
+  uint64_t r;
+
+  r = test_random();
+  if ((r&7)==0) {
+    return 0.0;
+  }
+  return (pycann_float_t)((int32_t)(r>>40)-8388608)*(1.0/8388608.0);
+}
+
+static void test_fill(pycann_float_t *x, unsigned int n) {
+  unsigned int j;
+
+  for (j=0; j<n; j=j+1) {
+    x[j] = test_uniform();
+  }
+}
+
+// Compare a result with the reference's, magnitude is the sum of the
+// magnitudes of the terms the result is made of
+static void test_check(const char *set, const char *kernel, unsigned int n, unsigned int k, double got, double expected, double magnitude) {
+  if (!(fabs(got-expected)<=TEST_TOLERANCE*magnitude)) {
+    if (test_failures<20) {
+      fprintf(stderr, "%s: %s n=%u [%u]: %.9g, expected %.9g\n", set, kernel, n, k, got, expected);
+    }
+    test_failures = test_failures+1;
+  }
+}
+
+// Length of test i
+static unsigned int test_length(unsigned int i) {
+  return i<TEST_SHORT?i:test_lengths[i-TEST_SHORT];
+}
+
+#define TEST_NUM_LENGTHS (TEST_SHORT+sizeof(test_lengths)/sizeof(test_lengths[0]))
+
+// dot, dot_sparse and their Hebbian versions (weights written back too)
+static void test_dot(const char *set, const pycann_kernels_t *ref, const pycann_kernels_t *vec) {
+  static pycann_float_t w[TEST_MAX], v[TEST_MAX], w_ref[TEST_MAX], w_vec[TEST_MAX];
+  static unsigned int c[TEST_MAX];
+  pycann_float_t g[4], u, m, o_ref, o_vec, dw;
+  unsigned int i, j, n, a;
+  double magnitude;
+
+  for (i=0; i<TEST_NUM_LENGTHS; i=i+1) {
+    n = test_length(i);
+    a = i%4; // misalign the weights
+    test_fill(w, TEST_MAX);
+    test_fill(v, TEST_MAX);
+    test_fill(g, 4);
+    u = test_uniform();
+    m = 0.01*test_uniform();
+    for (j=0; j<n; j=j+1) {
+      c[j] = test_random()%TEST_MAX;
+    }
+
+    // dense
+    magnitude = 0.0;
+    for (j=0; j<n; j=j+1) {
+      magnitude = magnitude+fabs(w[a+j]*v[j]);
+    }
+    test_check(set, "dot", n, 0, vec->dot(w+a, v, n), ref->dot(w+a, v, n), magnitude);
+
+    memcpy(w_ref, w, sizeof(w));
+    memcpy(w_vec, w, sizeof(w));
+    o_ref = ref->dot_hebbian(w_ref+a, v, n, g, u, m);
+    o_vec = vec->dot_hebbian(w_vec+a, v, n, g, u, m);
+    test_check(set, "dot_hebbian", n, 0, o_vec, o_ref, magnitude);
+    for (j=0; j<TEST_MAX; j=j+1) {
+      dw = j>=a && j<a+n?fabs(m)*(fabs(g[0]*u*v[j-a])+fabs(g[1]*v[j-a])+fabs(g[2]*u)+fabs(g[3])):0.0;
+      test_check(set, "dot_hebbian weights", n, j, w_vec[j], w_ref[j], j>=a && j<a+n?fabs(w[j])+dw:0.0);
+    }
+
+    // sparse
+    magnitude = 0.0;
+    for (j=0; j<n; j=j+1) {
+      magnitude = magnitude+fabs(w[a+j]*v[c[j]]);
+    }
+    test_check(set, "dot_sparse", n, 0, vec->dot_sparse(w+a, c, v, n), ref->dot_sparse(w+a, c, v, n), magnitude);
+
+    memcpy(w_ref, w, sizeof(w));
+    memcpy(w_vec, w, sizeof(w));
+    o_ref = ref->dot_hebbian_sparse(w_ref+a, c, v, n, g, u, m);
+    o_vec = vec->dot_hebbian_sparse(w_vec+a, c, v, n, g, u, m);
+    test_check(set, "dot_hebbian_sparse", n, 0, o_vec, o_ref, magnitude);
+    for (j=0; j<TEST_MAX; j=j+1) {
+      dw = j>=a && j<a+n?fabs(m)*(fabs(g[0]*u*v[c[j-a]])+fabs(g[1]*v[c[j-a]])+fabs(g[2]*u)+fabs(g[3])):0.0;
+      test_check(set, "dot_hebbian_sparse weights", n, j, w_vec[j], w_ref[j], j>=a && j<a+n?fabs(w[j])+dw:0.0);
+    }
+  }
+}
+
+// Quantized dot products
+static void test_dot_quantized(const char *set, const pycann_kernels_t *ref, const pycann_kernels_t *vec) {
+  static uint16_t h[TEST_MAX], b[TEST_MAX];
+  static int8_t q[TEST_MAX];
+  static pycann_float_t v[TEST_MAX];
+  unsigned int i, j, n, a;
+  double magnitude_h, magnitude_b, magnitude_q;
+
+  for (i=0; i<TEST_NUM_LENGTHS; i=i+1) {
+    n = test_length(i);
+    a = i%4;
+    test_fill(v, TEST_MAX);
+    for (j=0; j<TEST_MAX; j=j+1) {
+      h[j] = pycann_float_to_half(test_uniform());
+      b[j] = pycann_float_to_bf16(test_uniform());
+      q[j] = (int8_t)(test_random()%255-127);
+    }
+    magnitude_h = 0.0;
+    magnitude_b = 0.0;
+    magnitude_q = 0.0;
+    for (j=0; j<n; j=j+1) {
+      magnitude_h = magnitude_h+fabs(pycann_half_to_float(h[a+j])*v[j]);
+      magnitude_b = magnitude_b+fabs(pycann_bf16_to_float(b[a+j])*v[j]);
+      magnitude_q = magnitude_q+fabs(q[a+j]*v[j]);
+    }
+    test_check(set, "dot_f16", n, 0, vec->dot_f16(h+a, v, n), ref->dot_f16(h+a, v, n), magnitude_h);
+    test_check(set, "dot_bf16", n, 0, vec->dot_bf16(b+a, v, n), ref->dot_bf16(b+a, v, n), magnitude_b);
+    test_check(set, "dot_i8", n, 0, vec->dot_i8(q+a, v, n), ref->dot_i8(q+a, v, n), magnitude_q);
+  }
+}
+
+// axpy
+static void test_axpy(const char *set, const pycann_kernels_t *ref, const pycann_kernels_t *vec) {
+  static pycann_float_t x[TEST_MAX], o[TEST_MAX], o_ref[TEST_MAX], o_vec[TEST_MAX];
+  pycann_float_t w;
+  unsigned int i, j, n, a;
+
+  for (i=0; i<TEST_NUM_LENGTHS; i=i+1) {
+    n = test_length(i);
+    a = i%4;
+    test_fill(x, TEST_MAX);
+    test_fill(o, TEST_MAX);
+    w = test_uniform();
+    memcpy(o_ref, o, sizeof(o));
+    memcpy(o_vec, o, sizeof(o));
+    ref->axpy(o_ref+a, w, x, n);
+    vec->axpy(o_vec+a, w, x, n);
+    for (j=0; j<TEST_MAX; j=j+1) {
+      test_check(set, "axpy", n, j, o_vec[j], o_ref[j], j>=a && j<a+n?fabs(o[j])+fabs(w*x[j-a]):0.0);
+    }
+  }
+}
+
+// gemm and gemv, rows of gemv must not depend on the other rows
+static void test_gemm(const char *set, const pycann_kernels_t *ref, const pycann_kernels_t *vec) {
+  static const unsigned int rows_list[] = {1, 2, 3, 4, 5, 7, 8, 9, 17};
+  static const unsigned int n_list[] = {0, 1, 3, 7, 8, 15, 16, 17, 33, 100};
+  static const unsigned int nb_list[] = {1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33};
+  static pycann_float_t w[17*103], a[100*33], o[17*33], o_ref[17*33], o_vec[17*33], o_row[17];
+  unsigned int i, j, l, r, k, b, rows, n, nb, ldw;
+  double magnitude;
+
+  for (i=0; i<sizeof(rows_list)/sizeof(rows_list[0]); i=i+1) {
+    for (j=0; j<sizeof(n_list)/sizeof(n_list[0]); j=j+1) {
+      rows = rows_list[i];
+      n = n_list[j];
+      ldw = n+j%4;
+      test_fill(w, rows*ldw);
+
+      for (l=0; l<sizeof(nb_list)/sizeof(nb_list[0]); l=l+1) {
+        nb = nb_list[l];
+        test_fill(a, n*nb);
+        test_fill(o, rows*nb);
+        memcpy(o_ref, o, sizeof(pycann_float_t)*rows*nb);
+        memcpy(o_vec, o, sizeof(pycann_float_t)*rows*nb);
+        ref->gemm(o_ref, rows, w, ldw, a, n, nb);
+        vec->gemm(o_vec, rows, w, ldw, a, n, nb);
+        for (r=0; r<rows; r=r+1) {
+          for (b=0; b<nb; b=b+1) {
+            magnitude = fabs(o[r*nb+b]);
+            for (k=0; k<n; k=k+1) {
+              magnitude = magnitude+fabs(w[r*ldw+k]*a[k*nb+b]);
+            }
+            test_check(set, "gemm", n, r*nb+b, o_vec[r*nb+b], o_ref[r*nb+b], magnitude);
+          }
+        }
+      }
+
+      test_fill(a, n);
+      test_fill(o, rows);
+      memcpy(o_ref, o, sizeof(pycann_float_t)*rows);
+      memcpy(o_vec, o, sizeof(pycann_float_t)*rows);
+      memcpy(o_row, o, sizeof(pycann_float_t)*rows);
+      ref->gemv(o_ref, rows, w, ldw, a, n);
+      vec->gemv(o_vec, rows, w, ldw, a, n);
+      for (r=0; r<rows; r=r+1) {
+        vec->gemv(o_row+r, 1, w+r*ldw, ldw, a, n);
+        magnitude = fabs(o[r]);
+        for (k=0; k<n; k=k+1) {
+          magnitude = magnitude+fabs(w[r*ldw+k]*a[k]);
+        }
+        test_check(set, "gemv", n, r, o_vec[r], o_ref[r], magnitude);
+        test_check(set, "gemv single row", n, r, o_row[r], o_vec[r], 0.0);
+      }
+    }
+  }
+}
+
+int main(void) {
+  unsigned int i, failures;
+
+  for (i=0; i<sizeof(test_kernel_names)/sizeof(test_kernel_names[0]); i=i+1) {
+    if (pycann_kernels_select(test_kernel_names[i])!=0) {
+      printf("%s: not supported, skipped\n", test_kernel_names[i]);
+      continue;
+    }
+    failures = test_failures;
+    test_dot(test_kernel_names[i], &pycann_kernels_scalar, pycann_kernels);
+    test_dot_quantized(test_kernel_names[i], &pycann_kernels_scalar, pycann_kernels);
+    test_axpy(test_kernel_names[i], &pycann_kernels_scalar, pycann_kernels);
+    test_gemm(test_kernel_names[i], &pycann_kernels_scalar, pycann_kernels);
+    printf("%s: %s\n", test_kernel_names[i], test_failures==failures?"ok":"FAILED");
+  }
+  pycann_kernels_select("auto");
+
+  if (test_failures>0) {
+    fprintf(stderr, "%u results beyond the tolerance\n", test_failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ pycann - Neural network library
+ A Python/C hybrid for fast neural networks in Python
+ Copyright (C) 2010  Janosch Gräf <janosch.graef@gmx.net>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Test of the approximate sigmoid: the sigmoid kernel of every kernel set
+// the CPU supports and the inline pycann_sigmoid_approx must be within
+// PYCANN_SIGMOID_APPROX_ERROR of 1/(1+exp(PYCANN_SIGMOID_BETA*x)) over the
+// whole range of x the exponent is clamped to, its edges and beyond.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+
+#include "pycann.h"
+#include "kernels.h"
+
+// Number of evenly spaced values of x (odd, so the kernels' tails are used)
+#define TEST_SWEEP 2000001
+
+// x beyond the clamped range swept, in multiples of the range
+#define TEST_SWEEP_RANGE 1.25
+
+// Number of floats next to an edge tested on each side
+#define TEST_EDGE_ULPS 16
+
+static const char *test_kernel_names[] = {"scalar", "sse2", "avx2", "avx512"};
+
+// 1/(1+exp(PYCANN_SIGMOID_BETA*x)) in double precision, without overflow
+static double test_sigmoid(pycann_float_t x) {
+  double e;
+
+  if (x>0.0) {
+    e = exp(-(double)PYCANN_SIGMOID_BETA*x);
+    return e/(1.0+e);
+  }
+  return 1.0/(1.0+exp((double)PYCANN_SIGMOID_BETA*x));
+}
+
+// Append x and the floats next to it
+static unsigned int test_add_edge(pycann_float_t *x, unsigned int n, pycann_float_t edge) {
+  pycann_float_t up, down;
+  unsigned int k;
+
+  x[n] = edge;
+  n = n+1;
+  up = edge;
+  down = edge;
+  for (k=0; k<TEST_EDGE_ULPS; k=k+1) {
+    up = nextafterf(up, FLT_MAX);
+    down = nextafterf(down, -FLT_MAX);
+    x[n] = up;
+    x[n+1] = down;
+    n = n+2;
+  }
+  return n;
+}
+
+// Check y against the reference, returns the number of failures
+static unsigned int test_check(const char *what, const pycann_float_t *x, const pycann_float_t *y, unsigned int n, double *max_error) {
+  unsigned int j, failures;
+  double e;
+
+  failures = 0;
+  for (j=0; j<n; j=j+1) {
+    e = fabs((double)y[j]-test_sigmoid(x[j]));
+    *max_error = e>*max_error?e:*max_error;
+    if (!(e<=PYCANN_SIGMOID_APPROX_ERROR)) {
+      if (failures<10) {
+        fprintf(stderr, "%s: x=%.9g: %.9g, expected %.9g (error %.3g)\n", what, x[j], y[j], test_sigmoid(x[j]), e);
+      }
+      failures = failures+1;
+    }
+  }
+  return failures;
+}
+
+int main(void) {
+  pycann_float_t *x, *y, edge;
+  unsigned int i, j, n, m, failures;
+  double max_error;
+
+  // the edges of the clamp range, the points where the integer part of z
+  // changes (fraction +-0.5) and an evenly spaced sweep
+  edge = PYCANN_EXP2_LIMIT/PYCANN_SIGMOID_SCALE;
+  m = 2*(unsigned int)PYCANN_EXP2_LIMIT+1;
+  x = malloc(sizeof(pycann_float_t)*(TEST_SWEEP+(2*m+4)*(2*TEST_EDGE_ULPS+1)));
+  y = malloc(sizeof(pycann_float_t)*(TEST_SWEEP+(2*m+4)*(2*TEST_EDGE_ULPS+1)));
+  if (x==NULL || y==NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  n = 0;
+  n = test_add_edge(x, n, edge);
+  n = test_add_edge(x, n, -edge);
+  n = test_add_edge(x, n, 0.0);
+  for (j=0; j<m; j=j+1) {
+    n = test_add_edge(x, n, ((pycann_float_t)j-PYCANN_EXP2_LIMIT-0.5)/PYCANN_SIGMOID_SCALE);
+    n = test_add_edge(x, n, ((pycann_float_t)j-PYCANN_EXP2_LIMIT+0.5)/PYCANN_SIGMOID_SCALE);
+  }
+  for (j=0; j<TEST_SWEEP; j=j+1) {
+    x[n] = TEST_SWEEP_RANGE*edge*(2.0*j/(TEST_SWEEP-1)-1.0);
+    n = n+1;
+  }
+
+  failures = 0;
+
+  // inline scalar version
+  max_error = 0.0;
+  for (j=0; j<n; j=j+1) {
+    y[j] = pycann_sigmoid_approx(x[j]);
+  }
+  failures = failures+test_check("pycann_sigmoid_approx", x, y, n, &max_error);
+  printf("pycann_sigmoid_approx: max error %.3g (%u values)\n", max_error, n);
+
+  // sigmoid kernel of every supported kernel set
+  for (i=0; i<sizeof(test_kernel_names)/sizeof(test_kernel_names[0]); i=i+1) {
+    if (pycann_kernels_select(test_kernel_names[i])!=0) {
+      printf("%s: not supported, skipped\n", test_kernel_names[i]);
+      continue;
+    }
+    max_error = 0.0;
+    pycann_kernels->sigmoid(y, x, n);
+    failures = failures+test_check(test_kernel_names[i], x, y, n, &max_error);
+    printf("%s: max error %.3g (%u values)\n", test_kernel_names[i], max_error, n);
+  }
+  pycann_kernels_select("auto");
+
+  free(x);
+  free(y);
+  if (failures>0) {
+    fprintf(stderr, "%u values beyond PYCANN_SIGMOID_APPROX_ERROR\n", failures);
+    return 1;
+  }
+  return 0;
+}
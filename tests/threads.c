@@ -0,0 +1,150 @@
+/*
+ pycann - Neural network library
+ A Python/C hybrid for fast neural networks in Python
+ Copyright (C) 2010  Janosch Gräf <janosch.graef@gmx.net>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Test of synchronous updates being deterministic: with every kernel set the
+// CPU supports, every storage engine and both schedules, networks stepped by
+// 2 to TEST_MAX_THREADS threads must end up with bitwise the same activations
+// as with a single thread. The activation functions alternate in blocks of
+// odd length, so the runs and the partitions cut vectors anywhere.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pycann.h"
+#include "kernels.h"
+
+// Steps per network
+#define TEST_STEPS 50
+
+#define TEST_MAX_THREADS 5
+
+#define TEST_INPUTS 7
+
+static const unsigned int test_sizes[] = {157, 203};
+
+static const char *test_kernel_names[] = {"scalar", "sse2", "avx2", "avx512"};
+
+static const pycann_storage_t test_storages[] = {PYCANN_STORAGE_DENSE, PYCANN_STORAGE_SPARSE, PYCANN_STORAGE_FP16, PYCANN_STORAGE_BF16, PYCANN_STORAGE_INT8};
+
+static const char *test_storage_names[] = {"dense", "sparse", "fp16", "bf16", "int8"};
+
+static const pycann_activation_function_t test_functions[] = {PYCANN_SIGMOID_APPROX, PYCANN_SIGMOID_EXP, PYCANN_SIGMOID_APPROX, PYCANN_LINEAR};
+
+// Step a new network with num_threads threads and get its activations.
+// Networks with dense or sparse storage learn, if learn is set.
+static int test_run(unsigned int size, unsigned int num_threads, unsigned int s, pycann_schedule_t schedule, int learn, pycann_float_t *activations) {
+  pycann_float_t inputs[TEST_INPUTS], gamma[4];
+  pycann_t *net;
+  unsigned int i;
+
+  net = pycann_new_ex(size, TEST_INPUTS, 3, num_threads, 0);
+  if (net==NULL) {
+    fprintf(stderr, "%s", pycann_get_error());
+    return -1;
+  }
+  pycann_set_seed(net, size);
+  if (pycann_set_random_weights_ex(net, 0.4, PYCANN_RANDOM_NORMAL, 2.0, PYCANN_RANDOM_FAN_IN)!=0
+      || pycann_set_update_mode(net, PYCANN_UPDATE_SYNC)!=0
+      || pycann_set_schedule(net, schedule, 3)!=0
+      || pycann_set_storage(net, test_storages[s])!=0) {
+    fprintf(stderr, "%s", pycann_get_error());
+    pycann_del(net);
+    return -1;
+  }
+  for (i=0; i<size; i=i+1) {
+    pycann_set_activation_function(net, i, test_functions[(i/13)%4]);
+    pycann_set_threshold(net, i, 0.01*(pycann_float_t)(i%11)-0.05);
+    if (learn && i>=TEST_INPUTS) {
+      gamma[0] = 0.01;
+      gamma[1] = -0.005;
+      gamma[2] = 0.002;
+      gamma[3] = 0.0;
+      pycann_set_gamma(net, i, gamma);
+      pycann_set_mod(net, i, (i*7)%size, 0.5);
+    }
+  }
+  for (i=0; i<TEST_INPUTS; i=i+1) {
+    inputs[i] = 0.3*(pycann_float_t)i-1.0;
+  }
+  pycann_set_inputs(net, inputs);
+  pycann_step(net, TEST_STEPS);
+  pycann_get_activations(net, activations);
+  pycann_del(net);
+  return 0;
+}
+
+int main(void) {
+  pycann_float_t *expected, *got;
+  unsigned int i, k, s, n, t, c, failures;
+  pycann_schedule_t schedule;
+  int learn;
+
+  if (!pycann_is_threading_enabled()) {
+    printf("threading disabled, skipped\n");
+    return 0;
+  }
+
+  expected = malloc(sizeof(pycann_float_t)*test_sizes[1]);
+  got = malloc(sizeof(pycann_float_t)*test_sizes[1]);
+  if (expected==NULL || got==NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  failures = 0;
+  for (i=0; i<sizeof(test_kernel_names)/sizeof(test_kernel_names[0]); i=i+1) {
+    if (pycann_kernels_select(test_kernel_names[i])!=0) {
+      printf("%s: not supported, skipped\n", test_kernel_names[i]);
+      continue;
+    }
+    c = failures;
+    for (k=0; k<sizeof(test_sizes)/sizeof(test_sizes[0]); k=k+1) {
+      for (s=0; s<sizeof(test_storages)/sizeof(test_storages[0]); s=s+1) {
+        for (schedule=PYCANN_SCHEDULE_STATIC; schedule<=PYCANN_SCHEDULE_DYNAMIC; schedule=schedule+1) {
+          for (learn=0; learn<=(test_storages[s]<=PYCANN_STORAGE_SPARSE); learn=learn+1) {
+            if (test_run(test_sizes[k], 1, s, schedule, learn, expected)!=0) {
+              return 1;
+            }
+            for (t=2; t<=TEST_MAX_THREADS; t=t+1) {
+              if (test_run(test_sizes[k], t, s, schedule, learn, got)!=0) {
+                return 1;
+              }
+              if (memcmp(expected, got, sizeof(pycann_float_t)*test_sizes[k])!=0) {
+                for (n=0; n<test_sizes[k] && memcmp(expected+n, got+n, sizeof(pycann_float_t))==0; n=n+1);
+                fprintf(stderr, "%s: size %u, %s, %s schedule%s: %u threads differ first at neuron %u (%.9g, expected %.9g)\n", test_kernel_names[i], test_sizes[k], test_storage_names[s], schedule==PYCANN_SCHEDULE_STATIC?"static":"dynamic", learn?", learning":"", t, n, got[n], expected[n]);
+                failures = failures+1;
+              }
+            }
+          }
+        }
+      }
+    }
+    printf("%s: %s\n", test_kernel_names[i], failures==c?"ok":"FAILED");
+  }
+  pycann_kernels_select("auto");
+
+  free(expected);
+  free(got);
+  if (failures>0) {
+    fprintf(stderr, "%u networks depend on the number of threads\n", failures);
+    return 1;
+  }
+  return 0;
+}